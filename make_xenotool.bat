@@ -1,5 +1,5 @@
 @echo off
 if not exist bin ( mkdir bin )
 cls
-gcc -std=c11 -fno-omit-frame-pointer -Wall -Wpedantic -static-libgcc -ggdb -o ./bin/xenotool.exe ./src/xenotool.c ./src/xeno_lex.c ./src/xeno_xtx.c ./src/xeno_arx.c ./src/xeno_jnt.c ./src/xenodebug.c
+gcc -std=c11 -fno-omit-frame-pointer -Wall -Wpedantic -static-libgcc -ggdb -o ./bin/xenotool.exe ./src/xenotool.c ./src/xeno_lex.c ./src/xeno_xtx.c ./src/xeno_arx.c ./src/xeno_jnt.c ./src/xeno_vif.c ./src/xeno_model.c ./src/xeno_obj.c ./src/xeno_png.c ./src/xeno_ktx.c ./src/xeno_bc.c ./src/xeno_mip.c ./src/xeno_gs.c ./src/xeno_meshopt.c ./src/xeno_vcache.c ./src/xenodebug.c
 REM gcc -std=c11 -fno-omit-frame-pointer -Wall -Wpedantic -static-libgcc -ggdb -o ./bin/xenotool.exe ./src/xenotool.c ./src/xeno_lex.c ./src/xeno_xtx.c ./src/xenodebug.c -lduma
\ No newline at end of file
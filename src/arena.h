@@ -0,0 +1,97 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bump allocator for short lived parse state. Nothing is freed on its own;
+// arena_reset releases every allocation at once in O(1) and keeps the
+// blocks around for the next file, arena_cleanup gives them back.
+// Not thread safe, allocate everything workers need up front.
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+} arena_block;
+
+typedef struct {
+    arena_block *first;
+    arena_block *cur;
+    size_t block_size;
+} arena;
+
+arena arena_init(size_t block_size);
+void arena_cleanup(arena *a);
+void arena_reset(arena *a);
+void *arena_alloc(arena *a, size_t size);
+void *arena_calloc(arena *a, size_t count, size_t size);
+#endif
+
+#ifdef ARENA_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_HEADER ((sizeof(arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+arena arena_init(size_t block_size) {
+    return (arena){.first = NULL, .cur = NULL, .block_size = block_size};
+}
+
+void arena_cleanup(arena *a) {
+    if(!a) return;
+    arena_block *b = a->first;
+    while(b) {
+        arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    *a = arena_init(a->block_size);
+}
+
+void arena_reset(arena *a) {
+    if(!a) return;
+    a->cur = NULL;
+}
+
+void *arena_alloc(arena *a, size_t size) {
+    if(!a || size > SIZE_MAX - ARENA_HEADER - ARENA_ALIGN) return NULL;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if(!size) size = ARENA_ALIGN;
+    arena_block *b = a->cur;
+    if(!b || b->size - b->used < size) {
+        // blocks after cur are left over from before the last reset
+        arena_block *next = b ? b->next : a->first;
+        if(next && next->size >= size) {
+            b = next;
+        } else {
+            size_t capacity = size > a->block_size ? size : a->block_size;
+            arena_block *nb = malloc(ARENA_HEADER + capacity);
+            if(!nb) return NULL;
+            nb->size = capacity;
+            nb->next = next;
+            if(b) {
+                b->next = nb;
+            } else {
+                a->first = nb;
+            }
+            b = nb;
+        }
+        b->used = 0;
+        a->cur = b;
+    }
+    void *p = (uint8_t*)b + ARENA_HEADER + b->used;
+    b->used += size;
+    return p;
+}
+
+void *arena_calloc(arena *a, size_t count, size_t size) {
+    if(size && count > SIZE_MAX / size) return NULL;
+    void *p = arena_alloc(a, count * size);
+    if(p) memset(p, 0, count * size);
+    return p;
+}
+
+#undef ARENA_IMPLEMENTATION
+#endif
@@ -0,0 +1,155 @@
+#ifndef HASHIDX_H
+#define HASHIDX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vector.h"
+
+// Open-addressing hash index over the elements of a vector.
+// Elements are compared bytewise like vector_find, so hashidx_push_unique_i
+// gives the same indices as vector_push_unique_i in O(1) amortized time,
+// as long as every push to the vector goes through the index.
+// hashidx_find_eq and hashidx_insert work on any storage: the caller hashes
+// the value and eq compares it to the element stored at index i.
+typedef bool (*hashidx_eq)(const void *ctx, size_t i, const void *val);
+
+typedef struct {
+    uint64_t hash;
+    size_t i;
+} hashidx_slot;
+
+typedef struct {
+    hashidx_slot *slot;
+    size_t capacity;
+    size_t length;
+} hashidx;
+
+hashidx hashidx_init();
+void hashidx_cleanup(hashidx *h);
+uint64_t hashidx_hash(const void *val, size_t size);
+bool hashidx_find(hashidx *h, vector *v, const void *val, size_t *dst);
+bool hashidx_push_unique_i(hashidx *h, vector *v, const void *val, size_t *i);
+bool hashidx_find_eq(hashidx *h, uint64_t hash, hashidx_eq eq, const void *ctx, const void *val, size_t *dst);
+bool hashidx_insert(hashidx *h, uint64_t hash, size_t i);
+#endif
+
+#ifdef HASHIDX_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HASHIDX_EMPTY SIZE_MAX
+
+hashidx hashidx_init() {
+    return (hashidx){.slot = NULL, .capacity = 0, .length = 0};
+}
+
+void hashidx_cleanup(hashidx *h) {
+    if(!h) return;
+    free(h->slot);
+    *h = hashidx_init();
+}
+
+uint64_t hashidx_hash(const void *val, size_t size) {
+    const uint8_t *p = val;
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ size;
+    while(size >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+        p += 8;
+        size -= 8;
+    }
+    if(size) {
+        uint64_t w = 0;
+        memcpy(&w, p, size);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+    }
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static bool hashidx_grow(hashidx *h) {
+    size_t capacity = h->capacity ? h->capacity * 2 : 256;
+    hashidx_slot *slot = malloc(capacity * sizeof(hashidx_slot));
+    if(!slot) return false;
+    for(size_t i = 0; i < capacity; ++i) slot[i].i = HASHIDX_EMPTY;
+    for(size_t i = 0; i < h->capacity; ++i) {
+        if(h->slot[i].i == HASHIDX_EMPTY) continue;
+        size_t k = h->slot[i].hash & (capacity - 1);
+        while(slot[k].i != HASHIDX_EMPTY) k = (k + 1) & (capacity - 1);
+        slot[k] = h->slot[i];
+    }
+    free(h->slot);
+    h->slot = slot;
+    h->capacity = capacity;
+    return true;
+}
+
+// returns the slot holding val, or the empty slot where it would go
+static size_t hashidx_probe(hashidx *h, vector *v, const void *val, uint64_t hash) {
+    size_t k = hash & (h->capacity - 1);
+    while(h->slot[k].i != HASHIDX_EMPTY) {
+        if(h->slot[k].hash == hash) {
+            void *p = (char*)v->p + (v->size * h->slot[k].i);
+            if(memcmp(p, val, v->size) == 0) return k;
+        }
+        k = (k + 1) & (h->capacity - 1);
+    }
+    return k;
+}
+
+bool hashidx_find(hashidx *h, vector *v, const void *val, size_t *dst) {
+    if(!h || !v || !val || !h->capacity) return false;
+    size_t k = hashidx_probe(h, v, val, hashidx_hash(val, v->size));
+    if(h->slot[k].i == HASHIDX_EMPTY) return false;
+    if(dst) *dst = h->slot[k].i;
+    return true;
+}
+
+bool hashidx_push_unique_i(hashidx *h, vector *v, const void *val, size_t *i) {
+    if(!h || !v || !val) return false;
+    if((h->length + 1) * 2 > h->capacity && !hashidx_grow(h)) return false;
+    uint64_t hash = hashidx_hash(val, v->size);
+    size_t k = hashidx_probe(h, v, val, hash);
+    if(h->slot[k].i != HASHIDX_EMPTY) {
+        *i = h->slot[k].i;
+        return true;
+    }
+    if(!vector_push_i(v, val, i)) return false;
+    h->slot[k] = (hashidx_slot){.hash = hash, .i = *i};
+    ++h->length;
+    return true;
+}
+
+bool hashidx_find_eq(hashidx *h, uint64_t hash, hashidx_eq eq, const void *ctx, const void *val, size_t *dst) {
+    if(!h || !eq || !h->capacity) return false;
+    size_t k = hash & (h->capacity - 1);
+    while(h->slot[k].i != HASHIDX_EMPTY) {
+        if(h->slot[k].hash == hash && eq(ctx, h->slot[k].i, val)) {
+            if(dst) *dst = h->slot[k].i;
+            return true;
+        }
+        k = (k + 1) & (h->capacity - 1);
+    }
+    return false;
+}
+
+// adds index i without checking for duplicates
+bool hashidx_insert(hashidx *h, uint64_t hash, size_t i) {
+    if(!h) return false;
+    if((h->length + 1) * 2 > h->capacity && !hashidx_grow(h)) return false;
+    size_t k = hash & (h->capacity - 1);
+    while(h->slot[k].i != HASHIDX_EMPTY) k = (k + 1) & (h->capacity - 1);
+    h->slot[k] = (hashidx_slot){.hash = hash, .i = i};
+    ++h->length;
+    return true;
+}
+
+#undef HASHIDX_IMPLEMENTATION
+#endif
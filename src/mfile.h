@@ -0,0 +1,144 @@
+#ifndef MFILE_H
+#define MFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Read-only memory mapped file with a bounds checked cursor.
+// Copies made with mfile_view share the mapping but have their own cursor
+// and bounds; only the mfile returned by mfile_open owns the mapping.
+typedef struct {
+    const char *name;
+    const uint8_t *p;
+    size_t size;
+    size_t pos;
+    bool owner;
+} mfile;
+
+bool mfile_open(mfile *f, const char *filename);
+void mfile_close(mfile *f);
+mfile mfile_view(const mfile *f, size_t offset, size_t size);
+bool mfile_read(mfile *f, void *dst, size_t size);
+const void *mfile_get_ptr(mfile *f, size_t size);
+bool mfile_skip(mfile *f, size_t size);
+bool mfile_seek(mfile *f, size_t pos);
+size_t mfile_tell(const mfile *f);
+size_t mfile_remaining(const mfile *f);
+bool mfile_eof(const mfile *f);
+#endif
+
+#ifdef MFILE_IMPLEMENTATION
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+bool mfile_open(mfile *f, const char *filename) {
+    *f = (mfile){.name = filename};
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        return false;
+    }
+    f->size = size.QuadPart;
+    if(f->size) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if(mapping) {
+            f->p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+#else
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+    f->size = st.st_size;
+    if(f->size) {
+        void *p = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        f->p = (p == MAP_FAILED) ? NULL : p;
+    }
+    close(fd);
+#endif
+    if(f->size && !f->p) {
+        *f = (mfile){0};
+        return false;
+    }
+    f->owner = true;
+    return true;
+}
+
+void mfile_close(mfile *f) {
+    if(!f) return;
+    if(f->owner && f->p) {
+#ifdef _WIN32
+        UnmapViewOfFile(f->p);
+#else
+        munmap((void*)f->p, f->size);
+#endif
+    }
+    *f = (mfile){0};
+}
+
+mfile mfile_view(const mfile *f, size_t offset, size_t size) {
+    mfile ret = {.name = f->name};
+    if(offset > f->size) offset = f->size;
+    if(size > f->size - offset) size = f->size - offset;
+    ret.p = f->p + offset;
+    ret.size = size;
+    return ret;
+}
+
+bool mfile_read(mfile *f, void *dst, size_t size) {
+    const void *src = mfile_get_ptr(f, size);
+    if(!src) return false;
+    memcpy(dst, src, size);
+    return true;
+}
+
+const void *mfile_get_ptr(mfile *f, size_t size) {
+    if(size > f->size - f->pos) return NULL;
+    const void *ret = f->p + f->pos;
+    f->pos += size;
+    return ret;
+}
+
+bool mfile_skip(mfile *f, size_t size) {
+    return mfile_get_ptr(f, size) != NULL;
+}
+
+bool mfile_seek(mfile *f, size_t pos) {
+    if(pos > f->size) return false;
+    f->pos = pos;
+    return true;
+}
+
+size_t mfile_tell(const mfile *f) {
+    return f->pos;
+}
+
+size_t mfile_remaining(const mfile *f) {
+    return f->size - f->pos;
+}
+
+bool mfile_eof(const mfile *f) {
+    return f->pos >= f->size;
+}
+
+#undef MFILE_IMPLEMENTATION
+#endif
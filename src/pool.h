@@ -0,0 +1,121 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// Minimal worker pool: pool_run calls fn(ctx, job, worker) for every job in
+// [0, jobs) on up to `threads` threads and returns when all jobs are done.
+// `worker` is in [0, threads) and can be used to index per-thread scratch.
+// Jobs are handed out in increasing order; with threads <= 1 everything runs
+// on the calling thread.
+typedef void (*pool_fn)(void *ctx, size_t job, size_t worker);
+
+void pool_run(size_t jobs, size_t threads, pool_fn fn, void *ctx);
+size_t pool_cpu_count();
+#endif
+
+#ifdef POOL_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+typedef struct {
+    pool_fn fn;
+    void *ctx;
+    size_t jobs;
+    atomic_size_t next;
+} pool_state;
+
+typedef struct {
+    pool_state *state;
+    size_t worker;
+} pool_worker;
+
+static void pool_work(pool_worker *w) {
+    pool_state *s = w->state;
+    while(true) {
+        size_t job = atomic_fetch_add(&s->next, 1);
+        if(job >= s->jobs) break;
+        s->fn(s->ctx, job, w->worker);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI pool_thread(LPVOID arg) {
+    pool_work(arg);
+    return 0;
+}
+#else
+static void *pool_thread(void *arg) {
+    pool_work(arg);
+    return NULL;
+}
+#endif
+
+void pool_run(size_t jobs, size_t threads, pool_fn fn, void *ctx) {
+    if(threads > jobs) threads = jobs;
+    pool_state state = {.fn = fn, .ctx = ctx, .jobs = jobs};
+    atomic_init(&state.next, 0);
+    pool_worker *w = NULL;
+#ifdef _WIN32
+    HANDLE *t = NULL;
+#else
+    pthread_t *t = NULL;
+#endif
+    if(threads > 1) {
+        w = malloc(threads * sizeof(*w));
+        t = malloc(threads * sizeof(*t));
+    }
+    if(!w || !t) {
+        // one worker, or no memory for threads: the calling thread does all jobs
+        free(w);
+        free(t);
+        pool_worker w0 = {.state = &state, .worker = 0};
+        pool_work(&w0);
+        return;
+    }
+    for(size_t i = 0; i < threads; ++i) w[i] = (pool_worker){.state = &state, .worker = i};
+    // the calling thread works as worker 0
+    size_t started = 1;
+    for(; started < threads; ++started) {
+#ifdef _WIN32
+        t[started] = CreateThread(NULL, 0, pool_thread, &w[started], 0, NULL);
+        if(!t[started]) break;
+#else
+        if(pthread_create(&t[started], NULL, pool_thread, &w[started])) break;
+#endif
+    }
+    pool_work(&w[0]);
+    for(size_t i = 1; i < started; ++i) {
+#ifdef _WIN32
+        WaitForSingleObject(t[i], INFINITE);
+        CloseHandle(t[i]);
+#else
+        pthread_join(t[i], NULL);
+#endif
+    }
+    free(t);
+    free(w);
+}
+
+size_t pool_cpu_count() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors ? info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+#endif
+}
+
+#undef POOL_IMPLEMENTATION
+#endif
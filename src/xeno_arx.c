@@ -3,8 +3,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include "arx_file.h"
+#include "mfile.h"
+
+#define ARX_LUT_LEN (sizeof(((ARXHeader*)0)->lut) / sizeof(uint32_t))
 
 void print_u64b(uint64_t b) {
     for(int i = 0; i < 64; ++i) {
@@ -22,15 +26,141 @@ void print_u32b(uint32_t b) {
     puts("");
 }
 
-size_t uncompress_arx(char *filename, void **out) {
-    FILE *fp = fopen(filename, "rb");
-    if(!fp) return 0;
+static uint32_t read_u32(const uint8_t *p) {
+    uint32_t val;
+    memcpy(&val, p, sizeof(uint32_t));
+    return val;
+}
+
+// The stream is a sequence of 32-bit control words, each followed by the
+// literal words its bits refer to. A 0 bit copies the next literal word, a 1
+// bit is a marker followed by a LUT code:
+//   0x       -> lut[x]            (2 bits)
+//   10xx     -> lut[2 + xx]       (4 bits)
+//   110xxx   -> lut[6 + xxx]      (6 bits)
+//   111xxxxx -> lut[14 + xxxxx]   (8 bits)
+// arx_codes[] is indexed by the top 9 control bits and gives the number of
+// bits the next token uses and the LUT index it selects. Literals use
+// the ARX_LITERAL slot past the LUT, markers pointing past the LUT have
+// len 0.
+#define ARX_LITERAL ARX_LUT_LEN
+typedef struct {
+    uint8_t len;
+    uint8_t idx;
+} ARXCode;
+
+static void arx_build_codes(ARXCode *codes) {
+    for(uint32_t b = 0; b < 512; ++b) {
+        uint32_t len, idx;
+        if(!(b & 0x100)) {
+            codes[b] = (ARXCode){.len = 1, .idx = ARX_LITERAL};
+            continue;
+        } else if(!(b & 0x80)) {
+            len = 2;
+            idx = (b >> 6) & 0x1;
+        } else if(!(b & 0x40)) {
+            len = 4;
+            idx = 2 + ((b >> 4) & 0x3);
+        } else if(!(b & 0x20)) {
+            len = 6;
+            idx = 6 + ((b >> 2) & 0x7);
+        } else {
+            len = 8;
+            idx = 14 + (b & 0x1f);
+        }
+        codes[b].len = (idx >= ARX_LUT_LEN) ? 0 : len + 1;
+        codes[b].idx = idx;
+    }
+}
+
+size_t uncompress_arx_mem(const uint8_t *src, size_t len, void **out) {
+    *out = NULL;
+    if(len < sizeof(ARXHeader)) return 0;
+    ARXHeader h;
+    memcpy(&h, src, sizeof(ARXHeader));
+    size_t words = ((size_t)h.size_orig + 3) / 4;
+    *out = calloc(words ? words : 1, sizeof(uint32_t));
+    if(!*out) return 0;
+
+    ARXCode codes[512];
+    arx_build_codes(codes);
+    // one extra slot so literals can go through the same select
+    uint32_t lut[ARX_LUT_LEN + 1];
+    memcpy(lut, h.lut, sizeof(h.lut));
+
+    const uint8_t *ip = src + sizeof(ARXHeader);
+    const uint8_t *end = src + len;
+    uint32_t *o = *out;
+    uint32_t *oend = o + words;
+    // control bits are kept left-aligned, everything below buf_len is zero
+    uint64_t buf = 0;
+    uint32_t buf_len = 0;
+    while(o < oend) {
+        // fast path: bits below buf_len are zero, so a token that doesn't fit
+        // gets a len past buf_len. Zero padding can't make a valid code look
+        // like one past the LUT, the bit that puts it there must be present.
+        while(end - ip >= 4 && o < oend) {
+            ARXCode c = codes[buf >> 55];
+            if(!c.len) goto BAD_INDEX;
+            if(c.len > buf_len) break;
+            lut[ARX_LITERAL] = read_u32(ip);
+            *o++ = lut[c.idx];
+            ip += (c.idx == ARX_LITERAL) * sizeof(uint32_t);
+            buf <<= c.len;
+            buf_len -= c.len;
+        }
+        if(o >= oend) break;
+        if(!buf_len) {
+            if(end - ip < 4) break;
+            buf = (uint64_t)read_u32(ip) << 32;
+            ip += 4;
+            buf_len = 32;
+            continue;
+        }
+        if(!(buf >> 63)) {
+            if(end - ip < 4) break;
+            *o++ = read_u32(ip);
+            ip += 4;
+            buf <<= 1;
+            --buf_len;
+            continue;
+        }
+        ARXCode c = codes[buf >> 55];
+        if(c.len > buf_len) {
+            // the code continues in the next control word, no literals are pending
+            if(end - ip < 4) break;
+            buf |= (uint64_t)read_u32(ip) << (32 - buf_len);
+            ip += 4;
+            buf_len += 32;
+            continue;
+        }
+        if(!c.len) goto BAD_INDEX;
+        *o++ = lut[c.idx];
+        buf <<= c.len;
+        buf_len -= c.len;
+    }
+    return h.size_orig;
+BAD_INDEX:
+    printf("[0x%08llx] Error: ARX LUT index out of range (%u)\n", (uint64_t)(ip - src), codes[buf >> 55].idx);
+    free(*out);
+    *out = NULL;
+    return 0;
+}
+
+// Bit-at-a-time reference decoder, only used to check and benchmark the table decoder.
+static size_t uncompress_arx_bitwise(const uint8_t *src, size_t len, void **out) {
+    *out = NULL;
+    if(len < sizeof(ARXHeader)) return 0;
     ARXHeader h;
-    fread(&h, sizeof(ARXHeader), 1, fp);
-    *out = malloc(h.size_orig);
-    memset(*out, 0, h.size_orig);
+    memcpy(&h, src, sizeof(ARXHeader));
+    size_t words = ((size_t)h.size_orig + 3) / 4;
+    *out = calloc(words ? words : 1, sizeof(uint32_t));
+    if(!*out) return 0;
     uint32_t *o = *out;
-    
+    uint32_t *oend = o + words;
+    const uint8_t *ip = src + sizeof(ARXHeader);
+    const uint8_t *end = src + len;
+
     uint64_t buf = 0;
     uint8_t buf_len = 0;
     const uint64_t top = 1llu << 63;
@@ -39,21 +169,21 @@ size_t uncompress_arx(char *filename, void **out) {
         ARX_MARKER,
         ARX_LUT
     } s = ARX_DATA;
-    uint8_t lut_val, lut_idx, lut_len;
-    while(true) {
-        uint32_t val;
-        fread(&val, sizeof(uint32_t), 1, fp);
-        if(feof(fp) || ferror(fp)) break;
-        buf |= (uint64_t)val << (32 - buf_len);
+    uint8_t lut_val = 0, lut_idx = 0, lut_len = 0;
+    while(o < oend && end - ip >= 4) {
+        buf |= (uint64_t)read_u32(ip) << (32 - buf_len);
+        ip += 4;
         buf_len += 32;
-        while(buf_len) {
+        while(buf_len && o < oend) {
             uint8_t bit = (buf & top) >> 63;
             switch(s) {
                 case ARX_DATA: {
                     if(bit) {
                         s = ARX_MARKER;
                     } else {
-                        fread(o++, sizeof(uint32_t), 1, fp);
+                        if(end - ip < 4) return h.size_orig;
+                        *o++ = read_u32(ip);
+                        ip += 4;
                         buf <<= 1;
                         --buf_len;
                     }
@@ -83,6 +213,11 @@ size_t uncompress_arx(char *filename, void **out) {
                             case 6: idx = 6 + (lut_val & 0xf); break;
                             case 8: idx = 14 + (lut_val & 0x1f); break;
                         }
+                        if(idx >= ARX_LUT_LEN) {
+                            free(*out);
+                            *out = NULL;
+                            return 0;
+                        }
                         *o++ = h.lut[idx];
                     }
                     buf <<= 1;
@@ -92,6 +227,42 @@ size_t uncompress_arx(char *filename, void **out) {
             }
         }
     }
-    fclose(fp);
     return h.size_orig;
-}
\ No newline at end of file
+}
+
+size_t uncompress_arx(mfile *f, void **out) {
+    return uncompress_arx_mem(f->p, f->size, out);
+}
+
+static double bench_decoder(size_t (*decode)(const uint8_t*, size_t, void**), const uint8_t *src, size_t len, void **out, size_t *size) {
+    const int runs = 8;
+    double best = 0;
+    for(int i = 0; i < runs; ++i) {
+        if(*out) free(*out);
+        clock_t t0 = clock();
+        *size = decode(src, len, out);
+        clock_t t1 = clock();
+        double s = (double)(t1 - t0) / CLOCKS_PER_SEC;
+        if(i == 0 || s < best) best = s;
+    }
+    return best;
+}
+
+void benchmark_arx(mfile *f) {
+    const uint8_t *src = f->p;
+    size_t len = f->size;
+    void *ref = NULL, *fast = NULL;
+    size_t ref_size = 0, fast_size = 0;
+    double t_ref = bench_decoder(uncompress_arx_bitwise, src, len, &ref, &ref_size);
+    double t_fast = bench_decoder(uncompress_arx_mem, src, len, &fast, &fast_size);
+    double mb = fast_size / (1024.0 * 1024.0);
+    printf("ARX benchmark \"%s\": %llu -> %llu bytes\n", f->name, (uint64_t)len, (uint64_t)fast_size);
+    printf("  bitwise: %8.3f ms %9.2f MB/s\n", t_ref * 1000, t_ref > 0 ? mb / t_ref : 0);
+    printf("  table:   %8.3f ms %9.2f MB/s\n", t_fast * 1000, t_fast > 0 ? mb / t_fast : 0);
+    if(t_fast > 0) printf("  speedup: %.1fx\n", t_ref / t_fast);
+    if(ref_size != fast_size || (ref && fast && memcmp(ref, fast, fast_size))) {
+        printf("  Error: decoder output mismatch!\n");
+    }
+    free(ref);
+    free(fast);
+}
@@ -1,6 +1,12 @@
 #ifndef XENO_ARX_H
 #define XENO_ARX_H
 
-size_t uncompress_arx(char *filename, void **out);
+#include <stddef.h>
+#include <stdint.h>
+#include "mfile.h"
 
-#endif
\ No newline at end of file
+size_t uncompress_arx(mfile *f, void **out);
+size_t uncompress_arx_mem(const uint8_t *src, size_t len, void **out);
+void benchmark_arx(mfile *f);
+
+#endif
@@ -0,0 +1,812 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "xeno_bc.h"
+#include "pool.h"
+#include "xenotool.h"
+#include "xenodebug.h"
+#include "macro.h"
+
+// BC1, BC3 and BC7 block encoder. Endpoints come from the principal axis of
+// the block's colors and are refined by least squares on the chosen
+// indices; every candidate is scored by its exact squared error after
+// quantization. BC7 blocks with alpha also try mode 5, which indexes alpha
+// on its own; BC_BEST tries it with every channel rotation and also the six
+// level BC3 alpha mode.
+
+static const uint8_t fit_iterations[3] = {2, 4, 8};
+static const uint8_t refine_iterations[3] = {0, 1, 3};
+
+static const uint8_t bc7_weights2[4] = {0, 21, 43, 64};
+static const uint8_t bc7_weights4[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+typedef struct {
+    uint8_t px[16][4];
+    float c[4][16]; // px by channel
+    bool opaque;
+    bool transparent; // some alpha < 128, BC1 uses the transparent color
+} Block;
+
+// Interpolation weights of a block format in increasing order, lut maps a
+// position on the endpoint segment (0..256) to the nearest one.
+typedef struct {
+    int n;
+    float w[16];
+    uint8_t lut[257];
+} Levels;
+
+static Levels levels_bc1_4, levels_bc1_3, levels_bc7_2, levels_bc7_4;
+static bool bc_ready;
+
+static void levels_init(Levels *l, int n, const float *w) {
+    l->n = n;
+    memcpy(l->w, w, n * sizeof(float));
+    for(int t = 0; t <= 256; ++t) {
+        int best = 0;
+        for(int k = 1; k < n; ++k) {
+            if(fabsf(w[k] * 256 - t) < fabsf(w[best] * 256 - t)) best = k;
+        }
+        l->lut[t] = best;
+    }
+}
+
+static void bc_init() {
+    if(bc_ready) return;
+    float w[16];
+    for(int k = 0; k < 4; ++k) w[k] = k / 3.0f;
+    levels_init(&levels_bc1_4, 4, w);
+    for(int k = 0; k < 3; ++k) w[k] = k / 2.0f;
+    levels_init(&levels_bc1_3, 3, w);
+    for(int k = 0; k < 4; ++k) w[k] = bc7_weights2[k] / 64.0f;
+    levels_init(&levels_bc7_2, 4, w);
+    for(int k = 0; k < 16; ++k) w[k] = bc7_weights4[k] / 64.0f;
+    levels_init(&levels_bc7_4, 16, w);
+    bc_ready = true;
+}
+
+size_t bc_block_size(TextureFormat format) {
+    return format == TEX_FORMAT_BC1 ? 8 : 16;
+}
+
+// Partial blocks at the right and bottom edge repeat the last column and row.
+static void load_block(const RGBA *src, uint32_t width, uint32_t height, uint32_t bx, uint32_t by, Block *b) {
+    b->opaque = true;
+    b->transparent = false;
+    for(int i = 0; i < 16; ++i) {
+        uint32_t x = MIN(bx * 4 + (i & 3), width - 1);
+        uint32_t y = MIN(by * 4 + (i >> 2), height - 1);
+        memcpy(b->px[i], &src[(size_t)y * width + x], 4);
+        for(int c = 0; c < 4; ++c) b->c[c][i] = b->px[i][c];
+        if(b->px[i][3] != 255) b->opaque = false;
+        if(b->px[i][3] < 128) b->transparent = true;
+    }
+}
+
+// Nearest level for every pixel by projecting channels [c0, c0 + cn) on the
+// e0 -> e1 segment, the palette of each block format lies on that segment.
+static void project(const Block *b, int c0, int cn, const float *e0, const float *e1, const Levels *l, uint8_t level[16]) {
+    float d[4] = {0}, dd = 0, off = 0;
+    for(int c = c0; c < c0 + cn; ++c) {
+        d[c] = e1[c] - e0[c];
+        dd += d[c] * d[c];
+    }
+    if(dd < 1e-6f) {
+        memset(level, 0, 16);
+        return;
+    }
+    for(int c = c0; c < c0 + cn; ++c) {
+        d[c] *= 256.0f / dd;
+        off -= e0[c] * d[c];
+    }
+    int32_t t[16];
+#ifdef __SSE2__
+    for(int i = 0; i < 16; i += 4) {
+        __m128 v = _mm_set1_ps(off);
+        for(int c = c0; c < c0 + cn; ++c) v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(&b->c[c][i]), _mm_set1_ps(d[c])));
+        v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(256.0f));
+        _mm_storeu_si128((__m128i*)&t[i], _mm_cvtps_epi32(v));
+    }
+#else
+    for(int i = 0; i < 16; ++i) {
+        float v = off;
+        for(int c = c0; c < c0 + cn; ++c) v += b->c[c][i] * d[c];
+        t[i] = lrintf(CLAMP(v, 0.0f, 256.0f));
+    }
+#endif
+    for(int i = 0; i < 16; ++i) level[i] = l->lut[t[i]];
+}
+
+// Squared error of the pixels against pal[code[i]], mask has 0xff in the
+// bytes of the channels that count.
+static uint32_t block_error(const Block *b, const uint8_t (*pal)[4], const uint8_t code[16], uint32_t mask) {
+    uint8_t rec[16][4];
+    for(int i = 0; i < 16; ++i) memcpy(rec[i], pal[code[i]], 4);
+#ifdef __SSE2__
+    __m128i m = _mm_set1_epi32(mask);
+    __m128i z = _mm_setzero_si128();
+    __m128i acc = z;
+    for(int i = 0; i < 16; i += 4) {
+        __m128i p = _mm_and_si128(_mm_loadu_si128((const __m128i*)b->px[i]), m);
+        __m128i r = _mm_and_si128(_mm_loadu_si128((const __m128i*)rec[i]), m);
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(p, z), _mm_unpacklo_epi8(r, z));
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(p, z), _mm_unpackhi_epi8(r, z));
+        acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(acc);
+#else
+    uint32_t e = 0;
+    for(int i = 0; i < 16; ++i) {
+        for(int c = 0; c < 4; ++c) {
+            if(!((mask >> (c * 8)) & 0xff)) continue;
+            int d = b->px[i][c] - rec[i][c];
+            e += d * d;
+        }
+    }
+    return e;
+#endif
+}
+
+// Principal axis of channels [c0, c0 + cn) through their mean, cut to the
+// extent of the pixels. Pixels with alpha < 128 are left out with
+// skip_transparent.
+static void fit_line(const Block *b, int c0, int cn, bool skip_transparent, int iterations, float e0[4], float e1[4]) {
+    float mean[4] = {0}, cov[4][4] = {{0}};
+    int n = 0;
+    memset(e0, 0, 4 * sizeof(float));
+    memset(e1, 0, 4 * sizeof(float));
+    for(int i = 0; i < 16; ++i) {
+        if(skip_transparent && b->px[i][3] < 128) continue;
+        for(int c = c0; c < c0 + cn; ++c) mean[c] += b->c[c][i];
+        ++n;
+    }
+    if(!n) return;
+    for(int c = c0; c < c0 + cn; ++c) mean[c] /= n;
+    for(int i = 0; i < 16; ++i) {
+        if(skip_transparent && b->px[i][3] < 128) continue;
+        for(int j = c0; j < c0 + cn; ++j) {
+            for(int k = c0; k < c0 + cn; ++k) cov[j][k] += (b->c[j][i] - mean[j]) * (b->c[k][i] - mean[k]);
+        }
+    }
+    // power iteration from the row of the channel that varies most
+    int start = c0;
+    for(int c = c0; c < c0 + cn; ++c) if(cov[c][c] > cov[start][start]) start = c;
+    float axis[4] = {0};
+    for(int c = c0; c < c0 + cn; ++c) axis[c] = cov[start][c];
+    for(int it = 0; it < iterations; ++it) {
+        float v[4] = {0}, m = 0;
+        for(int j = c0; j < c0 + cn; ++j) {
+            for(int k = c0; k < c0 + cn; ++k) v[j] += cov[j][k] * axis[k];
+            m = MAX(m, fabsf(v[j]));
+        }
+        if(m == 0) break;
+        for(int c = c0; c < c0 + cn; ++c) axis[c] = v[c] / m;
+    }
+    float len = 0;
+    for(int c = c0; c < c0 + cn; ++c) len += axis[c] * axis[c];
+    if(len == 0) {
+        memcpy(e0, mean, 4 * sizeof(float));
+        memcpy(e1, mean, 4 * sizeof(float));
+        return;
+    }
+    len = sqrtf(len);
+    for(int c = c0; c < c0 + cn; ++c) axis[c] /= len;
+    float tmin = INFINITY, tmax = -INFINITY;
+    for(int i = 0; i < 16; ++i) {
+        if(skip_transparent && b->px[i][3] < 128) continue;
+        float t = 0;
+        for(int c = c0; c < c0 + cn; ++c) t += (b->c[c][i] - mean[c]) * axis[c];
+        tmin = MIN(tmin, t);
+        tmax = MAX(tmax, t);
+    }
+    for(int c = c0; c < c0 + cn; ++c) {
+        e0[c] = CLAMP(mean[c] + axis[c] * tmin, 0.0f, 255.0f);
+        e1[c] = CLAMP(mean[c] + axis[c] * tmax, 0.0f, 255.0f);
+    }
+}
+
+// Least squares endpoints for pixels at weight w[i] from e0 to e1, pixels
+// with w[i] < 0 are left out. Fails when all weights are the same.
+static bool refine_line(const Block *b, int c0, int cn, const float w[16], float e0[4], float e1[4]) {
+    float a11 = 0, a12 = 0, a22 = 0, r1[4] = {0}, r2[4] = {0};
+    for(int i = 0; i < 16; ++i) {
+        if(w[i] < 0) continue;
+        float u = 1 - w[i];
+        a11 += u * u;
+        a12 += u * w[i];
+        a22 += w[i] * w[i];
+        for(int c = c0; c < c0 + cn; ++c) {
+            r1[c] += u * b->c[c][i];
+            r2[c] += w[i] * b->c[c][i];
+        }
+    }
+    float det = a11 * a22 - a12 * a12;
+    if(fabsf(det) < 1e-6f) return false;
+    for(int c = c0; c < c0 + cn; ++c) {
+        e0[c] = CLAMP((a22 * r1[c] - a12 * r2[c]) / det, 0.0f, 255.0f);
+        e1[c] = CLAMP((a11 * r2[c] - a12 * r1[c]) / det, 0.0f, 255.0f);
+    }
+    return true;
+}
+
+static uint16_t rgb565_pack(const float e[4]) {
+    uint16_t r = lrintf(e[0] * 31 / 255.0f);
+    uint16_t g = lrintf(e[1] * 63 / 255.0f);
+    uint16_t b = lrintf(e[2] * 31 / 255.0f);
+    return r << 11 | g << 5 | b;
+}
+
+// BC1 palette in code order, the BC3 color block always has four colors
+static void bc1_palette(uint16_t c0, uint16_t c1, bool bc3, uint8_t pal[4][4]) {
+    uint16_t c[2] = {c0, c1};
+    for(int k = 0; k < 2; ++k) {
+        uint8_t r = c[k] >> 11, g = (c[k] >> 5) & 63, b = c[k] & 31;
+        pal[k][0] = r << 3 | r >> 2;
+        pal[k][1] = g << 2 | g >> 4;
+        pal[k][2] = b << 3 | b >> 2;
+        pal[k][3] = 255;
+    }
+    for(int ch = 0; ch < 3; ++ch) {
+        if(bc3 || c0 > c1) {
+            pal[2][ch] = (2 * pal[0][ch] + pal[1][ch] + 1) / 3;
+            pal[3][ch] = (pal[0][ch] + 2 * pal[1][ch] + 1) / 3;
+        } else {
+            pal[2][ch] = (pal[0][ch] + pal[1][ch] + 1) / 2;
+            pal[3][ch] = 0;
+        }
+    }
+    pal[2][3] = 255;
+    pal[3][3] = (bc3 || c0 > c1) ? 255 : 0;
+}
+
+// Orders the endpoints for the mode (four colors need c0 > c1, three colors
+// with transparency c0 <= c1) and picks the codes, returns the RGB error.
+static uint32_t bc1_try(const Block *b, uint16_t e0, uint16_t e1, bool bc3, bool punch, uint16_t *c0, uint16_t *c1, uint8_t code[16]) {
+    static const uint8_t code4[4] = {0, 2, 3, 1};
+    static const uint8_t code3[3] = {0, 2, 1};
+    *c0 = punch ? MIN(e0, e1) : MAX(e0, e1);
+    *c1 = punch ? MAX(e0, e1) : MIN(e0, e1);
+    uint8_t pal[4][4];
+    bc1_palette(*c0, *c1, bc3, pal);
+    float p0[4], p1[4];
+    for(int c = 0; c < 4; ++c) {
+        p0[c] = pal[0][c];
+        p1[c] = pal[1][c];
+    }
+    uint8_t level[16];
+    project(b, 0, 3, p0, p1, punch ? &levels_bc1_3 : &levels_bc1_4, level);
+    for(int i = 0; i < 16; ++i) {
+        if(punch) {
+            code[i] = b->px[i][3] < 128 ? 3 : code3[level[i]];
+        } else {
+            code[i] = code4[level[i]];
+        }
+    }
+    return block_error(b, (const uint8_t(*)[4])pal, code, 0x00ffffff);
+}
+
+// Returns the error of the block as decoded, RGB only for the BC3 color block.
+static uint32_t bc1_color(const Block *b, bool bc3, BCQuality q, uint8_t out[8]) {
+    static const float weight4[4] = {0, 1, 1 / 3.0f, 2 / 3.0f};
+    static const float weight3[4] = {0, 1, 0.5f, -1};
+    bool punch = !bc3 && b->transparent;
+    float e0[4], e1[4];
+    fit_line(b, 0, 3, punch, fit_iterations[q], e0, e1);
+    uint16_t c0, c1;
+    uint8_t code[16];
+    uint32_t err = bc1_try(b, rgb565_pack(e0), rgb565_pack(e1), bc3, punch, &c0, &c1, code);
+    for(int it = 0; it < refine_iterations[q] && err; ++it) {
+        float w[16];
+        for(int i = 0; i < 16; ++i) w[i] = punch ? weight3[code[i]] : weight4[code[i]];
+        if(!refine_line(b, 0, 3, w, e0, e1)) break;
+        uint16_t n0, n1;
+        uint8_t ncode[16];
+        uint32_t nerr = bc1_try(b, rgb565_pack(e0), rgb565_pack(e1), bc3, punch, &n0, &n1, ncode);
+        if(nerr >= err) break;
+        err = nerr;
+        c0 = n0;
+        c1 = n1;
+        memcpy(code, ncode, 16);
+    }
+    uint32_t bits = 0;
+    for(int i = 0; i < 16; ++i) bits |= (uint32_t)code[i] << (i * 2);
+    out[0] = c0;
+    out[1] = c0 >> 8;
+    out[2] = c1;
+    out[3] = c1 >> 8;
+    for(int k = 0; k < 4; ++k) out[4 + k] = bits >> (k * 8);
+    uint8_t pal[4][4];
+    bc1_palette(c0, c1, bc3, pal);
+    return block_error(b, (const uint8_t(*)[4])pal, code, bc3 ? 0x00ffffff : 0xffffffff);
+}
+
+// a0 > a1 gives eight levels, otherwise six plus 0 and 255
+static void bc4_palette(uint8_t a0, uint8_t a1, uint8_t pal[8]) {
+    pal[0] = a0;
+    pal[1] = a1;
+    if(a0 > a1) {
+        for(int k = 1; k < 7; ++k) pal[k + 1] = ((7 - k) * a0 + k * a1 + 3) / 7;
+    } else {
+        for(int k = 1; k < 5; ++k) pal[k + 1] = ((5 - k) * a0 + k * a1 + 2) / 5;
+        pal[6] = 0;
+        pal[7] = 255;
+    }
+}
+
+static uint32_t bc4_try(const Block *b, uint8_t a0, uint8_t a1, uint8_t code[16]) {
+    uint8_t pal[8];
+    bc4_palette(a0, a1, pal);
+    uint32_t err = 0;
+    for(int i = 0; i < 16; ++i) {
+        int best = 0, best_d = 256;
+        for(int k = 0; k < 8; ++k) {
+            int d = abs(b->px[i][3] - pal[k]);
+            if(d < best_d) {
+                best = k;
+                best_d = d;
+            }
+        }
+        code[i] = best;
+        err += best_d * best_d;
+    }
+    return err;
+}
+
+// BC3 alpha block, returns the alpha error
+static uint32_t bc4_alpha(const Block *b, BCQuality q, uint8_t out[8]) {
+    uint8_t lo = 255, hi = 0, lo6 = 255, hi6 = 0;
+    for(int i = 0; i < 16; ++i) {
+        uint8_t a = b->px[i][3];
+        lo = MIN(lo, a);
+        hi = MAX(hi, a);
+        if(a && a != 255) {
+            lo6 = MIN(lo6, a);
+            hi6 = MAX(hi6, a);
+        }
+    }
+    uint8_t a0 = hi, a1 = lo, code[16];
+    uint32_t err = bc4_try(b, a0, a1, code);
+    if(q == BC_BEST && err && lo6 <= hi6) {
+        // a narrow range between fully transparent and opaque texels
+        uint8_t code6[16];
+        uint32_t err6 = bc4_try(b, lo6, hi6, code6);
+        if(err6 < err) {
+            err = err6;
+            a0 = lo6;
+            a1 = hi6;
+            memcpy(code, code6, 16);
+        }
+    }
+    uint64_t bits = 0;
+    for(int i = 0; i < 16; ++i) bits |= (uint64_t)code[i] << (i * 3);
+    out[0] = a0;
+    out[1] = a1;
+    for(int k = 0; k < 6; ++k) out[2 + k] = bits >> (k * 8);
+    return err;
+}
+
+typedef struct {
+    uint8_t *p;
+    uint32_t pos;
+} BlockBits;
+
+static void bits_put(BlockBits *w, uint32_t v, uint32_t n) {
+    for(uint32_t i = 0; i < n; ++i, ++w->pos) {
+        if((v >> i) & 1) w->p[w->pos >> 3] |= 1 << (w->pos & 7);
+    }
+}
+
+static inline uint8_t bc7_interp(int e0, int e1, int w) {
+    return ((64 - w) * e0 + w * e1 + 32) >> 6;
+}
+
+// Mode 6 endpoints are 7 bits per channel plus a p-bit shared by the four
+// channels; picks the p-bit that lands closest to e.
+static int bc7_quant6(const float e[4], uint8_t q[4], int force_p) {
+    float best_err = INFINITY;
+    int best = 0;
+    for(int p = 0; p < 2; ++p) {
+        if(force_p >= 0 && p != force_p) continue;
+        uint8_t t[4];
+        float err = 0;
+        for(int c = 0; c < 4; ++c) {
+            t[c] = CLAMP(lrintf((e[c] - p) / 2), 0, 127);
+            float d = (t[c] << 1 | p) - e[c];
+            err += d * d;
+        }
+        if(err < best_err) {
+            best_err = err;
+            best = p;
+            memcpy(q, t, 4);
+        }
+    }
+    return best;
+}
+
+typedef struct {
+    uint8_t q[2][4];
+    int p[2];
+    uint8_t code[16];
+    uint32_t error;
+} Mode6;
+
+static void bc7_mode6_try(const Block *b, Mode6 *m) {
+    uint8_t pal[16][4];
+    float e0[4], e1[4];
+    for(int c = 0; c < 4; ++c) {
+        int a = m->q[0][c] << 1 | m->p[0];
+        int z = m->q[1][c] << 1 | m->p[1];
+        e0[c] = a;
+        e1[c] = z;
+        for(int k = 0; k < 16; ++k) pal[k][c] = bc7_interp(a, z, bc7_weights4[k]);
+    }
+    project(b, 0, 4, e0, e1, &levels_bc7_4, m->code);
+    m->error = block_error(b, (const uint8_t(*)[4])pal, m->code, 0xffffffff);
+}
+
+// Single subset RGBA with 4-bit indices.
+static uint32_t bc7_mode6(const Block *b, BCQuality q, uint8_t out[16]) {
+    float e0[4], e1[4];
+    fit_line(b, 0, 4, false, fit_iterations[q], e0, e1);
+    Mode6 best = {.error = UINT32_MAX};
+    for(int it = 0; it <= refine_iterations[q]; ++it) {
+        uint32_t prev = best.error;
+        // BC_BEST scores all four p-bit pairs instead of the closest one
+        for(int pp = 0; pp < (q == BC_BEST ? 4 : 1); ++pp) {
+            Mode6 m;
+            m.p[0] = bc7_quant6(e0, m.q[0], q == BC_BEST ? pp & 1 : -1);
+            m.p[1] = bc7_quant6(e1, m.q[1], q == BC_BEST ? pp >> 1 : -1);
+            bc7_mode6_try(b, &m);
+            if(m.error < best.error) best = m;
+        }
+        if(!best.error || best.error >= prev) break;
+        float w[16];
+        for(int i = 0; i < 16; ++i) w[i] = bc7_weights4[best.code[i]] / 64.0f;
+        if(!refine_line(b, 0, 4, w, e0, e1)) break;
+    }
+    // the first index has an implicit 0 as its top bit
+    if(best.code[0] & 8) {
+        for(int c = 0; c < 4; ++c) {
+            uint8_t t = best.q[0][c];
+            best.q[0][c] = best.q[1][c];
+            best.q[1][c] = t;
+        }
+        int t = best.p[0];
+        best.p[0] = best.p[1];
+        best.p[1] = t;
+        for(int i = 0; i < 16; ++i) best.code[i] = 15 - best.code[i];
+    }
+    memset(out, 0, 16);
+    BlockBits w = {out, 0};
+    bits_put(&w, 1 << 6, 7);
+    for(int c = 0; c < 4; ++c) {
+        bits_put(&w, best.q[0][c], 7);
+        bits_put(&w, best.q[1][c], 7);
+    }
+    bits_put(&w, best.p[0], 1);
+    bits_put(&w, best.p[1], 1);
+    for(int i = 0; i < 16; ++i) bits_put(&w, best.code[i], i ? 4 : 3);
+    return best.error;
+}
+
+static void bc7_mode5_color_try(const Block *b, const uint8_t q[2][3], uint8_t code[16], uint32_t *error) {
+    uint8_t pal[4][4] = {{0}};
+    float e0[4] = {0}, e1[4] = {0};
+    for(int c = 0; c < 3; ++c) {
+        int a = q[0][c] << 1 | q[0][c] >> 6;
+        int z = q[1][c] << 1 | q[1][c] >> 6;
+        e0[c] = a;
+        e1[c] = z;
+        for(int k = 0; k < 4; ++k) pal[k][c] = bc7_interp(a, z, bc7_weights2[k]);
+    }
+    project(b, 0, 3, e0, e1, &levels_bc7_2, code);
+    *error = block_error(b, (const uint8_t(*)[4])pal, code, 0x00ffffff);
+}
+
+// Single subset with separate 2-bit color and alpha indices, rotation swaps
+// alpha with R, G or B first so any one channel can be indexed on its own.
+static uint32_t bc7_mode5(const Block *src, int rotation, BCQuality q, uint8_t out[16]) {
+    Block b = *src;
+    if(rotation) {
+        for(int i = 0; i < 16; ++i) {
+            uint8_t t = b.px[i][rotation - 1];
+            b.px[i][rotation - 1] = b.px[i][3];
+            b.px[i][3] = t;
+            b.c[rotation - 1][i] = b.px[i][rotation - 1];
+            b.c[3][i] = t;
+        }
+    }
+    float e0[4], e1[4];
+    fit_line(&b, 0, 3, false, fit_iterations[q], e0, e1);
+    uint8_t cq[2][3], ccode[16];
+    uint32_t cerr = UINT32_MAX;
+    for(int it = 0; it <= refine_iterations[q]; ++it) {
+        uint8_t tq[2][3], tcode[16];
+        uint32_t terr;
+        for(int c = 0; c < 3; ++c) {
+            tq[0][c] = CLAMP(lrintf(e0[c] * 127 / 255.0f), 0, 127);
+            tq[1][c] = CLAMP(lrintf(e1[c] * 127 / 255.0f), 0, 127);
+        }
+        bc7_mode5_color_try(&b, (const uint8_t(*)[3])tq, tcode, &terr);
+        if(terr >= cerr) break;
+        cerr = terr;
+        memcpy(cq, tq, sizeof(cq));
+        memcpy(ccode, tcode, 16);
+        if(!cerr) break;
+        float w[16];
+        for(int i = 0; i < 16; ++i) w[i] = bc7_weights2[ccode[i]] / 64.0f;
+        if(!refine_line(&b, 0, 3, w, e0, e1)) break;
+    }
+    // alpha endpoints are 8 bits, the range of the block
+    uint8_t a[2] = {255, 0}, apal[4], acode[16];
+    for(int i = 0; i < 16; ++i) {
+        a[0] = MIN(a[0], b.px[i][3]);
+        a[1] = MAX(a[1], b.px[i][3]);
+    }
+    for(int k = 0; k < 4; ++k) apal[k] = bc7_interp(a[0], a[1], bc7_weights2[k]);
+    uint32_t aerr = 0;
+    for(int i = 0; i < 16; ++i) {
+        int best = 0, best_d = 256;
+        for(int k = 0; k < 4; ++k) {
+            int d = abs(b.px[i][3] - apal[k]);
+            if(d < best_d) {
+                best = k;
+                best_d = d;
+            }
+        }
+        acode[i] = best;
+        aerr += best_d * best_d;
+    }
+    if(ccode[0] & 2) {
+        for(int c = 0; c < 3; ++c) {
+            uint8_t t = cq[0][c];
+            cq[0][c] = cq[1][c];
+            cq[1][c] = t;
+        }
+        for(int i = 0; i < 16; ++i) ccode[i] = 3 - ccode[i];
+    }
+    if(acode[0] & 2) {
+        uint8_t t = a[0];
+        a[0] = a[1];
+        a[1] = t;
+        for(int i = 0; i < 16; ++i) acode[i] = 3 - acode[i];
+    }
+    memset(out, 0, 16);
+    BlockBits w = {out, 0};
+    bits_put(&w, 1 << 5, 6);
+    bits_put(&w, rotation, 2);
+    for(int c = 0; c < 3; ++c) {
+        bits_put(&w, cq[0][c], 7);
+        bits_put(&w, cq[1][c], 7);
+    }
+    bits_put(&w, a[0], 8);
+    bits_put(&w, a[1], 8);
+    for(int i = 0; i < 16; ++i) bits_put(&w, ccode[i], i ? 2 : 1);
+    for(int i = 0; i < 16; ++i) bits_put(&w, acode[i], i ? 2 : 1);
+    return cerr + aerr;
+}
+
+static uint32_t bc7_block(const Block *b, BCQuality q, uint8_t out[16]) {
+    uint32_t err = bc7_mode6(b, q, out);
+    if(q == BC_FAST || !err || (q == BC_NORMAL && b->opaque)) return err;
+    uint8_t tmp[16];
+    for(int r = 0; r < (q == BC_BEST ? 4 : 1); ++r) {
+        uint32_t e = bc7_mode5(b, r, q, tmp);
+        if(e < err) {
+            err = e;
+            memcpy(out, tmp, 16);
+        }
+    }
+    return err;
+}
+
+// Reference decoder for the self check, written from the format
+// descriptions without the encoder's helpers. BC7 handles the modes the
+// encoder writes (5 and 6), other modes decode to magenta.
+static void decode_bc1(const uint8_t *s, bool bc3, RGBA out[16]) {
+    uint16_t c0 = s[0] | s[1] << 8;
+    uint16_t c1 = s[2] | s[3] << 8;
+    uint32_t bits = s[4] | s[5] << 8 | s[6] << 16 | (uint32_t)s[7] << 24;
+    int col[4][4];
+    col[0][0] = ((c0 >> 11) << 3) | (c0 >> 13);
+    col[0][1] = (((c0 >> 5) & 0x3f) << 2) | ((c0 >> 9) & 3);
+    col[0][2] = ((c0 & 0x1f) << 3) | ((c0 >> 2) & 7);
+    col[1][0] = ((c1 >> 11) << 3) | (c1 >> 13);
+    col[1][1] = (((c1 >> 5) & 0x3f) << 2) | ((c1 >> 9) & 3);
+    col[1][2] = ((c1 & 0x1f) << 3) | ((c1 >> 2) & 7);
+    col[0][3] = col[1][3] = col[2][3] = col[3][3] = 255;
+    for(int k = 0; k < 3; ++k) {
+        if(c0 > c1 || bc3) {
+            col[2][k] = (col[0][k] * 2 + col[1][k] + 1) / 3;
+            col[3][k] = (col[0][k] + col[1][k] * 2 + 1) / 3;
+        } else {
+            col[2][k] = (col[0][k] + col[1][k] + 1) / 2;
+            col[3][k] = 0;
+        }
+    }
+    if(!(c0 > c1 || bc3)) col[3][3] = 0;
+    for(int i = 0; i < 16; ++i) {
+        int *c = col[(bits >> (2 * i)) & 3];
+        out[i] = (RGBA){c[0], c[1], c[2], c[3]};
+    }
+}
+
+static void decode_bc3_alpha(const uint8_t *s, RGBA out[16]) {
+    int a[8] = {s[0], s[1]};
+    if(a[0] > a[1]) {
+        for(int k = 2; k < 8; ++k) a[k] = ((8 - k) * a[0] + (k - 1) * a[1] + 3) / 7;
+    } else {
+        for(int k = 2; k < 6; ++k) a[k] = ((6 - k) * a[0] + (k - 1) * a[1] + 2) / 5;
+        a[6] = 0;
+        a[7] = 255;
+    }
+    uint64_t bits = 0;
+    for(int k = 0; k < 6; ++k) bits |= (uint64_t)s[2 + k] << (8 * k);
+    for(int i = 0; i < 16; ++i) out[i].a = a[(bits >> (3 * i)) & 7];
+}
+
+static uint32_t bits_get(const uint8_t *s, uint32_t *pos, uint32_t n) {
+    uint32_t v = 0;
+    for(uint32_t i = 0; i < n; ++i, ++*pos) v |= ((s[*pos >> 3] >> (*pos & 7)) & 1u) << i;
+    return v;
+}
+
+static void decode_bc7(const uint8_t *s, RGBA out[16]) {
+    int mode = 0;
+    while(mode < 8 && !((s[0] >> mode) & 1)) ++mode;
+    uint32_t pos = mode + 1;
+    int e[2][4];
+    if(mode == 6) {
+        for(int c = 0; c < 4; ++c) {
+            e[0][c] = bits_get(s, &pos, 7) << 1;
+            e[1][c] = bits_get(s, &pos, 7) << 1;
+        }
+        for(int k = 0; k < 2; ++k) {
+            int p = bits_get(s, &pos, 1);
+            for(int c = 0; c < 4; ++c) e[k][c] |= p;
+        }
+        for(int i = 0; i < 16; ++i) {
+            int w = bc7_weights4[bits_get(s, &pos, i ? 4 : 3)];
+            uint8_t v[4];
+            for(int c = 0; c < 4; ++c) v[c] = (e[0][c] * (64 - w) + e[1][c] * w + 32) >> 6;
+            out[i] = (RGBA){v[0], v[1], v[2], v[3]};
+        }
+    } else if(mode == 5) {
+        int rotation = bits_get(s, &pos, 2);
+        for(int c = 0; c < 3; ++c) {
+            for(int k = 0; k < 2; ++k) {
+                int v = bits_get(s, &pos, 7);
+                e[k][c] = (v << 1) | (v >> 6);
+            }
+        }
+        e[0][3] = bits_get(s, &pos, 8);
+        e[1][3] = bits_get(s, &pos, 8);
+        int ci[16], ai[16];
+        for(int i = 0; i < 16; ++i) ci[i] = bits_get(s, &pos, i ? 2 : 1);
+        for(int i = 0; i < 16; ++i) ai[i] = bits_get(s, &pos, i ? 2 : 1);
+        for(int i = 0; i < 16; ++i) {
+            uint8_t v[4];
+            for(int c = 0; c < 4; ++c) {
+                int w = bc7_weights2[c == 3 ? ai[i] : ci[i]];
+                v[c] = (e[0][c] * (64 - w) + e[1][c] * w + 32) >> 6;
+            }
+            if(rotation) {
+                uint8_t t = v[3];
+                v[3] = v[rotation - 1];
+                v[rotation - 1] = t;
+            }
+            out[i] = (RGBA){v[0], v[1], v[2], v[3]};
+        }
+    } else {
+        for(int i = 0; i < 16; ++i) out[i] = (RGBA){255, 0, 255, 255};
+    }
+}
+
+static void decode_block(TextureFormat format, const uint8_t *s, RGBA out[16]) {
+    switch(format) {
+        case TEX_FORMAT_BC1: {
+            decode_bc1(s, false, out);
+            break;
+        }
+        case TEX_FORMAT_BC3: {
+            decode_bc1(s + 8, true, out);
+            decode_bc3_alpha(s, out);
+            break;
+        }
+        default: {
+            decode_bc7(s, out);
+        }
+    }
+}
+
+typedef struct {
+    const RGBA *src;
+    uint32_t width, height;
+    uint32_t bw; // blocks per row
+    TextureFormat format;
+    BCQuality quality;
+    uint8_t *dst;
+    uint32_t *error; // per block, for the self check
+} BCJobs;
+
+static void bc_row_job(void *ctx, size_t job, size_t worker) {
+    (void)worker;
+    const BCJobs *j = ctx;
+    size_t size = bc_block_size(j->format);
+    for(uint32_t bx = 0; bx < j->bw; ++bx) {
+        Block b;
+        load_block(j->src, j->width, j->height, bx, job, &b);
+        size_t k = job * j->bw + bx;
+        uint8_t *out = j->dst + k * size;
+        switch(j->format) {
+            case TEX_FORMAT_BC1: {
+                j->error[k] = bc1_color(&b, false, j->quality, out);
+                break;
+            }
+            case TEX_FORMAT_BC3: {
+                j->error[k] = bc4_alpha(&b, j->quality, out) + bc1_color(&b, true, j->quality, out + 8);
+                break;
+            }
+            default: {
+                j->error[k] = bc7_block(&b, j->quality, out);
+            }
+        }
+    }
+}
+
+// With the 'b' debug flag, decodes every block again and compares its error
+// with what the encoder measured.
+static void bc_check(const BCJobs *j, size_t blocks) {
+    static const char *name[] = {"R8", "RGBA8", "BC1", "BC3", "BC7"};
+    size_t size = bc_block_size(j->format), mismatch = 0;
+    uint64_t total = 0;
+    for(size_t k = 0; k < blocks; ++k) {
+        Block b;
+        RGBA dec[16];
+        load_block(j->src, j->width, j->height, k % j->bw, k / j->bw, &b);
+        decode_block(j->format, j->dst + k * size, dec);
+        uint32_t err = 0;
+        for(int i = 0; i < 16; ++i) {
+            uint8_t *d = (uint8_t*)&dec[i];
+            for(int c = 0; c < 4; ++c) err += (b.px[i][c] - d[c]) * (b.px[i][c] - d[c]);
+        }
+        if(err != j->error[k]) {
+            if(!mismatch) printf("%s block %llu: encoder error %u, decoded %u\n", name[j->format], k, j->error[k], err);
+            ++mismatch;
+        }
+        total += err;
+    }
+    double mse = (double)total / (blocks * 64);
+    printf("%s: %llu blocks, %.2f dB PSNR, %llu mismatched\n", name[j->format], blocks, mse ? 10 * log10(255 * 255 / mse) : 99.0, mismatch);
+}
+
+// Encodes RGBA pixels to BC1, BC3 or BC7 blocks in row order, one row of
+// blocks per job. Returns NULL when out of memory.
+uint8_t *bc_encode(const RGBA *src, uint32_t width, uint32_t height, TextureFormat format, BCQuality quality) {
+    bc_init();
+    uint32_t bw = (width + 3) / 4, bh = (height + 3) / 4;
+    size_t blocks = (size_t)bw * bh;
+    BCJobs j = {
+        .src = src, .width = width, .height = height, .bw = bw, .format = format, .quality = quality,
+        .dst = malloc(blocks * bc_block_size(format)),
+        .error = malloc(blocks * sizeof(uint32_t))
+    };
+    if(!j.dst || !j.error) {
+        free(j.dst);
+        free(j.error);
+        return NULL;
+    }
+    pool_run(bh, options.threads, bc_row_job, &j);
+    if(dbg('b')) bc_check(&j, blocks);
+    free(j.error);
+    return j.dst;
+}
@@ -0,0 +1,12 @@
+#ifndef XENO_BC_H
+#define XENO_BC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "xenotool.h"
+
+size_t bc_block_size(TextureFormat format);
+uint8_t *bc_encode(const RGBA *src, uint32_t width, uint32_t height, TextureFormat format, BCQuality quality);
+
+#endif
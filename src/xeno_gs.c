@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "xeno_gs.h"
+#include "pool.h"
+#include "xenotool.h"
+#include "macro.h"
+
+// GS local memory is made of 8 KB pages of 32 256 byte blocks, each block
+// of 4 64 byte columns. A page holds 64x32 PSMCT32, 128x64 PSMT8 or
+// 128x128 PSMT4 texels, the tables below place each of them in it.
+
+#define GS_PAGE_SIZE 8192
+#define GS_BLOCK_SIZE 256
+
+static const uint8_t block32[4][8] = {
+    { 0,  1,  4,  5, 16, 17, 20, 21},
+    { 2,  3,  6,  7, 18, 19, 22, 23},
+    { 8,  9, 12, 13, 24, 25, 28, 29},
+    {10, 11, 14, 15, 26, 27, 30, 31}
+};
+
+static const uint8_t block4[8][4] = {
+    { 0,  2,  8, 10},
+    { 1,  3,  9, 11},
+    { 4,  6, 12, 14},
+    { 5,  7, 13, 15},
+    {16, 18, 24, 26},
+    {17, 19, 25, 27},
+    {20, 22, 28, 30},
+    {21, 23, 29, 31}
+};
+
+// word of a column holding PSMCT32 texel x of row y, for 8x2 texels
+static const uint8_t column_word32[2][8] = {
+    {0, 1, 4, 5,  8,  9, 12, 13},
+    {2, 3, 6, 7, 10, 11, 14, 15}
+};
+
+// Texel y * w + x of a page to its word (PSMCT32), byte (PSMT8) or nibble
+// (PSMT4) in the page.
+static uint16_t page32[32][64];
+static uint16_t page8[64][128];
+static uint16_t page4[128][128];
+static bool gs_ready;
+
+// PSMT8 and PSMT4 columns are four rows. The last two rows swap the
+// halves of the word order and every other column starts swapped.
+static uint32_t column_word(uint32_t x, uint32_t y, uint32_t column) {
+    return column_word32[y & 1][x & 7] ^ ((((y >> 1) ^ column) & 1) ? 8 : 0);
+}
+
+static void gs_init() {
+    if(gs_ready) return;
+    for(uint32_t y = 0; y < 32; ++y) {
+        for(uint32_t x = 0; x < 64; ++x) {
+            uint32_t column = (y & 7) >> 1;
+            page32[y][x] = block32[y >> 3][x >> 3] * 64 + column * 16 + column_word32[y & 1][x & 7];
+        }
+    }
+    // bytes 0 and 2 of a word hold rows 0 and 1 of the column, 1 and 3 rows 2 and 3
+    for(uint32_t y = 0; y < 64; ++y) {
+        for(uint32_t x = 0; x < 128; ++x) {
+            uint32_t column = (y & 15) >> 2;
+            uint32_t word = block32[y >> 4][x >> 4] * 64 + column * 16 + column_word(x, y & 3, column);
+            page8[y][x] = word * 4 + ((x >> 3) & 1) * 2 + ((y & 3) >> 1);
+        }
+    }
+    for(uint32_t y = 0; y < 128; ++y) {
+        for(uint32_t x = 0; x < 128; ++x) {
+            uint32_t column = (y & 15) >> 2;
+            uint32_t word = block4[y >> 4][x >> 5] * 64 + column * 16 + column_word(x, y & 3, column);
+            page4[y][x] = word * 8 + ((x >> 3) & 3) * 2 + ((y & 3) >> 1);
+        }
+    }
+    gs_ready = true;
+}
+
+static uint32_t page_width(GSPixelFormat psm) {
+    return psm == GS_PSMCT32 ? 64 : 128;
+}
+
+static uint32_t page_height(GSPixelFormat psm) {
+    return psm == GS_PSMCT32 ? 32 : psm == GS_PSMT8 ? 64 : 128;
+}
+
+typedef struct {
+    uint8_t *vram;
+    const GSBuffer *buf;
+    uint32_t x, y, w, h;
+    uint8_t *host;
+    size_t stride;
+    bool write;
+} GSTransfer;
+
+#define GS_ADDR(a) ((a) & (GS_VRAM_SIZE - 1))
+
+// Texels [x, x1) of one page row, `page` is the byte address of the page
+// and `table` its row of the page table.
+static void transfer32(uint8_t *vram, bool write, size_t page, const uint16_t *table, uint32_t x, uint32_t x1, uint8_t *host) {
+    // texels 2n and 2n + 1 are always next to each other
+    if(x & 1) {
+        size_t a = GS_ADDR(page + table[x++ & 63] * 4);
+        write ? memcpy(vram + a, host, 4) : memcpy(host, vram + a, 4);
+        host += 4;
+    }
+    if(write) {
+        for(; x + 1 < x1; x += 2, host += 8) memcpy(vram + GS_ADDR(page + table[x & 63] * 4), host, 8);
+    } else {
+        for(; x + 1 < x1; x += 2, host += 8) memcpy(host, vram + GS_ADDR(page + table[x & 63] * 4), 8);
+    }
+    if(x < x1) {
+        size_t a = GS_ADDR(page + table[x & 63] * 4);
+        write ? memcpy(vram + a, host, 4) : memcpy(host, vram + a, 4);
+    }
+}
+
+static void transfer8(uint8_t *vram, bool write, size_t page, const uint16_t *table, uint32_t x, uint32_t x1, uint8_t *host) {
+    if(write) {
+        for(; x < x1; ++x) vram[GS_ADDR(page + table[x & 127])] = *host++;
+    } else {
+        for(; x < x1; ++x) *host++ = vram[GS_ADDR(page + table[x & 127])];
+    }
+}
+
+static void transfer4(uint8_t *vram, bool write, size_t page, const uint16_t *table, uint32_t x, uint32_t x1, uint8_t *host) {
+    for(; x < x1; ++x, ++host) {
+        size_t nibble = page * 2 + table[x & 127];
+        uint8_t *m = vram + GS_ADDR(nibble >> 1);
+        int shift = (nibble & 1) * 4;
+        if(write) {
+            *m = (*m & ~(0xf << shift)) | ((*host & 0xf) << shift);
+        } else {
+            *host = (*m >> shift) & 0xf;
+        }
+    }
+}
+
+// texels [x0, x1) of rows [y0, y1), one at a time
+static void transfer_rows(const GSTransfer *t, uint32_t x0, uint32_t x1, uint32_t y0, uint32_t y1) {
+    GSPixelFormat psm = t->buf->psm;
+    uint32_t pw = page_width(psm), ph = page_height(psm);
+    uint32_t pages = psm == GS_PSMCT32 ? t->buf->bw : MAX(t->buf->bw / 2, 1);
+    size_t texel = psm == GS_PSMCT32 ? 4 : 1;
+    size_t base = (size_t)t->buf->bp * GS_BLOCK_SIZE;
+    for(uint32_t y = y0; y < y1; ++y) {
+        size_t row = base + (size_t)(y / ph) * pages * GS_PAGE_SIZE;
+        uint8_t *host = t->host + (y - t->y) * t->stride * texel;
+        for(uint32_t x = x0; x < x1;) {
+            uint32_t end = MIN(x1, (x / pw + 1) * pw);
+            size_t page = row + (x / pw) * GS_PAGE_SIZE;
+            uint8_t *h = host + (x - t->x) * texel;
+            switch(psm) {
+                case GS_PSMCT32: transfer32(t->vram, t->write, page, page32[y & 31], x, end, h); break;
+                case GS_PSMT8: transfer8(t->vram, t->write, page, page8[y & 63], x, end, h); break;
+                case GS_PSMT4: transfer4(t->vram, t->write, page, page4[y & 127], x, end, h); break;
+            }
+            x = end;
+        }
+    }
+}
+
+#ifdef __SSE2__
+// Reads a 16x16 PSMT8 block. Its 4 columns, seen as PSMCT32, are two rows
+// of 8 texels each: words 0, 1, 4, 5, 8, 9, 12, 13 and the odd pairs.
+// Such a row holds texture rows y and y + 2 of the same group of four:
+// bytes 0 and 2 of every word for y, bytes 1 and 3 for y + 2, with the
+// words rotated by 4 on every other row.
+static void read8_block(const uint8_t *b, uint8_t *dst, size_t stride) {
+    const __m128i mask = _mm_set1_epi32(0xff);
+    for(int r = 0; r < 8; ++r) {
+        const __m128i *c = (const __m128i*)(b + (r >> 1) * 64);
+        __m128i v0 = _mm_loadu_si128(c), v1 = _mm_loadu_si128(c + 1);
+        __m128i v2 = _mm_loadu_si128(c + 2), v3 = _mm_loadu_si128(c + 3);
+        __m128i lo = r & 1 ? _mm_unpackhi_epi64(v0, v1) : _mm_unpacklo_epi64(v0, v1);
+        __m128i hi = r & 1 ? _mm_unpackhi_epi64(v2, v3) : _mm_unpacklo_epi64(v2, v3);
+        __m128i b0 = _mm_packs_epi32(_mm_and_si128(lo, mask), _mm_and_si128(hi, mask));
+        __m128i b1 = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 8), mask), _mm_and_si128(_mm_srli_epi32(hi, 8), mask));
+        __m128i b2 = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 16), mask), _mm_and_si128(_mm_srli_epi32(hi, 16), mask));
+        __m128i b3 = _mm_packs_epi32(_mm_srli_epi32(lo, 24), _mm_srli_epi32(hi, 24));
+        __m128i row0 = _mm_packus_epi16(b0, b2);
+        __m128i row1 = _mm_packus_epi16(b1, b3);
+        int y = (r >> 1) * 4 + (r & 1);
+        if((r >> 1) & 1) {
+            row0 = _mm_shuffle_epi32(row0, _MM_SHUFFLE(2, 3, 0, 1));
+        } else {
+            row1 = _mm_shuffle_epi32(row1, _MM_SHUFFLE(2, 3, 0, 1));
+        }
+        _mm_storeu_si128((__m128i*)(dst + y * stride), row0);
+        _mm_storeu_si128((__m128i*)(dst + (y + 2) * stride), row1);
+    }
+}
+
+// whole blocks of a PSMT8 read, x and y multiples of 16
+static void read8_blocks(const GSTransfer *t, uint32_t x0, uint32_t x1, uint32_t y0, uint32_t y1) {
+    uint32_t pages = MAX(t->buf->bw / 2, 1);
+    size_t base = (size_t)t->buf->bp * GS_BLOCK_SIZE;
+    for(uint32_t y = y0; y < y1; y += 16) {
+        size_t row = base + (size_t)(y / 64) * pages * GS_PAGE_SIZE;
+        for(uint32_t x = x0; x < x1; x += 16) {
+            size_t block = row + (x / 128) * GS_PAGE_SIZE + block32[(y & 63) >> 4][(x & 127) >> 4] * GS_BLOCK_SIZE;
+            read8_block(t->vram + GS_ADDR(block), t->host + (y - t->y) * t->stride + (x - t->x), t->stride);
+        }
+    }
+}
+#endif
+
+// One job per row of pages, so PSMT4 writes never share a byte with
+// another job.
+static void gs_transfer_job(void *ctx, size_t job, size_t worker) {
+    (void)worker;
+    const GSTransfer *t = ctx;
+    uint32_t ph = page_height(t->buf->psm);
+    uint32_t x0 = t->x, x1 = t->x + t->w;
+    uint32_t y0 = MAX(t->y, (t->y / ph + job) * ph);
+    uint32_t y1 = MIN(t->y + t->h, (t->y / ph + job + 1) * ph);
+#ifdef __SSE2__
+    // PSMT8 reads are most of the work, whole blocks of them go through SIMD
+    uint32_t bx0 = (x0 + 15) & ~15u, bx1 = x1 & ~15u, by0 = (y0 + 15) & ~15u, by1 = y1 & ~15u;
+    if(t->buf->psm == GS_PSMT8 && !t->write && bx0 < bx1 && by0 < by1) {
+        read8_blocks(t, bx0, bx1, by0, by1);
+        transfer_rows(t, x0, x1, y0, by0);
+        transfer_rows(t, x0, bx0, by0, by1);
+        transfer_rows(t, bx1, x1, by0, by1);
+        transfer_rows(t, x0, x1, by1, y1);
+        return;
+    }
+#endif
+    transfer_rows(t, x0, x1, y0, y1);
+}
+
+static void gs_transfer(GSTransfer *t) {
+    if(!t->w || !t->h) return;
+    gs_init();
+    uint32_t ph = page_height(t->buf->psm);
+    pool_run((t->y + t->h - 1) / ph - t->y / ph + 1, options.threads, gs_transfer_job, t);
+}
+
+// host to local, like a BITBLTBUF/TRXPOS/TRXREG upload
+void gs_write(uint8_t *vram, const GSBuffer *buf, uint32_t x, uint32_t y, uint32_t w, uint32_t h, const void *src, size_t stride) {
+    GSTransfer t = {.vram = vram, .buf = buf, .x = x, .y = y, .w = w, .h = h, .host = (uint8_t*)src, .stride = stride, .write = true};
+    gs_transfer(&t);
+}
+
+// local to host
+void gs_read(const uint8_t *vram, const GSBuffer *buf, uint32_t x, uint32_t y, uint32_t w, uint32_t h, void *dst, size_t stride) {
+    GSTransfer t = {.vram = (uint8_t*)vram, .buf = buf, .x = x, .y = y, .w = w, .h = h, .host = dst, .stride = stride, .write = false};
+    gs_transfer(&t);
+}
+
+// CSM1 CLUT at (x, y) of a PSMCT32 buffer: 16 entries are an 8x2 rect, 256
+// a 16x16 one with entries 8-15 and 16-23 of every 32 swapped.
+void gs_read_clut(const uint8_t *vram, const GSBuffer *buf, uint32_t x, uint32_t y, uint32_t count, RGBA *pal) {
+    uint32_t w = count == 256 ? 16 : 8;
+    RGBA rect[256];
+    gs_read(vram, buf, x, y, w, count / w, rect, w);
+    for(uint32_t i = 0; i < count; ++i) {
+        uint32_t p = count == 256 ? (i & ~0x18u) | ((i & 0x08) << 1) | ((i & 0x10) >> 1) : i;
+        pal[i] = rect[p];
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef XENO_GS_H
+#define XENO_GS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "xenotool.h"
+
+#define GS_VRAM_SIZE (4 << 20)
+
+typedef enum {
+    GS_PSMCT32,
+    GS_PSMT8,
+    GS_PSMT4
+} GSPixelFormat;
+
+// A buffer in GS local memory like TEX0/BITBLTBUF describe one: bp in 256
+// byte blocks, bw in 64 texel units.
+typedef struct {
+    uint32_t bp;
+    uint32_t bw;
+    GSPixelFormat psm;
+} GSBuffer;
+
+// Host side texels are 4 bytes for PSMCT32 and one byte for PSMT8 and
+// PSMT4, stride texels a row.
+void gs_write(uint8_t *vram, const GSBuffer *buf, uint32_t x, uint32_t y, uint32_t w, uint32_t h, const void *src, size_t stride);
+void gs_read(const uint8_t *vram, const GSBuffer *buf, uint32_t x, uint32_t y, uint32_t w, uint32_t h, void *dst, size_t stride);
+void gs_read_clut(const uint8_t *vram, const GSBuffer *buf, uint32_t x, uint32_t y, uint32_t count, RGBA *pal);
+
+#endif
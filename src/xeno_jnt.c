@@ -4,6 +4,7 @@
 #include <math.h>
 
 #include "xeno_jnt.h"
+#include "arena.h"
 #include "xenotool.h"
 #include "xenodebug.h"
 #include "jnt_file.h"
@@ -66,27 +67,28 @@ void treeprint(int *a, int len, int depth, int root, uint64_t lines) {
 
 */
 
-int parse_jnt(char *filename) {
-    FILE *fp = fopen(filename, "rb");
+int parse_jnt(mfile *mf, arena *a) {
     JNTHeader jnt_h;
-    fread(&jnt_h, sizeof(JNTHeader), 1, fp);
+    if(!mfile_read(mf, &jnt_h, sizeof(JNTHeader))) return -1;
     print_jntheader(jnt_h);
+    if(jnt_h.offset < 0x10) return -1;
     size_t extra_len = jnt_h.offset - 0x10;
-    uint16_t *extra = malloc(extra_len);
-    fread(extra, extra_len, 1, fp);
+    uint16_t *extra = (uint16_t*)mfile_get_ptr(mf, extra_len);
+    if(!extra) return -1;
     if(extra_len) {
         if(dbg('j')) print_void(extra, extra_len / sizeof(uint16_t), 8, sizeof(uint16_t), "% 6u ");
         if(dbg('j')) print_bytes(extra, extra_len);
     }
-    JNTBlock *block = malloc(sizeof(JNTBlock) * jnt_h.block_count);
-    fread(block, sizeof(JNTBlock), jnt_h.block_count, fp);
+    JNTBlock *block = arena_alloc(a, sizeof(JNTBlock) * jnt_h.block_count);
+    if(!block || !mfile_read(mf, block, sizeof(JNTBlock) * jnt_h.block_count)) return -1;
     blockp = block;
     // uint16_t counts[0xff];
     // memset(counts, 0, sizeof(uint16_t) * 0xff);
     uint16_t cc[8][8];
     memset(cc, 0, sizeof(cc[0][0]) * 8 * 8);
-    int *arr = malloc(sizeof(int) * jnt_h.block_count);
-    pos = malloc(sizeof(f3) * jnt_h.block_count);
+    int *arr = arena_alloc(a, sizeof(int) * jnt_h.block_count);
+    pos = arena_alloc(a, sizeof(f3) * jnt_h.block_count);
+    if(!arr || !pos) return -1;
     float f[3] = {0,0,0};
     for(int i = 0; i < jnt_h.block_count; ++i) {
         arr[i] = block[i].header.unk7;
@@ -116,15 +118,12 @@ int parse_jnt(char *filename) {
     pos[0] = (f3){0,0,0};
     if(dbg('T')) treeprint(arr,jnt_h.block_count, 0, 0, 0);
     if(dbg('T')) printf("%d leaves\n", leaves);
-    free(arr);
-    free(pos);
     uint8_t val = 0;
-    fread(&val, 1, 1, fp);
-    fclose(fp);
+    mfile_read(mf, &val, 1);
     if(val) {
         printf("%d\n", val);
         return -1;
     }
-    if(getc(fp) != EOF) return -1;
+    if(!mfile_eof(mf)) return -1;
     return 0;
 }
\ No newline at end of file
@@ -1,6 +1,9 @@
 #ifndef XENO_JNT_H
 #define XENO_JNT_H
 
-int parse_jnt(char *filename);
+#include "mfile.h"
+#include "arena.h"
+
+int parse_jnt(mfile *f, arena *a);
 
 #endif
\ No newline at end of file
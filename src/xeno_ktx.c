@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "xeno_ktx.h"
+#include "xeno_bc.h"
+
+// KTX2 and DDS containers. The pixels or blocks go to the file as they are
+// after a fixed size header, so a reader can map the file and upload the
+// image without decoding anything.
+
+#define KTX2_VK_FORMAT_R8_UNORM 9
+#define KTX2_VK_FORMAT_R8_SRGB 15
+#define KTX2_VK_FORMAT_R8G8B8A8_UNORM 37
+#define KTX2_VK_FORMAT_R8G8B8A8_SRGB 43
+#define KTX2_VK_FORMAT_BC1_RGBA_UNORM_BLOCK 133
+#define KTX2_VK_FORMAT_BC1_RGBA_SRGB_BLOCK 134
+#define KTX2_VK_FORMAT_BC3_UNORM_BLOCK 137
+#define KTX2_VK_FORMAT_BC3_SRGB_BLOCK 138
+#define KTX2_VK_FORMAT_BC7_UNORM_BLOCK 145
+#define KTX2_VK_FORMAT_BC7_SRGB_BLOCK 146
+
+#define KTX2_DF_MODEL_RGBSDA 1
+#define KTX2_DF_MODEL_BC1A 128
+#define KTX2_DF_MODEL_BC3 130
+#define KTX2_DF_MODEL_BC7 134
+#define KTX2_DF_PRIMARIES_BT709 1
+#define KTX2_DF_TRANSFER_LINEAR 1
+#define KTX2_DF_TRANSFER_SRGB 2
+#define KTX2_DF_CHANNEL_ALPHA 15
+#define KTX2_DF_CHANNEL_BC1A_ALPHAPRESENT 1
+#define KTX2_DF_QUALIFIER_LINEAR 0x10
+
+typedef struct {
+    uint8_t identifier[12];
+    uint32_t vk_format;
+    uint32_t type_size;
+    uint32_t pixel_width;
+    uint32_t pixel_height;
+    uint32_t pixel_depth;
+    uint32_t layer_count;
+    uint32_t face_count;
+    uint32_t level_count;
+    uint32_t supercompression_scheme;
+    uint32_t dfd_byte_offset;
+    uint32_t dfd_byte_length;
+    uint32_t kvd_byte_offset;
+    uint32_t kvd_byte_length;
+    uint64_t sgd_byte_offset;
+    uint64_t sgd_byte_length;
+} KTX2Header;
+
+typedef struct {
+    uint64_t byte_offset;
+    uint64_t byte_length;
+    uint64_t uncompressed_byte_length;
+} KTX2Level;
+
+#define DDS_MAGIC 0x20534444
+#define DDSD_CAPS 0x1
+#define DDSD_HEIGHT 0x2
+#define DDSD_WIDTH 0x4
+#define DDSD_PITCH 0x8
+#define DDSD_PIXELFORMAT 0x1000
+#define DDSD_LINEARSIZE 0x80000
+#define DDPF_ALPHAPIXELS 0x1
+#define DDPF_FOURCC 0x4
+#define DDPF_RGB 0x40
+#define DDPF_LUMINANCE 0x20000
+#define DDSD_MIPMAPCOUNT 0x20000
+#define DDSCAPS_COMPLEX 0x8
+#define DDSCAPS_TEXTURE 0x1000
+#define DDSCAPS_MIPMAP 0x400000
+#define DDS_FOURCC_DXT1 0x31545844
+#define DDS_FOURCC_DXT5 0x35545844
+#define DDS_FOURCC_DX10 0x30315844
+#define DXGI_FORMAT_BC7_UNORM 98
+#define DXGI_FORMAT_BC7_UNORM_SRGB 99
+#define DDS_DIMENSION_TEXTURE2D 3
+
+typedef struct {
+    uint32_t size;
+    uint32_t flags;
+    uint32_t four_cc;
+    uint32_t rgb_bit_count;
+    uint32_t r_mask;
+    uint32_t g_mask;
+    uint32_t b_mask;
+    uint32_t a_mask;
+} DDSPixelFormat;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+    uint32_t flags;
+    uint32_t height;
+    uint32_t width;
+    uint32_t pitch_or_linear_size;
+    uint32_t depth;
+    uint32_t mip_map_count;
+    uint32_t reserved1[11];
+    DDSPixelFormat ddspf;
+    uint32_t caps;
+    uint32_t caps2;
+    uint32_t caps3;
+    uint32_t caps4;
+    uint32_t reserved2;
+} DDSHeader;
+
+typedef struct {
+    uint32_t dxgi_format;
+    uint32_t resource_dimension;
+    uint32_t misc_flag;
+    uint32_t array_size;
+    uint32_t misc_flags2;
+} DDSHeaderDX10;
+
+static bool format_compressed(TextureFormat format) {
+    return format == TEX_FORMAT_BC1 || format == TEX_FORMAT_BC3 || format == TEX_FORMAT_BC7;
+}
+
+// bytes per texel, or per 4x4 block for the BC formats
+static uint32_t format_unit_size(TextureFormat format) {
+    if(format_compressed(format)) return bc_block_size(format);
+    return format == TEX_FORMAT_RGBA8 ? 4 : 1;
+}
+
+static size_t format_data_size(TextureFormat format, uint32_t width, uint32_t height) {
+    if(format_compressed(format)) return (size_t)((width + 3) / 4) * ((height + 3) / 4) * bc_block_size(format);
+    return (size_t)width * height * format_unit_size(format);
+}
+
+// Writes a KTX2 texture with level_count mip levels, largest first. srgb
+// marks the color channels as sRGB encoded, alpha stays linear.
+bool ktx2_write(const char *filename, const TexLevel *levels, uint32_t level_count, TextureFormat format, bool srgb) {
+    if(!level_count || level_count > MIP_MAX_LEVELS || !levels[0].width || !levels[0].height) return false;
+    uint32_t unit = format_unit_size(format);
+
+    // basic data format descriptor, one sample per channel, the BC formats
+    // describe the whole block with one sample per color and alpha part
+    uint32_t samples;
+    uint32_t dfd[1 + 6 + 4 * 4] = {0};
+    uint32_t vk_format, model;
+    switch(format) {
+        case TEX_FORMAT_R8: {
+            vk_format = srgb ? KTX2_VK_FORMAT_R8_SRGB : KTX2_VK_FORMAT_R8_UNORM;
+            model = KTX2_DF_MODEL_RGBSDA;
+            samples = 1;
+            break;
+        }
+        case TEX_FORMAT_RGBA8: {
+            vk_format = srgb ? KTX2_VK_FORMAT_R8G8B8A8_SRGB : KTX2_VK_FORMAT_R8G8B8A8_UNORM;
+            model = KTX2_DF_MODEL_RGBSDA;
+            samples = 4;
+            break;
+        }
+        case TEX_FORMAT_BC1: {
+            vk_format = srgb ? KTX2_VK_FORMAT_BC1_RGBA_SRGB_BLOCK : KTX2_VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
+            model = KTX2_DF_MODEL_BC1A;
+            samples = 1;
+            dfd[7] = 63 << 16 | KTX2_DF_CHANNEL_BC1A_ALPHAPRESENT << 24;
+            break;
+        }
+        case TEX_FORMAT_BC3: {
+            vk_format = srgb ? KTX2_VK_FORMAT_BC3_SRGB_BLOCK : KTX2_VK_FORMAT_BC3_UNORM_BLOCK;
+            model = KTX2_DF_MODEL_BC3;
+            samples = 2;
+            dfd[7] = 63 << 16 | KTX2_DF_CHANNEL_ALPHA << 24;
+            dfd[11] = 64 | 63 << 16;
+            break;
+        }
+        default: {
+            vk_format = srgb ? KTX2_VK_FORMAT_BC7_SRGB_BLOCK : KTX2_VK_FORMAT_BC7_UNORM_BLOCK;
+            model = KTX2_DF_MODEL_BC7;
+            samples = 1;
+            dfd[7] = 127 << 16;
+        }
+    }
+    uint32_t dfd_length = (1 + 6 + 4 * samples) * sizeof(uint32_t);
+    dfd[0] = dfd_length;
+    dfd[2] = 2 | (6 + 4 * samples) * sizeof(uint32_t) << 16;
+    dfd[3] = model | KTX2_DF_PRIMARIES_BT709 << 8 | (srgb ? KTX2_DF_TRANSFER_SRGB : KTX2_DF_TRANSFER_LINEAR) << 16;
+    dfd[5] = unit;
+    if(format_compressed(format)) {
+        dfd[4] = 3 | 3 << 8;
+        for(uint32_t k = 0; k < samples; ++k) dfd[7 + k * 4 + 3] = 0xffffffff;
+    } else {
+        for(uint32_t c = 0; c < samples; ++c) {
+            uint32_t *s = &dfd[7 + c * 4];
+            uint32_t channel = c == 3 ? KTX2_DF_CHANNEL_ALPHA | (srgb ? KTX2_DF_QUALIFIER_LINEAR : 0) : c;
+            s[0] = c * 8 | 7 << 16 | channel << 24;
+            s[3] = 0xff;
+        }
+    }
+
+    // key/value data, each entry padded to 4 bytes
+    static const char writer[] = "KTXwriter\0xenotool";
+    uint8_t kvd[4 + sizeof(writer) + 3] = {0};
+    uint32_t kv_length = sizeof(writer);
+    memcpy(kvd, &kv_length, 4);
+    memcpy(kvd + 4, writer, sizeof(writer));
+    uint32_t kvd_length = (4 + kv_length + 3) & ~3u;
+
+    KTX2Header h = {
+        .identifier = {0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n'},
+        .vk_format = vk_format,
+        .type_size = 1,
+        .pixel_width = levels[0].width,
+        .pixel_height = levels[0].height,
+        .face_count = 1,
+        .level_count = level_count,
+        .dfd_byte_offset = sizeof(KTX2Header) + level_count * sizeof(KTX2Level),
+        .dfd_byte_length = dfd_length
+    };
+    h.kvd_byte_offset = h.dfd_byte_offset + dfd_length;
+    h.kvd_byte_length = kvd_length;
+    // the smallest level comes first in the file, every level is aligned
+    // to lcm(texel or block size, 4)
+    uint32_t align = unit % 4 ? 4 : unit;
+    KTX2Level index[MIP_MAX_LEVELS];
+    uint64_t offset = h.kvd_byte_offset + kvd_length;
+    for(uint32_t i = level_count; i-- > 0;) {
+        offset = (offset + align - 1) / align * align;
+        size_t length = format_data_size(format, levels[i].width, levels[i].height);
+        index[i] = (KTX2Level){offset, length, length};
+        offset += length;
+    }
+
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) return false;
+    bool ok = fwrite(&h, sizeof(KTX2Header), 1, fp) == 1 &&
+              fwrite(index, sizeof(KTX2Level), level_count, fp) == level_count &&
+              fwrite(dfd, 1, dfd_length, fp) == dfd_length &&
+              fwrite(kvd, 1, kvd_length, fp) == kvd_length;
+    offset = h.kvd_byte_offset + kvd_length;
+    static const uint8_t zero[16] = {0};
+    for(uint32_t i = level_count; ok && i-- > 0;) {
+        size_t padding = index[i].byte_offset - offset;
+        ok = fwrite(zero, 1, padding, fp) == padding &&
+             fwrite(levels[i].data, 1, index[i].byte_length, fp) == index[i].byte_length;
+        offset = index[i].byte_offset + index[i].byte_length;
+    }
+    if(fclose(fp)) ok = false;
+    return ok;
+}
+
+// Writes a plain DDS header for luminance, RGBA, BC1 (DXT1) and BC3
+// (DXT5), which every DDS reader understands. BC7 needs the DX10 header,
+// the only one that can say sRGB. Levels are stored largest first.
+bool dds_write(const char *filename, const TexLevel *levels, uint32_t level_count, TextureFormat format, bool srgb) {
+    if(!level_count || !levels[0].width || !levels[0].height) return false;
+    uint32_t width = levels[0].width, height = levels[0].height;
+    size_t data_length = format_data_size(format, width, height);
+    uint32_t unit = format_unit_size(format);
+    DDSHeader h = {
+        .magic = DDS_MAGIC,
+        .size = sizeof(DDSHeader) - sizeof(uint32_t),
+        .flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PITCH | DDSD_PIXELFORMAT,
+        .height = height,
+        .width = width,
+        .pitch_or_linear_size = width * unit,
+        .ddspf = {.size = sizeof(DDSPixelFormat), .rgb_bit_count = unit * 8, .r_mask = 0xff},
+        .caps = DDSCAPS_TEXTURE
+    };
+    DDSHeaderDX10 dx10 = {
+        .dxgi_format = srgb ? DXGI_FORMAT_BC7_UNORM_SRGB : DXGI_FORMAT_BC7_UNORM,
+        .resource_dimension = DDS_DIMENSION_TEXTURE2D,
+        .array_size = 1
+    };
+    if(format_compressed(format)) {
+        h.flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_LINEARSIZE | DDSD_PIXELFORMAT;
+        h.pitch_or_linear_size = data_length;
+        h.ddspf = (DDSPixelFormat){.size = sizeof(DDSPixelFormat), .flags = DDPF_FOURCC};
+        h.ddspf.four_cc = format == TEX_FORMAT_BC1 ? DDS_FOURCC_DXT1 : format == TEX_FORMAT_BC3 ? DDS_FOURCC_DXT5 : DDS_FOURCC_DX10;
+    } else if(format == TEX_FORMAT_RGBA8) {
+        h.ddspf.flags = DDPF_RGB | DDPF_ALPHAPIXELS;
+        h.ddspf.g_mask = 0xff00;
+        h.ddspf.b_mask = 0xff0000;
+        h.ddspf.a_mask = 0xff000000;
+    } else {
+        h.ddspf.flags = DDPF_LUMINANCE;
+    }
+    if(level_count > 1) {
+        h.flags |= DDSD_MIPMAPCOUNT;
+        h.mip_map_count = level_count;
+        h.caps |= DDSCAPS_COMPLEX | DDSCAPS_MIPMAP;
+    }
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) return false;
+    bool ok = fwrite(&h, sizeof(DDSHeader), 1, fp) == 1 &&
+              (format != TEX_FORMAT_BC7 || fwrite(&dx10, sizeof(DDSHeaderDX10), 1, fp) == 1);
+    for(uint32_t i = 0; ok && i < level_count; ++i) {
+        size_t length = format_data_size(format, levels[i].width, levels[i].height);
+        ok = fwrite(levels[i].data, 1, length, fp) == length;
+    }
+    if(fclose(fp)) ok = false;
+    return ok;
+}
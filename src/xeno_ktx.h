@@ -0,0 +1,12 @@
+#ifndef XENO_KTX_H
+#define XENO_KTX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "xenotool.h"
+
+bool ktx2_write(const char *filename, const TexLevel *levels, uint32_t level_count, TextureFormat format, bool srgb);
+bool dds_write(const char *filename, const TexLevel *levels, uint32_t level_count, TextureFormat format, bool srgb);
+
+#endif
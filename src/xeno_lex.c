@@ -4,10 +4,15 @@
 #include <math.h>
 
 #include "xeno_lex.h"
+#include "xeno_vif.h"
+#include "xeno_model.h"
+#include "mfile.h"
 #include "xenotool.h"
 #include "xenodebug.h"
 #include "lex_file.h"
 #include "vector.h"
+#include "hashidx.h"
+#include "pool.h"
 #include "macro.h"
 
 #define MAX_J 8
@@ -45,413 +50,552 @@ void fmod_range_vertex(Vertex *v0, Vertex *v1, Vertex *v2, float umin, float uma
     }
 }
 
-int64_t parse_lex(char *filename, Model *model, Texture *tex) {
-    FILE *fp = fopen(filename, "rb");
-    LexFile lex;
-    fread(&lex.header, sizeof(LexHeader), 1, fp);
-    if(dbg('h')) print_lexheader(lex.header);
-    if(!model->name[0]) {
-        memcpy(model->name, lex.header.name + 1, 32);
-        model->name[32] = 0;
-    }
-    
-    lex.mesh_addr = malloc(lex.header.nmesh * sizeof(uint32_t));
-    lex.mesh = malloc(lex.header.nmesh * sizeof(MeshObj));
-    
-    fread(lex.mesh_addr, sizeof(uint32_t), lex.header.nmesh, fp);
-    lex.matrix = malloc(lex.header.nmatrix * 2 * sizeof(float[16]));
-    
-    fseek(fp, lex.header.addr[0], SEEK_SET);
-    for(uint32_t i = 0; i < lex.header.nmatrix * 2; ++i) {
-        fread(lex.matrix[i], sizeof(float[16]), 1, fp);
-        if(dbg('h')) printf("\n%x:\n", i);
-        if(dbg('h')) print_floats(lex.matrix[i], 16, 4);
-    }
-    uint8_t *mem = malloc(4096);
-    memset(mem, 0, 4096);
+// Per-worker VIF scratch, reused for every mesh the worker decodes.
+typedef struct {
+    uint8_t *mem;
+    Vertex *vv;
+    size_t *vi;
+} LexScratch;
+
+// Everything a single mesh produces. Vertices, materials and bones are only
+// deduplicated within the mesh; vertex joint indices refer to the local bone
+// list offset by one so that the literal 0 and -1 values stay untouched.
+// Triangles refer to the local vertex and material lists until merged.
+typedef struct {
+    vector vertex;
+    hashidx vertex_index;
+    vector tri;
+    vector material;
+    vector bone;
+    size_t culled;
+    size_t end;
+    int64_t ret;
+} MeshResult;
+
+typedef struct {
+    mfile *f;
+    LexFile *lex;
+    Texture *tex;
+    LexScratch *scratch;
+    MeshResult *res;
+} LexJobs;
+
+static int16_t push_bone(MeshResult *res, uint32_t bn) {
+    size_t bii;
+    vector_push_unique_i(&res->bone, &bn, &bii);
+    return bii + 1;
+}
+
+// Strip triangles with zero area, the repeated vertices that join strips
+// within a VIF batch. Exact test, so thin but real triangles stay.
+static bool degenerate(const Vertex *a, const Vertex *b, const Vertex *c) {
+    float ux = b->x - a->x, uy = b->y - a->y, uz = b->z - a->z;
+    float vx = c->x - a->x, vy = c->y - a->y, vz = c->z - a->z;
+    return uy * vz - uz * vy == 0 && uz * vx - ux * vz == 0 && ux * vy - uy * vx == 0;
+}
+
+static int64_t decode_mesh(mfile *f, LexFile *lex, uint32_t i, Texture *tex, LexScratch *s, MeshResult *res) {
+    uint8_t *mem = s->mem;
+    Vertex *vv = s->vv;
+    size_t *vi = s->vi;
     size_t data_len = 0;
     size_t j = 0;
     uint8_t *p[MAX_J];
     size_t num[MAX_J];
     size_t components[MAX_J];
-    size_t component_bytes[MAX_J];
-    int64_t tricount = 0;
-    vector boneiv = vector_init(sizeof(uint32_t));
-    Vertex *vv = malloc(sizeof(Vertex) * MAX_V);
-    size_t *vi = malloc(sizeof(size_t) * MAX_V);
     size_t material_index = 0;
-    for(uint32_t i = 0; i < lex.header.nmesh; ++i) {
-        if(dbg('H')) printf("object %d\n", i);
-        fseek(fp, lex.mesh_addr[i], SEEK_SET);
-        fread(&lex.mesh[i].header, sizeof(MeshHeader), 1, fp);
-        vector_push_unique(&boneiv, &(lex.mesh[i].header.bone_idx));
-        if(dbg('H')) print_meshheader(lex.mesh[i].header);
-        MaterialRaw mr = (MaterialRaw){.uvinfo = lex.mesh[i].header.uvinfo, .pal0 = lex.mesh[i].header.pal0};
-        if(dbg('m')) print_materialraw(mr);
-        MaterialColor col = lex.mesh[i].header.col;
-        Material mat = parse_materialraw(mr, tex);
-        mat.col = col;
-        vector_push_unique_i(&model->material, &mat, &material_index);
-        if(dbg('m')) printf("^ material idx %llu\n", material_index);
-        Mesh mesh;
-        mesh.tri = vector_init(sizeof(Triangle));
-        mesh.name[0] = '\0';
-        mesh.weight_format = lex.mesh[i].header.weight_format;
-        snprintf(mesh.name, 64, "%02d/%s/%s", i, lex.mesh[i].header.group_name, lex.mesh[i].header.bone_name);
-        uint32_t next_addr = lex.mesh_addr[i] + lex.mesh[i].header.data_offset + lex.mesh[i].header.data_len;
-        fseek(fp, lex.mesh_addr[i] + lex.mesh[i].header.data_offset, SEEK_SET);
-        uint32_t write_mask = 0;
-        MeshBlockHeader mbh;
-        int vals_per_vert;
-        uint8_t cl = 0;
-        uint8_t wl = 0;
-        size_t vertex_count = 0;
-        while(true) {
-            VIFCommand vif;
-            fread(&vif, sizeof(VIFCommand), 1 , fp);
-            if(feof(fp) || ftell(fp)-4 == (int64_t)next_addr) {
+    if(dbg('H')) printf("object %d\n", i);
+    if(!mfile_seek(f, lex->mesh_addr[i]) || !mfile_read(f, &lex->mesh[i].header, sizeof(MeshHeader))) {
+        printf("Error: LEX mesh %d out of bounds\n", i);
+        return -1;
+    }
+    if(dbg('H')) print_meshheader(lex->mesh[i].header);
+    MaterialRaw mr = (MaterialRaw){.uvinfo = lex->mesh[i].header.uvinfo, .pal0 = lex->mesh[i].header.pal0};
+    if(dbg('m')) print_materialraw(mr);
+    MaterialColor col = lex->mesh[i].header.col;
+    Material mat = parse_materialraw(mr, tex);
+    mat.col = col;
+    vector_push_unique_i(&res->material, &mat, &material_index);
+    if(dbg('m')) printf("^ material idx %llu\n", material_index);
+    uint32_t next_addr = lex->mesh_addr[i] + lex->mesh[i].header.data_offset + lex->mesh[i].header.data_len;
+    if(!mfile_seek(f, lex->mesh_addr[i] + lex->mesh[i].header.data_offset)) goto EOF_ERROR;
+    VIFState vs = {0};
+    MeshBlockHeader mbh;
+    int vals_per_vert;
+    size_t vertex_count = 0;
+    while(true) {
+        VIFCommand vif;
+        if(!mfile_read(f, &vif, sizeof(VIFCommand)) || mfile_tell(f)-4 == next_addr) {
+            break;
+        }
+        if(dbg('c')) print_vifcommand(vif, mfile_tell(f));
+        bool do_process = false;
+        bool do_continue = false;
+        switch(vif.cmd) {
+            case 0x00: {
+                do_continue = true;
                 break;
             }
-            if(dbg('c')) print_vifcommand(vif, ftell(fp));
-            bool do_process = false;
-            bool do_continue = false;
-            switch(vif.cmd) {
-                case 0x00: {
-                    do_continue = true;
-                    break;
+            case 0x01: {
+                vs.cl = vif.imm0;
+                vs.wl = vif.imm1;
+                if(dbg('c')) printf("CL: %d WL: %d\n", vs.cl, vs.wl);
+                do_continue = true;
+                break;
+            }
+            case 0x17: {
+                do_process = true;
+                break;
+            }
+            case 0x20: {
+                if(!mfile_read(f, &vs.mask, 4)) goto EOF_ERROR;
+                if(dbg('c')) printf("write_mask: %08x\n", vs.mask);
+                do_continue = true;
+                break;
+            }
+            case 0x05: {
+                vs.mode = vif.imm & 0x3;
+                if(dbg('c')) printf("mode: %d\n", vs.mode);
+                do_continue = true;
+                break;
+            }
+            case 0x30: {
+                if(!mfile_read(f, vs.row, sizeof(vs.row))) goto EOF_ERROR;
+                if(dbg('c')) print_bytes_dim(vs.row, sizeof(vs.row), 16);
+                do_continue = true;
+                break;
+            }
+            case 0x31: {
+                if(!mfile_read(f, vs.col, sizeof(vs.col))) goto EOF_ERROR;
+                if(dbg('c')) print_bytes_dim(vs.col, sizeof(vs.col), 16);
+                do_continue = true;
+                break;
+            }
+            default: {
+                if(vif.cmd >= 0x60 && vif.cmd < 0x80) {
+                    if(dbg('c')) printf("VIF unpack\n");
+                } else {
+                    printf("\n[0x%08llx] unknown VIF command %02x\n", mfile_tell(f), vif.cmd);
+                    return -1;
                 }
-                case 0x01: {
-                    cl = vif.imm0;
-                    wl = vif.imm1;
-                    if(dbg('c')) printf("CL: %d WL: %d\n", cl, wl);
-                    do_continue = true;
-                    break;
+                break;
+            }
+        }
+        if(do_continue) continue;
+        if(do_process) {
+            if(dbg('D')) printf("\nthis is after a meshblock\n");
+            for(size_t k = 0; k < j && dbg('D'); ++k) {
+                printf("k: %llu\n", k);
+                print_floats(p[k], num[k] * 4, 4);
+                print_bytes_dim(p[k], num[k] * 16, 16);
+            }
+            vertex_count = mbh.count;
+            uint8_t vertex_format = lex->mesh[i].header.vertex_format & 0xf0;
+            switch(j) {
+                case 1: {
+                    if(vertex_format == 0x80) {
+                        p[0] = mem;
+                        p[1] = p[0] + vertex_count * 8 * sizeof(float);
+                        p[2] = p[1] + vertex_count * 4 * sizeof(float);
+                        break;
+                    }
+                    printf("idk homie (j: %llu)\n", j);
+                    return -1;
                 }
-                case 0x17: {
-                    do_process = true;
+                case 0: {
+                    vertex_count = 0;
                     break;
                 }
-                case 0x20: {
-                    fread(&write_mask, 4, 1, fp);
-                    if(dbg('c')) printf("write_mask: %08x\n", write_mask);
-                    do_continue = true;
+                case 2:
+                case 3:
+                case 4:
+                case 5: {
+                    
                     break;
                 }
                 default: {
-                    if(vif.cmd >= 0x60 && vif.cmd < 0x80) {
-                        if(dbg('c')) printf("VIF unpack\n");
-                    } else {
-                        printf("\n[0x%08lx] unknown VIF command %02x\n", ftell(fp), vif.cmd);
-                        return -1;
-                    }
-                    break;
+                    printf("idk homie (j: %llu)\n", j);
+                    return -1;
                 }
             }
-            if(do_continue) continue;
-            if(do_process) {
-                if(dbg('D')) printf("\nthis is after a meshblock\n");
-                for(size_t k = 0; k < j; ++k) {
-                    if(dbg('D')) printf("k: %llu\n", k);
-                    if(component_bytes[k] == 4) {
-                        if(dbg('D')) print_floats(p[k], num[k] * components[k], components[k]);
-                        if(dbg('D')) print_bytes_dim(p[k], num[k] * components[k] * 4, components[k] * 4);
-                    } else if(component_bytes[k] == 1) {
-                        if(dbg('D')) print_bytes_dim(p[k], num[k] * components[k], components[k]);
-                    } else {
-                        printf("oopsie! cant do that :(\n");
-                        return -1;
-                    }
+            if(vertex_count == 0) {
+                memset(mem, 0, data_len);
+                data_len = 0;
+                j = 0;
+                continue;
+            }
+            Material material = ((Material*)res->material.p)[material_index]; 
+            for(size_t v = 0; v < vertex_count; ++v) {
+                vv[v] = (Vertex){0};
+                if(vertex_format == 0x10) {
+                    vv[v].x  = ((float*)p[0])[v * 4];
+                    vv[v].y  = ((float*)p[0])[v * 4 + 1];
+                    vv[v].z  = ((float*)p[0])[v * 4 + 2];
+                    vv[v].nx = vv[v].ny = vv[v].nz = 0;
+                    vv[v].u  = ((float*)p[0])[v * 4 + 3];
+                    vv[v].v  = ((float*)p[1])[v * 4];
+                    size_t j_col = (components[2] == 4 ? 2 : 3);
+                    vv[v].r  = (uint8_t)((uint32_t*)p[j_col])[v * 4] / 128.0f;
+                    vv[v].g  = (uint8_t)((uint32_t*)p[j_col])[v * 4 + 1] / 128.0f;
+                    vv[v].b  = (uint8_t)((uint32_t*)p[j_col])[v * 4 + 2] / 128.0f;
+                    vv[v].a  = (uint8_t)((uint32_t*)p[j_col])[v * 4 + 3] / 128.0f;
+                } else if(vertex_format == 0x80) {
+                    vv[v].x  = ((float*)p[0])[v * 4];
+                    vv[v].y  = ((float*)p[0])[v * 4 + 1];
+                    vv[v].z  = ((float*)p[0])[v * 4 + 2];
+                    vv[v].nx = ((float*)p[0])[v * 4 + vertex_count * 4];
+                    vv[v].ny = ((float*)p[0])[v * 4 + vertex_count * 4 + 1];
+                    vv[v].nz = ((float*)p[0])[v * 4 + vertex_count * 4 + 2];
+                    vv[v].u  = ((float*)p[0])[v * 4 + 3];
+                    vv[v].v  = ((float*)p[0])[v * 4 + vertex_count * 4 + 3];
+                    vv[v].r  = ((float*)p[1])[v * 4] / 128.0f;
+                    vv[v].g  = ((float*)p[1])[v * 4 + 1] / 128.0f;
+                    vv[v].b  = ((float*)p[1])[v * 4 + 2] / 128.0f;
+                    vv[v].a  = ((float*)p[1])[v * 4 + 3] / 128.0f;
+                } else {
+                    printf("[0x%08llx] Error: unknown vertex format! (%02x)\n", mfile_tell(f), vertex_format);
+                    return -1;
                 }
-                vertex_count = mbh.count;
-                uint8_t vertex_format = lex.mesh[i].header.vertex_format & 0xf0;
-                switch(j) {
-                    case 1: {
-                        if(vertex_format == 0x80) {
-                            p[0] = mem;
-                            p[1] = p[0] + vertex_count * 8 * sizeof(float);
-                            p[2] = p[1] + vertex_count * 4 * sizeof(float);
-                            break;
+                switch(lex->mesh[i].header.weight_format) {
+                    case 0: // no weights
+                        for(int n = 0; n < 4; ++n) {
+                            vv[v].w[n] = 0;
+                            vv[v].j[n] = -1;
                         }
-                        printf("idk homie (j: %llu)\n", j);
-                        return -1;
-                    }
-                    case 0: {
-                        vertex_count = 0;
-                        break;
-                    }
-                    case 2:
-                    case 3:
-                    case 4:
-                    case 5: {
-                        
                         break;
-                    }
-                    default: {
-                        printf("idk homie (j: %llu)\n", j);
-                        return -1;
-                    }
-                }
-                if(vertex_count == 0) {
-                    memset(mem, 0, data_len);
-                    data_len = 0;
-                    j = 0;
-                    continue;
-                }
-                Material material = ((Material*)model->material.p)[material_index]; 
-                for(size_t v = 0; v < vertex_count; ++v) {
-                    if(vertex_format == 0x10) {
-                        vv[v].x  = ((float*)p[0])[v * 4];
-                        vv[v].y  = ((float*)p[0])[v * 4 + 1];
-                        vv[v].z  = ((float*)p[0])[v * 4 + 2];
-                        vv[v].nx = vv[v].ny = vv[v].nz = 0;
-                        vv[v].u  = ((float*)p[0])[v * 4 + 3];
-                        vv[v].v  = ((float*)p[1])[v];
-                        size_t j_col = (components[2] == 4 ? 2 : 3);
-                        vv[v].r  = ((uint8_t*)p[j_col])[v * 4] / 128.0f;
-                        vv[v].g  = ((uint8_t*)p[j_col])[v * 4 + 1] / 128.0f;
-                        vv[v].b  = ((uint8_t*)p[j_col])[v * 4 + 2] / 128.0f;
-                        vv[v].a  = ((uint8_t*)p[j_col])[v * 4 + 3] / 128.0f;
-                    } else if(vertex_format == 0x80) {
-                        vv[v].x  = ((float*)p[0])[v * 4];
-                        vv[v].y  = ((float*)p[0])[v * 4 + 1];
-                        vv[v].z  = ((float*)p[0])[v * 4 + 2];
-                        vv[v].nx = ((float*)p[0])[v * 4 + vertex_count * 4];
-                        vv[v].ny = ((float*)p[0])[v * 4 + vertex_count * 4 + 1];
-                        vv[v].nz = ((float*)p[0])[v * 4 + vertex_count * 4 + 2];
-                        vv[v].u  = ((float*)p[0])[v * 4 + 3];
-                        vv[v].v  = ((float*)p[0])[v * 4 + vertex_count * 4 + 3];
-                        vv[v].r  = ((float*)p[1])[v * 4] / 128.0f;
-                        vv[v].g  = ((float*)p[1])[v * 4 + 1] / 128.0f;
-                        vv[v].b  = ((float*)p[1])[v * 4 + 2] / 128.0f;
-                        vv[v].a  = ((float*)p[1])[v * 4 + 3] / 128.0f;
-                    } else {
-                        printf("[0x%08lx] Error: unknown vertex format! (%02x)\n", ftell(fp), vertex_format);
-                        return -1;
-                    }
-                    switch(lex.mesh[i].header.weight_format) {
-                        case 0: // no weights
-                            for(int n = 0; n < 4; ++n) {
-                                vv[v].w[n] = 0;
-                                vv[v].j[n] = -1;
+                    case 1: // 8 values per vert: 4 indices and 4 weights
+                        for(int n = 0; n < 4; ++n) {
+                            vv[v].w[n] = ((float*)p[2])[v * 4 + vertex_count * 4 + n];
+                            uint32_t bone = ((uint32_t*)p[2])[v * 4 + n];
+                            if(bone) {
+                                int32_t bi = (bone / 4) - 184;
+                                if(bi < 0) {puts("negative bone index"); continue;}
+                                vv[v].j[n] = push_bone(res, lex->mesh[i].header.unk2[bi+1]);
+                            } else {
+                                vv[v].j[n] = 0;
                             }
-                            break;
-                        case 1: // 8 values per vert: 4 indices and 4 weights
-                            for(int n = 0; n < 4; ++n) {
-                                vv[v].w[n] = ((float*)p[2])[v * 4 + vertex_count * 4 + n];
-                                uint32_t bone = ((uint32_t*)p[2])[v * 4 + n];
-                                if(bone) {
-                                    int32_t bi = (bone / 4) - 184;
-                                    if(bi < 0) {puts("negative bone index"); continue;}
-                                    size_t bii;
-                                    uint32_t bn = lex.mesh[i].header.unk2[bi+1];
-                                    vector_push_unique_i(&model->bone, &bn, &bii);
-                                    vv[v].j[n] = bii;
-                                } else {
-                                    vv[v].j[n] = 0;
-                                }
-                                
+                            
+                        }
+                        break;
+                    case 3: // 4 values per vert, 1 index and 3 zeroes
+                        for(int n = 0; n < 4; ++n) {
+                            uint32_t bone = ((uint32_t*)p[2])[v * 4 + n];
+                            if(bone) {
+                                vv[v].w[n] = 1;
+                                int32_t bi = (bone / 4) - 184;
+                                if(bi < 0) {puts("negative bone index"); continue;}
+                                vv[v].j[n] = push_bone(res, lex->mesh[i].header.unk2[bi+1]);
+                            } else {
+                                vv[v].w[n] = ((float*)p[2])[v * 4 + n];;
+                                vv[v].j[n] = 0;
                             }
-                            break;
-                        case 3: // 4 values per vert, 1 index and 3 zeroes
-                            for(int n = 0; n < 4; ++n) {
+                        }
+                        break;
+                    case 5: // 4 values per vert, 2 indices and 2 weights
+                        for(int n = 0; n < 4; ++n) {
+                            if(n < 2) {
+                                vv[v].w[n] = ((float*)p[2])[v * 4 + n + 2];
                                 uint32_t bone = ((uint32_t*)p[2])[v * 4 + n];
                                 if(bone) {
-                                    vv[v].w[n] = 1;
                                     int32_t bi = (bone / 4) - 184;
                                     if(bi < 0) {puts("negative bone index"); continue;}
-                                    size_t bii;
-                                    uint32_t bn = lex.mesh[i].header.unk2[bi+1];
-                                    vector_push_unique_i(&model->bone, &bn, &bii);
-                                    vv[v].j[n] = bii;
+                                    vv[v].j[n] = push_bone(res, lex->mesh[i].header.unk2[bi+1]);
                                 } else {
-                                    vv[v].w[n] = ((float*)p[2])[v * 4 + n];;
                                     vv[v].j[n] = 0;
                                 }
-                            }
-                            break;
-                        case 5: // 4 values per vert, 2 indices and 2 weights
-                            for(int n = 0; n < 4; ++n) {
-                                if(n < 2) {
-                                    vv[v].w[n] = ((float*)p[2])[v * 4 + n + 2];
-                                    uint32_t bone = ((uint32_t*)p[2])[v * 4 + n];
-                                    if(bone) {
-                                        int32_t bi = (bone / 4) - 184;
-                                        if(bi < 0) {puts("negative bone index"); continue;}
-                                        size_t bii;
-                                        uint32_t bn = lex.mesh[i].header.unk2[bi+1];
-                                        vector_push_unique_i(&model->bone, &bn, &bii);
-                                        vv[v].j[n] = bii;
-                                    } else {
-                                        vv[v].j[n] = 0;
-                                    }
-                                } else {
-                                    vv[v].w[n] = 0;
-                                    vv[v].j[n] = 0;
-                                }
-                            }
-                            break;
-                        case 1024: // 3 floats per vert, shape key?
-                            for(int n = 0; n < 4; ++n) {
+                            } else {
                                 vv[v].w[n] = 0;
-                                vv[v].j[n] = -1;
+                                vv[v].j[n] = 0;
                             }
-                            break;
-                        default: {
-                            printf("unknown weight_format %d\n", lex.mesh[i].header.weight_format);
-                            return -1;
-                            break;
                         }
+                        break;
+                    case 1024: // 3 floats per vert, shape key?
+                        for(int n = 0; n < 4; ++n) {
+                            vv[v].w[n] = 0;
+                            vv[v].j[n] = -1;
+                        }
+                        break;
+                    default: {
+                        printf("unknown weight_format %d\n", lex->mesh[i].header.weight_format);
+                        return -1;
+                        break;
                     }
                 }
-                for(size_t v = 0; v < vertex_count - 2; ++v) {
-                    Vertex vv0 = vv[v];
-                    Vertex vv1 = vv[v + 1];
-                    Vertex vv2 = vv[v + 2];
-                    vv0.v = 1 - vv0.v;
-                    vv1.v = 1 - vv1.v;
-                    vv2.v = 1 - vv2.v;
-                    if(material.has_texture) {
-                        fmod_range_vertex(&vv0, &vv1, &vv2, material.uminf, material.umaxf, material.vminf, material.vmaxf);
-                    }
-                    vv0.v = 1 - vv0.v;
-                    vv1.v = 1 - vv1.v;
-                    vv2.v = 1 - vv2.v;
-                    if(tex) {
-                        vv0.v /= 1024/tex->max_y;
-                        vv1.v /= 1024/tex->max_y;
-                        vv2.v /= 1024/tex->max_y;
-                    }
-                    vv0.v = 1 - vv0.v;
-                    vv1.v = 1 - vv1.v;
-                    vv2.v = 1 - vv2.v;
-                    vector_push_unique_i(&model->vertex, &vv0, &vi[v]);
-                    vector_push_unique_i(&model->vertex, &vv1, &vi[v + 1]);
-                    vector_push_unique_i(&model->vertex, &vv2, &vi[v + 2]);
-                    Triangle t;
-                    t.mat = material_index;
-                    size_t v1, v2;
-                    if(v % 2 == 0) {
-                        v1 = v + 1;
-                        v2 = v + 2;
-                    } else {
-                        v1 = v + 2;
-                        v2 = v + 1;
-                    }
-                    t.i[0] = vi[v];
-                    t.i[1] = vi[v1];
-                    t.i[2] = vi[v2];
-                    vector_push(&mesh.tri, &t);
-                }
-                memset(mem, 0, data_len);
-                data_len = 0;
-                j = 0;
-                continue;
-            }
-            num[j] = vif.num;
-            size_t sizes[] = {4, 2, 1, 0};
-            components[j] = (vif.unpack_type >> 2)+1;
-            component_bytes[j] = sizes[vif.unpack_type&0x3];
-            if(dbg('c')) printf("components %llu component_bytes %llu\n", components[j], component_bytes[j]);
-            if(!components[j] || !component_bytes[j]) {
-                printf("uhhhhhhhhhhhhhhhhhh\n");
-                return -1;
             }
-            if(vif.write_masking) {
-                if(dbg('c')) printf("write masking not supported\n");
-                if(dbg('!')) return -1;
-            }
-            if(!vif.tops_add) {
-                printf("not adding TOPS?! how dare you!\n");
-                return -1;
-            }
-            
-            if(vif.addr == 0) {
-                fread(&mbh, sizeof(MeshBlockHeader), 1, fp);
-                if(dbg('h')) print_meshblockheader(mbh);
-                --num[j];
-                vals_per_vert = num[j] / mbh.count;
-                if(dbg('h')) printf("vals per vertex: %d\n", vals_per_vert);
-                if(mbh.unk1[0] == 0x40) {
-                    size_t to_read = num[j] * components[j] * component_bytes[j];
-                    if(to_read == sizeof(MaterialBlock)) {
-                        if(dbg('m')) printf("\n!!!--------- assign new material ---------!!!\n");
-                        MaterialBlock matb;
-                        fread(&matb, sizeof(MaterialBlock), 1, fp);
-                        mr = (MaterialRaw){.uvinfo = matb.uvinfo, .pal0 = matb.pal0};
-                        if(dbg('m')) print_materialraw(mr);
-                        Material newmat = parse_materialraw(mr, tex);
-                        col = matb.col;
-                        newmat.col = col;
-                        vector_push_unique_i(&model->material, &newmat, &material_index);
-                        num[j] = 0;
-                        if(dbg('m')) print_materialblock(matb);
-                        if(dbg('m')) printf("^ material idx %llu\n", material_index);
-                    } else if(to_read == sizeof(MaterialBlockSmall)) {
-                        if(dbg('m')) printf("\n!!!--------- assign new material without new colors ---------!!!\n");
-                        MaterialBlockSmall matbs;
-                        fread(&matbs, sizeof(MaterialBlockSmall), 1, fp);
-                        mr = (MaterialRaw){.uvinfo = matbs.uvinfo, .pal0 = matbs.pal0};
-                        if(dbg('m')) print_materialraw(mr);
-                        Material newmat = parse_materialraw(mr, tex);
-                        newmat.col = col;
-                        vector_push_unique_i(&model->material, &newmat, &material_index);
-                        num[j] = 0;
-                        if(dbg('m')) print_materialblocksmall(matbs);
-                        if(dbg('m')) printf("^ material idx %llu\n", material_index);
-                    } else {
-                        printf("[0x%08lx] how curious... something new!\n", ftell(fp));
-                        uint8_t* guff = malloc (num[j] * components[j] * component_bytes[j]);
-                        fread(guff, num[j] * components[j] * component_bytes[j], 1, fp);
-                        print_bytes_dim(guff, num[j] * components[j] * component_bytes[j], 16);
-                        free(guff);
-                        return -1;
-                    }
+            for(size_t v = 0; v < vertex_count - 2; ++v) {
+                if(degenerate(&vv[v], &vv[v + 1], &vv[v + 2])) {
+                    ++res->culled;
                     continue;
-                } else if(mbh.unk1[0] != 0x00) {
-                    printf("\n[0x%08lx] unknown mbh.unk1[0] %02x\n", ftell(fp), mbh.unk1[0]);
-                    return -1;
                 }
+                Vertex vv0 = vv[v];
+                Vertex vv1 = vv[v + 1];
+                Vertex vv2 = vv[v + 2];
+                vv0.v = 1 - vv0.v;
+                vv1.v = 1 - vv1.v;
+                vv2.v = 1 - vv2.v;
+                if(material.has_texture) {
+                    fmod_range_vertex(&vv0, &vv1, &vv2, material.uminf, material.umaxf, material.vminf, material.vmaxf);
+                }
+                vv0.v = 1 - vv0.v;
+                vv1.v = 1 - vv1.v;
+                vv2.v = 1 - vv2.v;
+                if(tex) {
+                    vv0.v /= 1024/tex->max_y;
+                    vv1.v /= 1024/tex->max_y;
+                    vv2.v /= 1024/tex->max_y;
+                }
+                vv0.v = 1 - vv0.v;
+                vv1.v = 1 - vv1.v;
+                vv2.v = 1 - vv2.v;
+                hashidx_push_unique_i(&res->vertex_index, &res->vertex, &vv0, &vi[v]);
+                hashidx_push_unique_i(&res->vertex_index, &res->vertex, &vv1, &vi[v + 1]);
+                hashidx_push_unique_i(&res->vertex_index, &res->vertex, &vv2, &vi[v + 2]);
+                Triangle t;
+                t.mat = material_index;
+                size_t v1, v2;
+                if(v % 2 == 0) {
+                    v1 = v + 1;
+                    v2 = v + 2;
+                } else {
+                    v1 = v + 2;
+                    v2 = v + 1;
+                }
+                t.i[0] = vi[v];
+                t.i[1] = vi[v1];
+                t.i[2] = vi[v2];
+                vector_push(&res->tri, &t);
             }
-            size_t to_read = num[j] * components[j] * component_bytes[j];
-            //align to 4 byte boundary
-            to_read = (to_read + 3) & ~0x3;
-            if(dbg('v')) printf("j: %llu addr: %03x, to_read: %03llx, data_len: %03llx\n", j, vif.addr*16, to_read, data_len);
-            p[j] = mem + data_len;
-            fread(p[j], to_read, 1, fp);
-            data_len += to_read;
-            ++j;
-            if(j > MAX_J) {
-                printf("MAX_J exceeded: %llu > %u\n", j, MAX_J);
+            memset(mem, 0, data_len);
+            data_len = 0;
+            j = 0;
+            continue;
+        }
+        num[j] = vif.num ? vif.num : 256;
+        components[j] = (vif.unpack_type >> 2)+1;
+        if(dbg('c')) printf("components %llu packed size %llu\n", components[j], vif_unpack_size(vif.unpack_type, 1));
+        if(!vif_unpack_size(vif.unpack_type, 1)) {
+            printf("[0x%08llx] Error: invalid VIF unpack type %x\n", mfile_tell(f), vif.unpack_type);
+            return -1;
+        }
+        if(!vif.tops_add) {
+            printf("not adding TOPS?! how dare you!\n");
+            return -1;
+        }
+        
+        if(vif.addr == 0) {
+            if(!mfile_read(f, &mbh, sizeof(MeshBlockHeader))) goto EOF_ERROR;
+            if(dbg('h')) print_meshblockheader(mbh);
+            --num[j];
+            vals_per_vert = num[j] / mbh.count;
+            if(dbg('h')) printf("vals per vertex: %d\n", vals_per_vert);
+            if(mbh.unk1[0] == 0x40) {
+                size_t to_read = vif_unpack_size(vif.unpack_type, num[j]);
+                if(to_read == sizeof(MaterialBlock)) {
+                    if(dbg('m')) printf("\n!!!--------- assign new material ---------!!!\n");
+                    MaterialBlock matb;
+                    if(!mfile_read(f, &matb, sizeof(MaterialBlock))) goto EOF_ERROR;
+                    mr = (MaterialRaw){.uvinfo = matb.uvinfo, .pal0 = matb.pal0};
+                    if(dbg('m')) print_materialraw(mr);
+                    Material newmat = parse_materialraw(mr, tex);
+                    col = matb.col;
+                    newmat.col = col;
+                    vector_push_unique_i(&res->material, &newmat, &material_index);
+                    num[j] = 0;
+                    if(dbg('m')) print_materialblock(matb);
+                    if(dbg('m')) printf("^ material idx %llu\n", material_index);
+                } else if(to_read == sizeof(MaterialBlockSmall)) {
+                    if(dbg('m')) printf("\n!!!--------- assign new material without new colors ---------!!!\n");
+                    MaterialBlockSmall matbs;
+                    if(!mfile_read(f, &matbs, sizeof(MaterialBlockSmall))) goto EOF_ERROR;
+                    mr = (MaterialRaw){.uvinfo = matbs.uvinfo, .pal0 = matbs.pal0};
+                    if(dbg('m')) print_materialraw(mr);
+                    Material newmat = parse_materialraw(mr, tex);
+                    newmat.col = col;
+                    vector_push_unique_i(&res->material, &newmat, &material_index);
+                    num[j] = 0;
+                    if(dbg('m')) print_materialblocksmall(matbs);
+                    if(dbg('m')) printf("^ material idx %llu\n", material_index);
+                } else {
+                    printf("[0x%08llx] how curious... something new!\n", mfile_tell(f));
+                    size_t guff_len = MIN(to_read, mfile_remaining(f));
+                    print_bytes_dim((void*)mfile_get_ptr(f, guff_len), guff_len, 16);
+                    return -1;
+                }
+                continue;
+            } else if(mbh.unk1[0] != 0x00) {
+                printf("\n[0x%08llx] unknown mbh.unk1[0] %02x\n", mfile_tell(f), mbh.unk1[0]);
                 return -1;
             }
         }
-        tricount += mesh.tri.length;
-        if(dbg('t')) printf("%llu triangles\n", mesh.tri.length);
-        if(!vector_push(&model->mesh, &mesh)) {
-            printf("Error: could not push value to mesh vector\n");
+        size_t span = vif_unpack_span(&vs, num[j]) * 16;
+        if(dbg('v')) printf("j: %llu addr: %03x, span: %03llx, data_len: %03llx\n", j, vif.addr*16, span, data_len);
+        p[j] = mem + data_len;
+        if(data_len + span > VU_MEM_SIZE) {
+            printf("[0x%08llx] Error: VIF data exceeds VU memory\n", mfile_tell(f));
+            return -1;
+        }
+        // in fill mode the packet holds fewer elements than qwords written
+        const void *packed = mfile_get_ptr(f, vif_packet_size(&vs, vif.unpack_type, num[j]));
+        if(!packed) goto EOF_ERROR;
+        vif_unpack(&vs, vif, num[j], packed, (uint32_t*)p[j]);
+        data_len += span;
+        ++j;
+        if(j > MAX_J) {
+            printf("MAX_J exceeded: %llu > %u\n", j, MAX_J);
+            return -1;
+        }
+    }
+    memset(mem, 0, data_len);
+    return res->tri.length;
+EOF_ERROR:
+    printf("[0x%08llx] Error: unexpected end of LEX file\n", mfile_tell(f));
+    return -1;
+}
+
+static void decode_mesh_job(void *ctx, size_t job, size_t worker) {
+    LexJobs *jobs = ctx;
+    MeshResult *res = &jobs->res[job];
+    // every job gets its own cursor into the shared mapping
+    mfile view = mfile_view(jobs->f, 0, jobs->f->size);
+    res->ret = decode_mesh(&view, jobs->lex, job, jobs->tex, &jobs->scratch[worker], res);
+    res->end = mfile_tell(&view);
+}
+
+static void mesh_result_cleanup(MeshResult *res) {
+    vector_cleanup(&res->vertex);
+    hashidx_cleanup(&res->vertex_index);
+    vector_cleanup(&res->tri);
+    vector_cleanup(&res->material);
+    vector_cleanup(&res->bone);
+}
+
+// Appends a decoded mesh to the model. Meshes are merged in file order, so
+// materials, bones and vertices get the same indices as a serial decode.
+static bool merge_mesh(Model *model, LexFile *lex, uint32_t i, MeshResult *res, arena *a) {
+    size_t *bone_map = arena_alloc(a, res->bone.length * sizeof(size_t));
+    size_t *mat_map = arena_alloc(a, res->material.length * sizeof(size_t));
+    size_t *vert_map = arena_alloc(a, res->vertex.length * sizeof(size_t));
+    bool ok = bone_map && mat_map && vert_map;
+    for(size_t k = 0; ok && k < res->bone.length; ++k) {
+        ok = vector_push_unique_i(&model->bone, &((uint32_t*)res->bone.p)[k], &bone_map[k]);
+    }
+    for(size_t k = 0; ok && k < res->material.length; ++k) {
+        ok = vector_push_unique_i(&model->material, &((Material*)res->material.p)[k], &mat_map[k]);
+    }
+    for(size_t k = 0; ok && k < res->vertex.length; ++k) {
+        Vertex v = ((Vertex*)res->vertex.p)[k];
+        for(int n = 0; n < 4; ++n) {
+            if(v.j[n] > 0) v.j[n] = bone_map[v.j[n] - 1];
+        }
+        ok = model_push_vertex(model, &v, &vert_map[k]);
+    }
+    Mesh mesh;
+    mesh.tri = res->tri;
+    res->tri = vector_init(sizeof(Triangle));
+    for(size_t k = 0; ok && k < mesh.tri.length; ++k) {
+        Triangle *t = &((Triangle*)mesh.tri.p)[k];
+        t->mat = mat_map[t->mat];
+        for(int n = 0; n < 3; ++n) t->i[n] = vert_map[t->i[n]];
+    }
+    mesh.weight_format = lex->mesh[i].header.weight_format;
+    snprintf(mesh.name, 64, "%02d/%s/%s", i, lex->mesh[i].header.group_name, lex->mesh[i].header.bone_name);
+    if(ok && !vector_push(&model->mesh, &mesh)) {
+        printf("Error: could not push value to mesh vector\n");
+        ok = false;
+    }
+    if(!ok) vector_cleanup(&mesh.tri);
+    return ok;
+}
+
+// All temporary state lives in the arena, error paths just return.
+int64_t parse_lex(mfile *f, Model *model, Texture *tex, arena *a) {
+    LexFile lex;
+    if(!mfile_read(f, &lex.header, sizeof(LexHeader))) {
+        printf("Error: LEX header out of bounds\n");
+        return -1;
+    }
+    if(dbg('h')) print_lexheader(lex.header);
+    if(!model->name[0]) {
+        memcpy(model->name, lex.header.name + 1, 32);
+        model->name[32] = 0;
+    }
+    
+    if(mfile_remaining(f) / sizeof(uint32_t) < lex.header.nmesh) {
+        printf("Error: LEX mesh table out of bounds\n");
+        return -1;
+    }
+    lex.mesh_addr = arena_alloc(a, lex.header.nmesh * sizeof(uint32_t));
+    lex.mesh = arena_alloc(a, lex.header.nmesh * sizeof(MeshObj));
+    lex.matrix = arena_calloc(a, (size_t)lex.header.nmatrix * 2, sizeof(float[16]));
+    if(!lex.mesh_addr || !lex.mesh || !lex.matrix) {
+        printf("Error: out of memory\n");
+        return -1;
+    }
+    mfile_read(f, lex.mesh_addr, sizeof(uint32_t) * lex.header.nmesh);
+    
+    mfile_seek(f, lex.header.addr[0]);
+    for(uint32_t i = 0; i < lex.header.nmatrix * 2; ++i) {
+        if(!mfile_read(f, lex.matrix[i], sizeof(float[16]))) {
+            printf("Error: LEX matrix %x out of bounds\n", i);
             return -1;
         }
+        if(dbg('h')) printf("\n%x:\n", i);
+        if(dbg('h')) print_floats(lex.matrix[i], 16, 4);
+    }
+    // per mesh debug output is only readable when meshes are decoded in order
+    size_t threads = options.threads;
+    if(dbg('H') || dbg('h') || dbg('m') || dbg('c') || dbg('D') || dbg('v') || dbg('U')) threads = 1;
+    if(threads > lex.header.nmesh) threads = lex.header.nmesh;
+    if(!threads) threads = 1;
+    LexScratch *scratch = arena_alloc(a, threads * sizeof(LexScratch));
+    MeshResult *res = arena_alloc(a, lex.header.nmesh * sizeof(MeshResult));
+    if(!scratch || !res) {
+        printf("Error: out of memory\n");
+        return -1;
     }
-    // for(size_t i = 0; i < boneiv->length; ++i) {
-        // uint32_t bonei = ((uint32_t*)boneiv->p)[i];
-        // printf("[%d]\n", bonei);
-    // }
-    // for(size_t i = 0; i < model->bone->length; ++i) {
-        // uint32_t bone = ((uint32_t*)model->bone->p)[i];
-        // printf("%08x %u %d %d %d\n", bone, bone, bone % 4, bone / 4, (bone/4)-184);
-        // printf("% 4d  %02x %c \n", bone, bone, bone);
-    // }
+    for(size_t w = 0; w < threads; ++w) {
+        scratch[w].mem = arena_calloc(a, VU_MEM_SIZE, 1);
+        scratch[w].vv = arena_alloc(a, sizeof(Vertex) * MAX_V);
+        scratch[w].vi = arena_alloc(a, sizeof(size_t) * MAX_V);
+        if(!scratch[w].mem || !scratch[w].vv || !scratch[w].vi) {
+            printf("Error: out of memory\n");
+            return -1;
+        }
+    }
+    for(uint32_t i = 0; i < lex.header.nmesh; ++i) {
+        res[i] = (MeshResult){
+            .vertex = vector_init(sizeof(Vertex)),
+            .vertex_index = hashidx_init(),
+            .tri = vector_init(sizeof(Triangle)),
+            .material = vector_init(sizeof(Material)),
+            .bone = vector_init(sizeof(uint32_t)),
+            .culled = 0,
+            .end = mfile_tell(f),
+            .ret = -1
+        };
+    }
+    LexJobs jobs = {.f = f, .lex = &lex, .tex = tex, .scratch = scratch, .res = res};
+    pool_run(lex.header.nmesh, threads, decode_mesh_job, &jobs);
+    
+    int64_t tricount = 0;
+    size_t culled = 0;
+    for(uint32_t i = 0; i < lex.header.nmesh; ++i) {
+        mfile_seek(f, res[i].end);
+        if(res[i].ret < 0 || !merge_mesh(model, &lex, i, &res[i], a)) {
+            tricount = -1;
+            break;
+        }
+        tricount += res[i].ret;
+        culled += res[i].culled;
+        if(dbg('t')) printf("%lld triangles\n", res[i].ret);
+    }
+    for(uint32_t i = 0; i < lex.header.nmesh; ++i) mesh_result_cleanup(&res[i]);
+    if(tricount < 0) return -1;
+    
+    if(culled) printf("%llu degenerate triangles culled\n", culled);
     if(model->bone.length) printf("%llu weight groups\n", model->bone.length);
     model->bone_count = MAX(model->bone.length, model->bone_count);
-    vector_cleanup(&boneiv);
-    free(vv);
-    free(vi);
-    free(mem);
-    free(lex.matrix);
-    free(lex.mesh);
-    free(lex.mesh_addr);
-    printf("\n[0x%08lx] Parsing LEX finished!\n", ftell(fp));
-    fclose(fp);
+    printf("\n[0x%08llx] Parsing LEX finished!\n", mfile_tell(f));
     return tricount;
 }
 
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include "xenotool.h"
-int64_t parse_lex(char *filename, Model *model, Texture *tex);
+#include "mfile.h"
+#include "arena.h"
+int64_t parse_lex(mfile *f, Model *model, Texture *tex, arena *a);
 Material parse_materialraw(MaterialRaw mr, Texture *tex);
 #endif
\ No newline at end of file
@@ -0,0 +1,689 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "xeno_meshopt.h"
+#include "xenodebug.h"
+#include "macro.h"
+
+// Vertex streams are coded in blocks of up to 256 vertices. Every byte of
+// a vertex is delta coded against the same byte of the vertex before it,
+// zigzagged and stored in groups of 16 as 0, 2, 4 or 8 bit values. Values
+// that don't fit are replaced by all ones and follow the group as whole
+// bytes. The first vertex goes at the end, padded to 32 bytes, so the
+// decoder can always read a group ahead.
+
+#define VERTEX_HEADER 0xa0
+#define VERTEX_BLOCK_BYTES 8192
+#define VERTEX_BLOCK_MAX 256
+#define GROUP_SIZE 16
+#define GROUP_DECODE_LIMIT 24 // largest group plus its share of the header
+#define TAIL_MAX 32
+
+// Index streams code triangles against a 16 entry FIFO of recent edges and
+// one of recent vertices, new vertices are usually the next unused index.
+// Each triangle is a code byte, indices that can't be predicted are
+// zigzagged deltas from the last one in 7 bit groups. Sequences are just
+// the deltas, each from one of two baselines.
+
+#define INDEX_HEADER 0xe0
+#define SEQUENCE_HEADER 0xd0
+#define INDEX_VERSION 1
+#define INDEX_FEC_MAX 13 // 13 and 14 code last - 1 and last + 1
+
+static const uint8_t group_bits[4] = {0, 2, 4, 8};
+
+static const uint8_t triangle_order[3][3] = {
+    {0, 1, 2},
+    {1, 2, 0},
+    {2, 0, 1}
+};
+
+// feb/fec pairs of new triangles, the most common ones get a table index in
+// the code byte. Goes at the end of the stream, also as padding.
+static const uint8_t codeaux_table[16] = {
+    0x00, 0x76, 0x87, 0x56, 0x67, 0x78, 0xa9, 0x86, 0x65, 0x89, 0x68, 0x98, 0x01, 0x69, 0x00, 0x00
+};
+
+static size_t vertex_block_size(size_t size) {
+    size_t n = (VERTEX_BLOCK_BYTES / size) & ~(size_t)(GROUP_SIZE - 1);
+    return MIN(n, VERTEX_BLOCK_MAX);
+}
+
+static uint8_t zigzag8(uint8_t v) {
+    return ((int8_t)v >> 7) ^ (v << 1);
+}
+
+static uint8_t unzigzag8(uint8_t v) {
+    return -(v & 1) ^ (v >> 1);
+}
+
+// encoded size of a group, SIZE_MAX when bits is 0 and it isn't all zero
+static size_t group_measure(const uint8_t *g, int bits) {
+    if(bits == 0) {
+        for(int i = 0; i < GROUP_SIZE; ++i) {
+            if(g[i]) return SIZE_MAX;
+        }
+        return 0;
+    }
+    if(bits == 8) return GROUP_SIZE;
+    size_t size = GROUP_SIZE * bits / 8;
+    uint8_t sentinel = (1 << bits) - 1;
+    for(int i = 0; i < GROUP_SIZE; ++i) size += g[i] >= sentinel;
+    return size;
+}
+
+// first value in the high bits of each byte
+static uint8_t *encode_group(uint8_t *data, const uint8_t *g, int bits) {
+    if(bits == 0) return data;
+    if(bits == 8) {
+        memcpy(data, g, GROUP_SIZE);
+        return data + GROUP_SIZE;
+    }
+    uint8_t sentinel = (1 << bits) - 1;
+    for(int i = 0; i < GROUP_SIZE; i += 8 / bits) {
+        uint8_t byte = 0;
+        for(int k = 0; k < 8 / bits; ++k) byte = (byte << bits) | MIN(g[i + k], sentinel);
+        *data++ = byte;
+    }
+    for(int i = 0; i < GROUP_SIZE; ++i) {
+        if(g[i] >= sentinel) *data++ = g[i];
+    }
+    return data;
+}
+
+// 2 bits a group for its width, then the groups
+static uint8_t *encode_bytes(uint8_t *data, uint8_t *end, const uint8_t *buf, size_t n) {
+    uint8_t *header = data;
+    size_t header_size = (n / GROUP_SIZE + 3) / 4;
+    if((size_t)(end - data) < header_size) return NULL;
+    memset(header, 0, header_size);
+    data += header_size;
+    for(size_t i = 0; i < n; i += GROUP_SIZE) {
+        if((size_t)(end - data) < GROUP_DECODE_LIMIT) return NULL;
+        int best = 3;
+        size_t best_size = GROUP_SIZE;
+        for(int b = 0; b < 3; ++b) {
+            size_t size = group_measure(buf + i, group_bits[b]);
+            if(size < best_size) {
+                best = b;
+                best_size = size;
+            }
+        }
+        size_t g = i / GROUP_SIZE;
+        header[g / 4] |= best << ((g % 4) * 2);
+        data = encode_group(data, buf + i, group_bits[best]);
+    }
+    return data;
+}
+
+static uint8_t *encode_block(uint8_t *data, uint8_t *end, const uint8_t *src, size_t count, size_t size, uint8_t *last) {
+    // the groups past count are coded too, as zeros
+    uint8_t buf[VERTEX_BLOCK_MAX] = {0};
+    size_t aligned = (count + GROUP_SIZE - 1) & ~(size_t)(GROUP_SIZE - 1);
+    for(size_t k = 0; k < size; ++k) {
+        uint8_t p = last[k];
+        for(size_t i = 0; i < count; ++i) {
+            uint8_t v = src[i * size + k];
+            buf[i] = zigzag8(v - p);
+            p = v;
+        }
+        data = encode_bytes(data, end, buf, aligned);
+        if(!data) return NULL;
+    }
+    memcpy(last, src + size * (count - 1), size);
+    return data;
+}
+
+static const uint8_t *decode_group_scalar(const uint8_t *data, uint8_t *dst, int bitslog2) {
+    int bits = group_bits[bitslog2];
+    if(bits == 0) {
+        memset(dst, 0, GROUP_SIZE);
+        return data;
+    }
+    if(bits == 8) {
+        memcpy(dst, data, GROUP_SIZE);
+        return data + GROUP_SIZE;
+    }
+    const uint8_t *var = data + GROUP_SIZE * bits / 8;
+    uint8_t sentinel = (1 << bits) - 1;
+    for(int i = 0; i < GROUP_SIZE; ++i) {
+        int shift = 8 - bits - (i % (8 / bits)) * bits;
+        uint8_t v = (data[i / (8 / bits)] >> shift) & sentinel;
+        dst[i] = v == sentinel ? *var++ : v;
+    }
+    return var;
+}
+
+#ifdef __SSE2__
+// Spreads the packed values to one a byte with shifts and masks, then
+// patches the few sentinels from the variable part.
+static const uint8_t *decode_group_simd(const uint8_t *data, uint8_t *dst, int bitslog2) {
+    __m128i r;
+    uint8_t sentinel;
+    const uint8_t *var;
+    switch(bitslog2) {
+        case 0: {
+            _mm_storeu_si128((__m128i*)dst, _mm_setzero_si128());
+            return data;
+        }
+        case 1: {
+            uint32_t w;
+            memcpy(&w, data, sizeof(w));
+            __m128i x = _mm_cvtsi32_si128(w);
+            x = _mm_unpacklo_epi8(x, x);
+            x = _mm_unpacklo_epi16(x, x);
+            r = _mm_or_si128(
+                _mm_or_si128(_mm_and_si128(_mm_srli_epi16(x, 6), _mm_set1_epi32(0x00000003)), _mm_and_si128(_mm_srli_epi16(x, 4), _mm_set1_epi32(0x00000300))),
+                _mm_or_si128(_mm_and_si128(_mm_srli_epi16(x, 2), _mm_set1_epi32(0x00030000)), _mm_and_si128(x, _mm_set1_epi32(0x03000000))));
+            sentinel = 3;
+            var = data + 4;
+            break;
+        }
+        case 2: {
+            __m128i x = _mm_loadl_epi64((const __m128i*)data);
+            x = _mm_unpacklo_epi8(x, x);
+            r = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(x, 4), _mm_set1_epi16(0x000f)), _mm_and_si128(x, _mm_set1_epi16(0x0f00)));
+            sentinel = 15;
+            var = data + 8;
+            break;
+        }
+        default: {
+            _mm_storeu_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)data));
+            return data + GROUP_SIZE;
+        }
+    }
+    _mm_storeu_si128((__m128i*)dst, r);
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(r, _mm_set1_epi8(sentinel)));
+    while(mask) {
+        dst[__builtin_ctz(mask)] = *var++;
+        mask &= mask - 1;
+    }
+    return var;
+}
+
+// Four byte streams at once: 16 vertices are transposed to 4 byte lanes,
+// unzigzagged and prefix summed in the register.
+static void decode_deltas_simd(uint8_t (*buf)[VERTEX_BLOCK_MAX], uint8_t *dst, size_t count, size_t size, const uint8_t *last) {
+    uint32_t w;
+    memcpy(&w, last, sizeof(w));
+    __m128i p = _mm_set1_epi32(w);
+    const __m128i one = _mm_set1_epi8(1), low7 = _mm_set1_epi8(0x7f);
+    for(size_t i = 0; i < count; i += GROUP_SIZE) {
+        __m128i r0 = _mm_loadu_si128((const __m128i*)(buf[0] + i));
+        __m128i r1 = _mm_loadu_si128((const __m128i*)(buf[1] + i));
+        __m128i r2 = _mm_loadu_si128((const __m128i*)(buf[2] + i));
+        __m128i r3 = _mm_loadu_si128((const __m128i*)(buf[3] + i));
+        __m128i t0 = _mm_unpacklo_epi8(r0, r1), t1 = _mm_unpackhi_epi8(r0, r1);
+        __m128i t2 = _mm_unpacklo_epi8(r2, r3), t3 = _mm_unpackhi_epi8(r2, r3);
+        __m128i v[4] = {_mm_unpacklo_epi16(t0, t2), _mm_unpackhi_epi16(t0, t2), _mm_unpacklo_epi16(t1, t3), _mm_unpackhi_epi16(t1, t3)};
+        for(int q = 0; q < 4; ++q) {
+            __m128i d = v[q];
+            d = _mm_xor_si128(_mm_and_si128(_mm_srli_epi16(d, 1), low7), _mm_sub_epi8(_mm_setzero_si128(), _mm_and_si128(d, one)));
+            d = _mm_add_epi8(d, _mm_slli_si128(d, 4));
+            d = _mm_add_epi8(d, _mm_slli_si128(d, 8));
+            d = _mm_add_epi8(d, p);
+            p = _mm_shuffle_epi32(d, 0xff);
+            for(size_t l = i + q * 4; l < MIN(i + q * 4 + 4, count); ++l) {
+                w = _mm_cvtsi128_si32(d);
+                memcpy(dst + l * size, &w, sizeof(w));
+                d = _mm_srli_si128(d, 4);
+            }
+        }
+    }
+}
+#endif
+
+static void decode_deltas_scalar(uint8_t (*buf)[VERTEX_BLOCK_MAX], uint8_t *dst, size_t count, size_t size, const uint8_t *last) {
+    for(int c = 0; c < 4; ++c) {
+        uint8_t p = last[c];
+        for(size_t i = 0; i < count; ++i) {
+            p += unzigzag8(buf[c][i]);
+            dst[i * size + c] = p;
+        }
+    }
+}
+
+static const uint8_t *decode_bytes(const uint8_t *data, const uint8_t *end, uint8_t *buf, size_t n, bool simd) {
+    const uint8_t *header = data;
+    size_t header_size = (n / GROUP_SIZE + 3) / 4;
+    if((size_t)(end - data) < header_size) return NULL;
+    data += header_size;
+    for(size_t i = 0; i < n; i += GROUP_SIZE) {
+        if((size_t)(end - data) < GROUP_DECODE_LIMIT) return NULL;
+        size_t g = i / GROUP_SIZE;
+        int bitslog2 = (header[g / 4] >> ((g % 4) * 2)) & 3;
+#ifdef __SSE2__
+        if(simd) {
+            data = decode_group_simd(data, buf + i, bitslog2);
+            continue;
+        }
+#endif
+        data = decode_group_scalar(data, buf + i, bitslog2);
+    }
+    return data;
+}
+
+static const uint8_t *decode_block(const uint8_t *data, const uint8_t *end, uint8_t *dst, size_t count, size_t size, uint8_t *last, bool simd) {
+    uint8_t buf[4][VERTEX_BLOCK_MAX];
+    uint8_t transposed[VERTEX_BLOCK_BYTES];
+    size_t aligned = (count + GROUP_SIZE - 1) & ~(size_t)(GROUP_SIZE - 1);
+    for(size_t k = 0; k < size; k += 4) {
+        for(int c = 0; c < 4; ++c) {
+            data = decode_bytes(data, end, buf[c], aligned, simd);
+            if(!data) return NULL;
+        }
+#ifdef __SSE2__
+        if(simd) {
+            decode_deltas_simd(buf, transposed + k, count, size, last + k);
+            continue;
+        }
+#endif
+        decode_deltas_scalar(buf, transposed + k, count, size, last + k);
+    }
+    memcpy(dst, transposed, count * size);
+    memcpy(last, transposed + size * (count - 1), size);
+    return data;
+}
+
+static bool decode_vertex(void *dst, size_t count, size_t size, const uint8_t *src, size_t len, bool simd) {
+    if(size == 0 || size > 256 || size % 4) return false;
+    const uint8_t *data = src, *end = src + len;
+    size_t tail = MAX(size, TAIL_MAX);
+    if(len < 1 + tail) return false;
+    if(*data++ != VERTEX_HEADER) return false;
+    uint8_t last[256];
+    memcpy(last, end - size, size);
+    size_t block = vertex_block_size(size);
+    for(size_t i = 0; i < count; i += block) {
+        data = decode_block(data, end, (uint8_t*)dst + i * size, MIN(block, count - i), size, last, simd);
+        if(!data) return false;
+    }
+    return (size_t)(end - data) == tail;
+}
+
+bool meshopt_decode_vertex(void *dst, size_t count, size_t size, const uint8_t *src, size_t len) {
+    return decode_vertex(dst, count, size, src, len, true);
+}
+
+static void vertex_check(const uint8_t *enc, size_t len, const void *src, size_t count, size_t size) {
+    uint8_t *dec = malloc(count * size + 1);
+    if(!dec) return;
+    bool scalar = decode_vertex(dec, count, size, enc, len, false) && !memcmp(dec, src, count * size);
+    memset(dec, 0, count * size);
+    bool simd = decode_vertex(dec, count, size, enc, len, true) && !memcmp(dec, src, count * size);
+    printf("meshopt vertices: %llu x %llu bytes, %llu -> %llu bytes, scalar %s, simd %s\n", count, size, count * size, len, scalar ? "ok" : "MISMATCH", simd ? "ok" : "MISMATCH");
+    free(dec);
+}
+
+size_t meshopt_vertex_bound(size_t count, size_t size) {
+    size_t block = vertex_block_size(size);
+    size_t blocks = (count + block - 1) / block;
+    size_t header_size = (block / GROUP_SIZE + 3) / 4;
+    return 1 + blocks * size * (header_size + block) + MAX(size, TAIL_MAX);
+}
+
+// size has to be a multiple of 4 up to 256
+size_t meshopt_encode_vertex(uint8_t *dst, size_t cap, const void *src, size_t count, size_t size) {
+    if(size == 0 || size > 256 || size % 4) return 0;
+    const uint8_t *v = src;
+    uint8_t *data = dst, *end = dst + cap;
+    size_t tail = MAX(size, TAIL_MAX);
+    if(cap < 1 + tail) return 0;
+    *data++ = VERTEX_HEADER;
+    uint8_t first[256] = {0}, last[256];
+    if(count) memcpy(first, v, size);
+    memcpy(last, first, size);
+    size_t block = vertex_block_size(size);
+    for(size_t i = 0; i < count; i += block) {
+        data = encode_block(data, end, v + i * size, MIN(block, count - i), size, last);
+        if(!data) return 0;
+    }
+    if((size_t)(end - data) < tail) return 0;
+    memset(data, 0, tail - size);
+    memcpy(data + tail - size, first, size);
+    data += tail;
+    if(dbg('e')) vertex_check(dst, data - dst, src, count, size);
+    return data - dst;
+}
+
+typedef struct {
+    uint32_t edge[16][2];
+    uint32_t vertex[16];
+    size_t edge_offset;
+    size_t vertex_offset;
+    uint32_t next;
+    uint32_t last;
+} IndexFifo;
+
+static void fifo_init(IndexFifo *f) {
+    memset(f->edge, 0xff, sizeof(f->edge));
+    memset(f->vertex, 0xff, sizeof(f->vertex));
+    f->edge_offset = f->vertex_offset = 0;
+    f->next = f->last = 0;
+}
+
+// edge a-b, b-c or c-a, newest first, as distance << 2 | rotation
+static int fifo_find_edge(const IndexFifo *f, uint32_t a, uint32_t b, uint32_t c) {
+    for(int i = 0; i < 16; ++i) {
+        const uint32_t *e = f->edge[(f->edge_offset - 1 - i) & 15];
+        if(e[0] == a && e[1] == b) return (i << 2) | 0;
+        if(e[0] == b && e[1] == c) return (i << 2) | 1;
+        if(e[0] == c && e[1] == a) return (i << 2) | 2;
+    }
+    return -1;
+}
+
+static void fifo_push_edge(IndexFifo *f, uint32_t a, uint32_t b) {
+    f->edge[f->edge_offset][0] = a;
+    f->edge[f->edge_offset][1] = b;
+    f->edge_offset = (f->edge_offset + 1) & 15;
+}
+
+static int fifo_find_vertex(const IndexFifo *f, uint32_t v) {
+    for(int i = 0; i < 16; ++i) {
+        if(f->vertex[(f->vertex_offset - 1 - i) & 15] == v) return i;
+    }
+    return -1;
+}
+
+static void fifo_push_vertex(IndexFifo *f, uint32_t v, bool cond) {
+    f->vertex[f->vertex_offset] = v;
+    f->vertex_offset = (f->vertex_offset + cond) & 15;
+}
+
+static void encode_index(uint8_t **data, uint32_t index, uint32_t last) {
+    uint32_t d = index - last;
+    uint32_t v = (d << 1) ^ (uint32_t)-(int32_t)(d >> 31);
+    do {
+        *(*data)++ = (v & 127) | (v > 127 ? 128 : 0);
+        v >>= 7;
+    } while(v);
+}
+
+// at most 5 bytes even for broken input
+static uint32_t decode_index(const uint8_t **data, uint32_t last) {
+    uint32_t v = *(*data)++;
+    if(v >= 128) {
+        v &= 127;
+        for(int i = 0, shift = 7; i < 4; ++i, shift += 7) {
+            uint8_t g = *(*data)++;
+            v |= (uint32_t)(g & 127) << shift;
+            if(g < 128) break;
+        }
+    }
+    return last + ((v >> 1) ^ -(v & 1));
+}
+
+size_t meshopt_index_bound(size_t index_count, size_t vertex_count) {
+    unsigned bits = 1;
+    while(bits < 32 && vertex_count > (size_t)1 << bits) ++bits;
+    // code byte, aux byte and three free indices of bits + 1 zigzagged
+    size_t groups = (bits + 1 + 6) / 7;
+    return 1 + (index_count / 3) * (2 + 3 * groups) + 16;
+}
+
+static void index_check(const uint8_t *enc, size_t len, const uint32_t *src, size_t count) {
+    uint32_t *dec = malloc(count * sizeof(uint32_t) + 1);
+    if(!dec) return;
+    bool ok = meshopt_decode_index(dec, count, sizeof(uint32_t), enc, len);
+    // triangles can come back rotated, the winding stays
+    for(size_t i = 0; i < count && ok; i += 3) {
+        const uint32_t *a = src + i, *b = dec + i;
+        ok = (a[0] == b[0] && a[1] == b[1] && a[2] == b[2])
+          || (a[0] == b[2] && a[1] == b[0] && a[2] == b[1])
+          || (a[0] == b[1] && a[1] == b[2] && a[2] == b[0]);
+    }
+    printf("meshopt indices: %llu, %llu -> %llu bytes, %s\n", count, count * sizeof(uint32_t), len, ok ? "ok" : "MISMATCH");
+    free(dec);
+}
+
+// count has to be a multiple of 3
+size_t meshopt_encode_index(uint8_t *dst, size_t cap, const uint32_t *src, size_t count) {
+    if(count % 3 || cap < 1 + count / 3 + 16) return 0;
+    dst[0] = INDEX_HEADER | INDEX_VERSION;
+    IndexFifo f;
+    fifo_init(&f);
+    uint8_t *code = dst + 1;
+    uint8_t *data = code + count / 3;
+    uint8_t *safe_end = dst + cap - 16;
+    for(size_t i = 0; i < count; i += 3) {
+        // a triangle is at most 16 bytes of data
+        if(data > safe_end) return 0;
+        const uint32_t *t = src + i;
+        int fer = fifo_find_edge(&f, t[0], t[1], t[2]);
+        if(fer >= 0 && (fer >> 2) < 15) {
+            // the edge match rotates the triangle to a-b
+            const uint8_t *o = triangle_order[fer & 3];
+            uint32_t a = t[o[0]], b = t[o[1]], c = t[o[2]];
+            int fe = fer >> 2;
+            int fc = fifo_find_vertex(&f, c);
+            int fec = (fc >= 1 && fc < INDEX_FEC_MAX) ? fc : (c == f.next) ? (f.next++, 0) : 15;
+            if(fec == 15 && c + 1 == f.last) {
+                fec = 13;
+                f.last = c;
+            } else if(fec == 15 && c == f.last + 1) {
+                fec = 14;
+                f.last = c;
+            }
+            *code++ = (fe << 4) | fec;
+            if(fec == 15) {
+                encode_index(&data, c, f.last);
+                f.last = c;
+            }
+            if(fec == 0 || fec >= INDEX_FEC_MAX) fifo_push_vertex(&f, c, true);
+            fifo_push_edge(&f, c, b);
+            fifo_push_edge(&f, a, c);
+            continue;
+        }
+        // a new triangle, rotated so a is most likely next
+        int rotation = (t[1] == f.next) ? 1 : (t[2] == f.next) ? 2 : 0;
+        const uint8_t *o = triangle_order[rotation];
+        uint32_t a = t[o[0]], b = t[o[1]], c = t[o[2]];
+        // 0 1 2 after the start restarts next, as if a new stream began
+        bool reset = a == 0 && b == 1 && c == 2 && f.next > 0;
+        if(reset) {
+            f.next = 0;
+            memset(f.vertex, 0xff, sizeof(f.vertex));
+        }
+        int fb = fifo_find_vertex(&f, b);
+        int fc = fifo_find_vertex(&f, c);
+        int fea = (a == f.next) ? (f.next++, 0) : 15;
+        int feb = (fb >= 0 && fb < 14) ? fb + 1 : (b == f.next) ? (f.next++, 0) : 15;
+        int fec = (fc >= 0 && fc < 14) ? fc + 1 : (c == f.next) ? (f.next++, 0) : 15;
+        uint8_t codeaux = (feb << 4) | fec;
+        int aux = -1;
+        for(int k = 0; k < 14 && aux < 0; ++k) {
+            if(codeaux_table[k] == codeaux) aux = k;
+        }
+        if(fea == 0 && aux >= 0 && !reset) {
+            *code++ = 0xf0 | aux;
+        } else {
+            *code++ = 0xf0 | 14 | fea;
+            *data++ = codeaux;
+        }
+        if(fea == 15) {
+            encode_index(&data, a, f.last);
+            f.last = a;
+        }
+        if(feb == 15) {
+            encode_index(&data, b, f.last);
+            f.last = b;
+        }
+        if(fec == 15) {
+            encode_index(&data, c, f.last);
+            f.last = c;
+        }
+        if(fea == 0 || fea == 15) fifo_push_vertex(&f, a, true);
+        if(feb == 0 || feb == 15) fifo_push_vertex(&f, b, true);
+        if(fec == 0 || fec == 15) fifo_push_vertex(&f, c, true);
+        fifo_push_edge(&f, b, a);
+        fifo_push_edge(&f, c, b);
+        fifo_push_edge(&f, a, c);
+    }
+    if(data > safe_end) return 0;
+    memcpy(data, codeaux_table, sizeof(codeaux_table));
+    data += sizeof(codeaux_table);
+    if(dbg('e')) index_check(dst, data - dst, src, count);
+    return data - dst;
+}
+
+static void write_triangle(void *dst, size_t i, size_t index_size, uint32_t a, uint32_t b, uint32_t c) {
+    if(index_size == 2) {
+        uint16_t *d = (uint16_t*)dst + i;
+        d[0] = a;
+        d[1] = b;
+        d[2] = c;
+    } else {
+        uint32_t *d = (uint32_t*)dst + i;
+        d[0] = a;
+        d[1] = b;
+        d[2] = c;
+    }
+}
+
+// index_size is 2 or 4
+bool meshopt_decode_index(void *dst, size_t count, size_t index_size, const uint8_t *src, size_t len) {
+    if(count % 3 || (index_size != 2 && index_size != 4)) return false;
+    if(len < 1 + count / 3 + 16) return false;
+    if((src[0] & 0xf0) != INDEX_HEADER || (src[0] & 0x0f) > INDEX_VERSION) return false;
+    int fec_max = (src[0] & 0x0f) >= 1 ? INDEX_FEC_MAX : 15;
+    IndexFifo f;
+    fifo_init(&f);
+    const uint8_t *code = src + 1;
+    const uint8_t *data = code + count / 3;
+    const uint8_t *safe_end = src + len - 16;
+    const uint8_t *table = safe_end;
+    for(size_t i = 0; i < count; i += 3) {
+        if(data > safe_end) return false;
+        uint8_t codetri = *code++;
+        if(codetri < 0xf0) {
+            const uint32_t *e = f.edge[(f.edge_offset - 1 - (codetri >> 4)) & 15];
+            uint32_t a = e[0], b = e[1], c;
+            int fec = codetri & 15;
+            if(fec < fec_max) {
+                c = fec == 0 ? f.next++ : f.vertex[(f.vertex_offset - 1 - fec) & 15];
+                fifo_push_vertex(&f, c, fec == 0);
+            } else {
+                // 13 and 14 are last - 1 and last + 1
+                c = f.last = fec == 15 ? decode_index(&data, f.last) : f.last + (fec == 13 ? -1 : 1);
+                fifo_push_vertex(&f, c, true);
+            }
+            fifo_push_edge(&f, c, b);
+            fifo_push_edge(&f, a, c);
+            write_triangle(dst, i, index_size, a, b, c);
+            continue;
+        }
+        int fea, feb, fec;
+        uint8_t codeaux;
+        if(codetri < 0xfe) {
+            codeaux = table[codetri & 15];
+            fea = 0;
+        } else {
+            codeaux = *data++;
+            fea = codetri == 0xfe ? 0 : 15;
+            if(codeaux == 0) f.next = 0;
+        }
+        feb = codeaux >> 4;
+        fec = codeaux & 15;
+        // the fifo is read before any of the three is pushed
+        uint32_t a = fea == 0 ? f.next++ : 0;
+        uint32_t b = feb == 0 ? f.next++ : f.vertex[(f.vertex_offset - feb) & 15];
+        uint32_t c = fec == 0 ? f.next++ : f.vertex[(f.vertex_offset - fec) & 15];
+        if(fea == 15) a = f.last = decode_index(&data, f.last);
+        if(feb == 15) b = f.last = decode_index(&data, f.last);
+        if(fec == 15) c = f.last = decode_index(&data, f.last);
+        fifo_push_vertex(&f, a, true);
+        fifo_push_vertex(&f, b, feb == 0 || feb == 15);
+        fifo_push_vertex(&f, c, fec == 0 || fec == 15);
+        fifo_push_edge(&f, b, a);
+        fifo_push_edge(&f, c, b);
+        fifo_push_edge(&f, a, c);
+        write_triangle(dst, i, index_size, a, b, c);
+    }
+    return data == safe_end;
+}
+
+size_t meshopt_sequence_bound(size_t index_count, size_t vertex_count) {
+    unsigned bits = 1;
+    while(bits < 32 && vertex_count > (size_t)1 << bits) ++bits;
+    // zigzag and baseline bits on top of the index
+    size_t groups = (bits + 1 + 1 + 6) / 7;
+    return 1 + index_count * groups + 4;
+}
+
+static void sequence_check(const uint8_t *enc, size_t len, const uint32_t *src, size_t count) {
+    uint32_t *dec = malloc(count * sizeof(uint32_t) + 1);
+    if(!dec) return;
+    bool ok = meshopt_decode_sequence(dec, count, sizeof(uint32_t), enc, len) && !memcmp(dec, src, count * sizeof(uint32_t));
+    printf("meshopt index sequence: %llu, %llu -> %llu bytes, %s\n", count, count * sizeof(uint32_t), len, ok ? "ok" : "MISMATCH");
+    free(dec);
+}
+
+// The baseline switches when the delta from it gets too big for a byte,
+// so two interleaved runs like the sides of a strip both stay small.
+size_t meshopt_encode_sequence(uint8_t *dst, size_t cap, const uint32_t *src, size_t count) {
+    if(cap < 1 + count + 4) return 0;
+    dst[0] = SEQUENCE_HEADER | INDEX_VERSION;
+    uint32_t last[2] = {0};
+    int current = 0;
+    uint8_t *data = dst + 1;
+    uint8_t *safe_end = dst + cap - 4;
+    for(size_t i = 0; i < count; ++i) {
+        // an index is at most 5 bytes, the tail covers the rest
+        if(data >= safe_end) return 0;
+        int32_t cd = src[i] - last[current];
+        current ^= (cd < 0 ? -cd : cd) >= 30;
+        uint32_t d = src[i] - last[current];
+        uint32_t v = (((d << 1) ^ (uint32_t)-(int32_t)(d >> 31)) << 1) | current;
+        do {
+            *data++ = (v & 127) | (v > 127 ? 128 : 0);
+            v >>= 7;
+        } while(v);
+        last[current] = src[i];
+    }
+    if(data > safe_end) return 0;
+    memset(data, 0, 4);
+    data += 4;
+    if(dbg('e')) sequence_check(dst, data - dst, src, count);
+    return data - dst;
+}
+
+// index_size is 2 or 4
+bool meshopt_decode_sequence(void *dst, size_t count, size_t index_size, const uint8_t *src, size_t len) {
+    if(index_size != 2 && index_size != 4) return false;
+    if(len < 1 + count + 4) return false;
+    if((src[0] & 0xf0) != SEQUENCE_HEADER || (src[0] & 0x0f) > INDEX_VERSION) return false;
+    const uint8_t *data = src + 1;
+    const uint8_t *safe_end = src + len - 4;
+    uint32_t last[2] = {0};
+    for(size_t i = 0; i < count; ++i) {
+        if(data >= safe_end) return false;
+        // baseline in the low bit, the zigzagged delta above it
+        uint32_t v = *data++;
+        if(v >= 128) {
+            v &= 127;
+            for(int k = 0, shift = 7; k < 4; ++k, shift += 7) {
+                uint8_t g = *data++;
+                v |= (uint32_t)(g & 127) << shift;
+                if(g < 128) break;
+            }
+        }
+        int current = v & 1;
+        v >>= 1;
+        uint32_t index = last[current] + ((v >> 1) ^ -(v & 1));
+        last[current] = index;
+        if(index_size == 2) {
+            ((uint16_t*)dst)[i] = index;
+        } else {
+            ((uint32_t*)dst)[i] = index;
+        }
+    }
+    return data == safe_end;
+}
@@ -0,0 +1,25 @@
+#ifndef XENO_MESHOPT_H
+#define XENO_MESHOPT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// EXT_meshopt_compression vertex (ATTRIBUTES, version 0) and index
+// (TRIANGLES and INDICES, version 1) codecs. Encoders return the encoded
+// size, 0 when cap is too small, the bound functions give a cap that
+// always fits.
+size_t meshopt_vertex_bound(size_t count, size_t size);
+size_t meshopt_encode_vertex(uint8_t *dst, size_t cap, const void *src, size_t count, size_t size);
+bool meshopt_decode_vertex(void *dst, size_t count, size_t size, const uint8_t *src, size_t len);
+
+size_t meshopt_index_bound(size_t index_count, size_t vertex_count);
+size_t meshopt_encode_index(uint8_t *dst, size_t cap, const uint32_t *src, size_t count);
+bool meshopt_decode_index(void *dst, size_t count, size_t index_size, const uint8_t *src, size_t len);
+
+// INDICES mode, for index lists that aren't triangles like strips
+size_t meshopt_sequence_bound(size_t index_count, size_t vertex_count);
+size_t meshopt_encode_sequence(uint8_t *dst, size_t cap, const uint32_t *src, size_t count);
+bool meshopt_decode_sequence(void *dst, size_t count, size_t index_size, const uint8_t *src, size_t len);
+
+#endif
@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "xeno_mip.h"
+#include "pool.h"
+#include "xenotool.h"
+#include "macro.h"
+
+// Each mip level is filtered from the one above it in linear light, four
+// floats per texel. Color is premultiplied by alpha while filtering so
+// transparent texels don't darken their neighbours. The filters are
+// separable, rows are filtered first and then columns, both in bands of
+// rows on the worker pool.
+
+#define MIP_BAND_ROWS 16
+#define KAISER_WIDTH 3.0f // in destination texels
+#define KAISER_ALPHA 4.0f
+#define SRGB_LUT_SIZE 16384
+#define COVERAGE_CUTOFF 0.5f // alpha test reference for coverage
+#define MIP_PI 3.14159265358979f
+
+static float srgb_to_linear[256];
+static uint8_t linear_to_srgb[SRGB_LUT_SIZE + 1];
+static bool mip_ready;
+
+static void mip_init() {
+    if(mip_ready) return;
+    for(int i = 0; i < 256; ++i) {
+        float c = i / 255.0f;
+        srgb_to_linear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+    }
+    for(int i = 0; i <= SRGB_LUT_SIZE; ++i) {
+        float l = (float)i / SRGB_LUT_SIZE;
+        float c = l <= 0.0031308f ? l * 12.92f : 1.055f * powf(l, 1 / 2.4f) - 0.055f;
+        linear_to_srgb[i] = lrintf(c * 255);
+    }
+    mip_ready = true;
+}
+
+// Source texels and their weights for every destination texel along one
+// axis, at most `max` per texel.
+typedef struct {
+    uint32_t max;
+    uint32_t *count;
+    uint32_t *idx;
+    float *w;
+} Taps;
+
+static float bessel_i0(float x) {
+    float sum = 1, term = 1;
+    for(int k = 1; term > sum * 1e-7f; ++k) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static float kaiser(float x) {
+    if(fabsf(x) >= KAISER_WIDTH) return 0;
+    float t = x / KAISER_WIDTH;
+    float sinc = x == 0 ? 1 : sinf(MIP_PI * x) / (MIP_PI * x);
+    return sinc * bessel_i0(KAISER_ALPHA * sqrtf(1 - t * t)) / bessel_i0(KAISER_ALPHA);
+}
+
+static void taps_free(Taps *t) {
+    free(t->count);
+    free(t->idx);
+    free(t->w);
+}
+
+// Box averages the source texels under each destination texel, Kaiser is a
+// windowed sinc. Texels past the edges repeat the edge. The caller frees t
+// even when this fails.
+static bool taps_init(Taps *t, uint32_t src, uint32_t dst, MipFilter filter) {
+    float scale = (float)src / dst;
+    float radius = filter == MIP_BOX ? scale / 2 : KAISER_WIDTH * scale;
+    t->max = (uint32_t)ceilf(radius * 2) + 2;
+    t->count = malloc(dst * sizeof(uint32_t));
+    t->idx = malloc((size_t)dst * t->max * sizeof(uint32_t));
+    t->w = malloc((size_t)dst * t->max * sizeof(float));
+    if(!t->count || !t->idx || !t->w) return false;
+    for(uint32_t i = 0; i < dst; ++i) {
+        float center = (i + 0.5f) * scale;
+        int32_t lo = floorf(center - radius), hi = ceilf(center + radius);
+        uint32_t *idx = t->idx + (size_t)i * t->max;
+        float *w = t->w + (size_t)i * t->max;
+        uint32_t n = 0;
+        float sum = 0;
+        for(int32_t j = lo; j < hi && n < t->max; ++j) {
+            float weight;
+            if(filter == MIP_BOX) {
+                weight = MIN(j + 1.0f, center + radius) - MAX((float)j, center - radius);
+            } else {
+                weight = kaiser((j + 0.5f - center) / scale);
+            }
+            if(weight == 0) continue;
+            idx[n] = CLAMP(j, 0, (int32_t)src - 1);
+            w[n++] = weight;
+            sum += weight;
+        }
+        for(uint32_t k = 0; k < n; ++k) w[k] /= sum;
+        t->count[i] = n;
+    }
+    return true;
+}
+
+// dst = sum of w[k] * src[idx[k] * stride], four floats per texel
+static inline void filter_texel(float *dst, const float *src, size_t stride, const uint32_t *idx, const float *w, uint32_t n) {
+#ifdef __SSE2__
+    __m128 acc = _mm_setzero_ps();
+    for(uint32_t k = 0; k < n; ++k) acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(src + idx[k] * stride), _mm_set1_ps(w[k])));
+    _mm_storeu_ps(dst, acc);
+#else
+    float acc[4] = {0};
+    for(uint32_t k = 0; k < n; ++k) {
+        for(int c = 0; c < 4; ++c) acc[c] += src[idx[k] * stride + c] * w[k];
+    }
+    memcpy(dst, acc, sizeof(acc));
+#endif
+}
+
+typedef struct {
+    const float *src;
+    float *tmp; // rows filtered, dw x sh
+    float *dst;
+    uint32_t sw, sh, dw, dh;
+    const Taps *x, *y;
+} MipJobs;
+
+static void mip_rows_job(void *ctx, size_t job, size_t worker) {
+    (void)worker;
+    const MipJobs *j = ctx;
+    uint32_t y1 = MIN((job + 1) * MIP_BAND_ROWS, j->sh);
+    for(uint32_t y = job * MIP_BAND_ROWS; y < y1; ++y) {
+        const float *row = j->src + (size_t)y * j->sw * 4;
+        float *out = j->tmp + (size_t)y * j->dw * 4;
+        for(uint32_t x = 0; x < j->dw; ++x) {
+            size_t t = (size_t)x * j->x->max;
+            filter_texel(out + x * 4, row, 4, j->x->idx + t, j->x->w + t, j->x->count[x]);
+        }
+    }
+}
+
+static void mip_cols_job(void *ctx, size_t job, size_t worker) {
+    (void)worker;
+    const MipJobs *j = ctx;
+    uint32_t y1 = MIN((job + 1) * MIP_BAND_ROWS, j->dh);
+    for(uint32_t y = job * MIP_BAND_ROWS; y < y1; ++y) {
+        size_t t = (size_t)y * j->y->max;
+        float *out = j->dst + (size_t)y * j->dw * 4;
+        for(uint32_t x = 0; x < j->dw; ++x) {
+            filter_texel(out + x * 4, j->tmp + x * 4, (size_t)j->dw * 4, j->y->idx + t, j->y->w + t, j->y->count[y]);
+        }
+    }
+}
+
+// fraction of texels that pass the alpha test with alpha multiplied by scale
+static float coverage(const float *img, size_t n, float scale) {
+    size_t covered = 0;
+    for(size_t i = 0; i < n; ++i) covered += img[i * 4 + 3] * scale > COVERAGE_CUTOFF;
+    return (float)covered / n;
+}
+
+// Alpha scale that makes a smaller level keep the coverage of the top one,
+// so alpha tested texture doesn't thin out with distance.
+static float coverage_scale(const float *img, size_t n, float target) {
+    float lo = 0, hi = 4, best = 1;
+    float best_diff = fabsf(coverage(img, n, 1) - target);
+    for(int it = 0; it < 16 && best_diff > 0; ++it) {
+        float mid = (lo + hi) / 2;
+        float c = coverage(img, n, mid);
+        if(fabsf(c - target) < best_diff) {
+            best = mid;
+            best_diff = fabsf(c - target);
+        }
+        if(c < target) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return best;
+}
+
+// Undoes the premultiply with the filtered alpha, before alpha_scale.
+static void to_rgba(const float *src, size_t n, float alpha_scale, bool premultiplied, RGBA *dst) {
+    for(size_t i = 0; i < n; ++i) {
+        const float *p = src + i * 4;
+        float inv = !premultiplied ? 1 : p[3] > 0 ? 1 / p[3] : 0;
+        dst[i].r = linear_to_srgb[lrintf(CLAMP(p[0] * inv, 0.0f, 1.0f) * SRGB_LUT_SIZE)];
+        dst[i].g = linear_to_srgb[lrintf(CLAMP(p[1] * inv, 0.0f, 1.0f) * SRGB_LUT_SIZE)];
+        dst[i].b = linear_to_srgb[lrintf(CLAMP(p[2] * inv, 0.0f, 1.0f) * SRGB_LUT_SIZE)];
+        dst[i].a = lrintf(CLAMP(p[3] * alpha_scale, 0.0f, 1.0f) * 255);
+    }
+}
+
+// levels[0] holds the sRGB RGBA source, fills in the smaller levels down to
+// 1x1 and returns the level count. The new levels are allocated here; when
+// memory runs out the chain just ends early.
+uint32_t mip_build(TexLevel *levels, MipFilter filter) {
+    mip_init();
+    uint32_t w = levels[0].width, h = levels[0].height;
+    size_t n = (size_t)w * h;
+    const RGBA *src = (const RGBA*)levels[0].data;
+    float *cur = malloc(n * 4 * sizeof(float));
+    if(!cur) return 1;
+    bool opaque = true;
+    for(size_t i = 0; i < n; ++i) {
+        float a = src[i].a / 255.0f;
+        cur[i * 4] = srgb_to_linear[src[i].r] * a;
+        cur[i * 4 + 1] = srgb_to_linear[src[i].g] * a;
+        cur[i * 4 + 2] = srgb_to_linear[src[i].b] * a;
+        cur[i * 4 + 3] = a;
+        if(src[i].a != 255) opaque = false;
+    }
+    float target = opaque ? 1 : coverage(cur, n, 1);
+    uint32_t count = 1;
+    while((w > 1 || h > 1) && count < MIP_MAX_LEVELS) {
+        uint32_t dw = MAX(w / 2, 1), dh = MAX(h / 2, 1);
+        float *tmp = malloc((size_t)dw * h * 4 * sizeof(float));
+        float *next = malloc((size_t)dw * dh * 4 * sizeof(float));
+        RGBA *out = malloc((size_t)dw * dh * sizeof(RGBA));
+        Taps tx = {0}, ty = {0};
+        bool ok = tmp && next && out && taps_init(&tx, w, dw, filter) && taps_init(&ty, h, dh, filter);
+        if(ok) {
+            MipJobs j = {.src = cur, .tmp = tmp, .dst = next, .sw = w, .sh = h, .dw = dw, .dh = dh, .x = &tx, .y = &ty};
+            pool_run((h + MIP_BAND_ROWS - 1) / MIP_BAND_ROWS, options.threads, mip_rows_job, &j);
+            pool_run((dh + MIP_BAND_ROWS - 1) / MIP_BAND_ROWS, options.threads, mip_cols_job, &j);
+            float scale = opaque ? 1 : coverage_scale(next, (size_t)dw * dh, target);
+            to_rgba(next, (size_t)dw * dh, scale, !opaque, out);
+            levels[count++] = (TexLevel){dw, dh, (uint8_t*)out};
+        } else {
+            free(next);
+            free(out);
+            next = NULL;
+        }
+        taps_free(&tx);
+        taps_free(&ty);
+        free(tmp);
+        free(cur);
+        cur = next;
+        if(!cur) break;
+        w = dw;
+        h = dh;
+    }
+    free(cur);
+    return count;
+}
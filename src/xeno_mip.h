@@ -0,0 +1,10 @@
+#ifndef XENO_MIP_H
+#define XENO_MIP_H
+
+#include <stdint.h>
+
+#include "xenotool.h"
+
+uint32_t mip_build(TexLevel *levels, MipFilter filter);
+
+#endif
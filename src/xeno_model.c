@@ -0,0 +1,95 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "xeno_model.h"
+#include "xenotool.h"
+#include "hashidx.h"
+#include "vector.h"
+
+// where each attribute lives in Vertex
+static const struct {
+    size_t offset;
+    size_t size;
+} vertex_attr[ATTR_COUNT] = {
+    [ATTR_POSITION] = {offsetof(Vertex, x), 3 * sizeof(float)},
+    [ATTR_NORMAL] = {offsetof(Vertex, nx), 3 * sizeof(float)},
+    [ATTR_TEXCOORD] = {offsetof(Vertex, u), 2 * sizeof(float)},
+    [ATTR_COLOR] = {offsetof(Vertex, r), 4 * sizeof(float)},
+    [ATTR_WEIGHTS] = {offsetof(Vertex, w), 4 * sizeof(float)},
+    [ATTR_JOINTS] = {offsetof(Vertex, j), 4 * sizeof(int16_t)},
+};
+
+// Value of an attribute a vertex doesn't have. Streams are only created
+// once a vertex differs from it, and are backfilled with it.
+static const Vertex vertex_default = {.j = {-1, -1, -1, -1}};
+
+void model_init(Model *m) {
+    m->mesh = vector_init(sizeof(Mesh));
+    m->material = vector_init(sizeof(Material));
+    for(int a = 0; a < ATTR_COUNT; ++a) m->attr[a] = vector_init(vertex_attr[a].size);
+    m->vertex_count = 0;
+    m->vertex_index = hashidx_init();
+    m->bone = vector_init(sizeof(uint32_t));
+    m->bone_count = 0;
+    m->name[0] = 0;
+}
+
+void model_cleanup(Model *m) {
+    if(!m) return;
+    for(size_t i = 0; i < m->mesh.length; ++i) vector_cleanup(&((Mesh*)m->mesh.p)[i].tri);
+    vector_cleanup(&m->mesh);
+    vector_cleanup(&m->material);
+    for(int a = 0; a < ATTR_COUNT; ++a) vector_cleanup(&m->attr[a]);
+    hashidx_cleanup(&m->vertex_index);
+    vector_cleanup(&m->bone);
+}
+
+bool model_has(const Model *m, VertexAttribute a) {
+    return m->attr[a].length != 0;
+}
+
+static const void *attr_ptr(const Vertex *v, int a) {
+    return (const char*)v + vertex_attr[a].offset;
+}
+
+static bool vertex_eq(const void *ctx, size_t i, const void *val) {
+    const Model *m = ctx;
+    for(int a = 0; a < ATTR_COUNT; ++a) {
+        size_t size = vertex_attr[a].size;
+        const void *stored = model_has(m, a) ? (const char*)m->attr[a].p + i * size : attr_ptr(&vertex_default, a);
+        if(memcmp(stored, attr_ptr(val, a), size)) return false;
+    }
+    return true;
+}
+
+// Welds v into the model like vector_push_unique_i on whole vertices would,
+// but appends each attribute to its own stream.
+bool model_push_vertex(Model *m, const Vertex *v, size_t *i) {
+    uint64_t hash = hashidx_hash(v, sizeof(Vertex));
+    if(hashidx_find_eq(&m->vertex_index, hash, vertex_eq, m, v, i)) return true;
+    for(int a = 0; a < ATTR_COUNT; ++a) {
+        vector *s = &m->attr[a];
+        const void *val = attr_ptr(v, a);
+        if(!model_has(m, a)) {
+            if(a != ATTR_POSITION && !memcmp(val, attr_ptr(&vertex_default, a), s->size)) continue;
+            if(!vector_grow(s, m->vertex_count + 1)) return false;
+            for(size_t k = 0; k < m->vertex_count; ++k) vector_push(s, attr_ptr(&vertex_default, a));
+        }
+        if(!vector_push(s, val)) return false;
+    }
+    *i = m->vertex_count++;
+    return hashidx_insert(&m->vertex_index, hash, *i);
+}
+
+// Rescales texture coordinates after the texture was cropped to its top
+// left 1/su x 1/sv. v counts from the bottom, like the rest of the model.
+// Vertices pushed after this won't weld with the rescaled ones.
+void model_crop_uv(Model *m, float su, float sv) {
+    float (*uv)[2] = m->attr[ATTR_TEXCOORD].p;
+    if(!uv) return;
+    for(size_t i = 0; i < m->vertex_count; ++i) {
+        uv[i][0] *= su;
+        uv[i][1] = 1 - (1 - uv[i][1]) * sv;
+    }
+}
@@ -0,0 +1,13 @@
+#ifndef XENO_MODEL_H
+#define XENO_MODEL_H
+
+#include <stdbool.h>
+#include "xenotool.h"
+
+void model_init(Model *m);
+void model_cleanup(Model *m);
+bool model_push_vertex(Model *m, const Vertex *v, size_t *i);
+bool model_has(const Model *m, VertexAttribute a);
+void model_crop_uv(Model *m, float su, float sv);
+
+#endif
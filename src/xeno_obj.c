@@ -0,0 +1,481 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "xeno_obj.h"
+#include "xenotool.h"
+#include "macro.h"
+
+#define OBJ_BUFFER_SIZE (1 << 20)
+
+// Buffered text output, numbers are formatted by hand instead of printf.
+typedef struct {
+    FILE *fp;
+    char *p;
+    size_t length;
+    bool error;
+} ObjWriter;
+
+static bool ow_open(ObjWriter *w, const char *filename) {
+    *w = (ObjWriter){0};
+    w->p = malloc(OBJ_BUFFER_SIZE);
+    if(!w->p) return false;
+    w->fp = fopen(filename, "w");
+    if(!w->fp) {
+        free(w->p);
+        return false;
+    }
+    return true;
+}
+
+static void ow_flush(ObjWriter *w) {
+    if(w->length && fwrite(w->p, 1, w->length, w->fp) != w->length) w->error = true;
+    w->length = 0;
+}
+
+static bool ow_close(ObjWriter *w) {
+    ow_flush(w);
+    if(fclose(w->fp)) w->error = true;
+    free(w->p);
+    return !w->error;
+}
+
+// every single number or short string fits, so callers reserve once per item
+static char *ow_reserve(ObjWriter *w, size_t n) {
+    if(OBJ_BUFFER_SIZE - w->length < n) ow_flush(w);
+    return w->p + w->length;
+}
+
+static void ow_str(ObjWriter *w, const char *s) {
+    size_t n = strlen(s);
+    if(n > OBJ_BUFFER_SIZE / 2) {
+        ow_flush(w);
+        if(fwrite(s, 1, n, w->fp) != n) w->error = true;
+        return;
+    }
+    memcpy(ow_reserve(w, n), s, n);
+    w->length += n;
+}
+
+static void ow_char(ObjWriter *w, char c) {
+    *ow_reserve(w, 1) = c;
+    ++w->length;
+}
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const uint32_t pow10_u32[10] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+static uint32_t decimal_length(uint64_t v) {
+    uint32_t n = 1;
+    while(v >= 10) {
+        v /= 10;
+        ++n;
+    }
+    return n;
+}
+
+// writes exactly len digits of v ending at end
+static void put_digits(char *end, uint64_t v, uint32_t len) {
+    while(len >= 2) {
+        end -= 2;
+        memcpy(end, &digit_pairs[(v % 100) * 2], 2);
+        v /= 100;
+        len -= 2;
+    }
+    if(len) *--end = '0' + v % 10;
+}
+
+static char *fmt_u64(char *dst, uint64_t v) {
+    uint32_t len = decimal_length(v);
+    put_digits(dst + len, v, len);
+    return dst + len;
+}
+
+static void ow_u64(ObjWriter *w, uint64_t v) {
+    char *p = ow_reserve(w, 20);
+    w->length += fmt_u64(p, v) - p;
+}
+
+// Shortest round trip float to decimal conversion, this is the Ryu
+// algorithm by Ulf Adams (https://github.com/ulfjack/ryu, f2s.c).
+// The power of 5 tables are built once from their definition.
+#define FLOAT_POW5_INV_BITCOUNT 59
+#define FLOAT_POW5_BITCOUNT 61
+static uint64_t float_pow5_inv_split[31];
+static uint64_t float_pow5_split[47];
+static bool float_tables_ready;
+
+// little endian 32-bit limbs, big enough for 2^128
+typedef struct {
+    uint32_t w[5];
+} ryu_big;
+
+static uint32_t big_bits(const ryu_big *b) {
+    for(int i = 4; i >= 0; --i) {
+        if(b->w[i]) {
+            uint32_t n = 0;
+            while(n < 32 && b->w[i] >> n) ++n;
+            return i * 32 + n;
+        }
+    }
+    return 0;
+}
+
+// top 64 bits after shifting right by s (s may be negative)
+static uint64_t big_shift64(const ryu_big *b, int32_t s) {
+    uint64_t r = 0;
+    for(int bit = 63; bit >= 0; --bit) {
+        int32_t src = bit + s;
+        if(src < 0 || src >= 160) continue;
+        r |= (uint64_t)((b->w[src / 32] >> (src % 32)) & 1) << bit;
+    }
+    return r;
+}
+
+static void ryu_init() {
+    ryu_big p = {{1}};
+    for(uint32_t i = 0; i < 47; ++i) {
+        uint32_t bits = big_bits(&p);
+        float_pow5_split[i] = big_shift64(&p, (int32_t)bits - FLOAT_POW5_BITCOUNT);
+        if(i < 31) {
+            // floor(2^(bits - 1 + 59) / 5^i) + 1, dividing by 5 one step at a time
+            ryu_big q = {{0}};
+            uint32_t e = bits - 1 + FLOAT_POW5_INV_BITCOUNT;
+            q.w[e / 32] = 1u << (e % 32);
+            for(uint32_t k = 0; k < i; ++k) {
+                uint64_t rem = 0;
+                for(int l = 4; l >= 0; --l) {
+                    uint64_t cur = (rem << 32) | q.w[l];
+                    q.w[l] = cur / 5;
+                    rem = cur % 5;
+                }
+            }
+            float_pow5_inv_split[i] = big_shift64(&q, 0) + 1;
+        }
+        uint64_t carry = 0;
+        for(int l = 0; l < 5; ++l) {
+            uint64_t cur = (uint64_t)p.w[l] * 5 + carry;
+            p.w[l] = (uint32_t)cur;
+            carry = cur >> 32;
+        }
+    }
+    float_tables_ready = true;
+}
+
+static inline uint32_t pow5bits(int32_t e) {
+    return (((uint32_t)e * 1217359) >> 19) + 1;
+}
+
+static inline uint32_t log10_pow2(int32_t e) {
+    return ((uint32_t)e * 78913) >> 18;
+}
+
+static inline uint32_t log10_pow5(int32_t e) {
+    return ((uint32_t)e * 732923) >> 20;
+}
+
+static inline uint32_t pow5_factor(uint32_t v) {
+    uint32_t n = 0;
+    while(v % 5 == 0) {
+        v /= 5;
+        ++n;
+    }
+    return n;
+}
+
+static inline bool multiple_of_pow5(uint32_t v, uint32_t p) {
+    return pow5_factor(v) >= p;
+}
+
+static inline bool multiple_of_pow2(uint32_t v, uint32_t p) {
+    return (v & ((1u << p) - 1)) == 0;
+}
+
+static inline uint32_t mul_shift(uint32_t m, uint64_t factor, int32_t shift) {
+    uint64_t bits0 = (uint64_t)m * (uint32_t)factor;
+    uint64_t bits1 = (uint64_t)m * (uint32_t)(factor >> 32);
+    uint64_t sum = (bits0 >> 32) + bits1;
+    return (uint32_t)(sum >> (shift - 32));
+}
+
+// finite f != 0 -> shortest digits and decimal exponent
+static void f2d(uint32_t ieee_mantissa, uint32_t ieee_exponent, uint32_t *digits, int32_t *exponent) {
+    int32_t e2;
+    uint32_t m2;
+    if(ieee_exponent == 0) {
+        e2 = 1 - 127 - 23 - 2;
+        m2 = ieee_mantissa;
+    } else {
+        e2 = (int32_t)ieee_exponent - 127 - 23 - 2;
+        m2 = (1u << 23) | ieee_mantissa;
+    }
+    bool accept_bounds = (m2 & 1) == 0;
+    uint32_t mv = 4 * m2;
+    uint32_t mp = 4 * m2 + 2;
+    uint32_t mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
+    uint32_t mm = 4 * m2 - 1 - mm_shift;
+
+    uint32_t vr, vp, vm;
+    int32_t e10;
+    bool vm_trailing_zeros = false;
+    bool vr_trailing_zeros = false;
+    uint8_t last_removed = 0;
+    if(e2 >= 0) {
+        uint32_t q = log10_pow2(e2);
+        e10 = q;
+        int32_t k = FLOAT_POW5_INV_BITCOUNT + pow5bits(q) - 1;
+        int32_t i = -e2 + q + k;
+        vr = mul_shift(mv, float_pow5_inv_split[q], i);
+        vp = mul_shift(mp, float_pow5_inv_split[q], i);
+        vm = mul_shift(mm, float_pow5_inv_split[q], i);
+        if(q != 0 && (vp - 1) / 10 <= vm / 10) {
+            int32_t l = FLOAT_POW5_INV_BITCOUNT + pow5bits(q - 1) - 1;
+            last_removed = mul_shift(mv, float_pow5_inv_split[q - 1], -e2 + q - 1 + l) % 10;
+        }
+        if(q <= 9) {
+            if(mv % 5 == 0) {
+                vr_trailing_zeros = multiple_of_pow5(mv, q);
+            } else if(accept_bounds) {
+                vm_trailing_zeros = multiple_of_pow5(mm, q);
+            } else {
+                vp -= multiple_of_pow5(mp, q);
+            }
+        }
+    } else {
+        uint32_t q = log10_pow5(-e2);
+        e10 = q + e2;
+        int32_t i = -e2 - q;
+        int32_t k = pow5bits(i) - FLOAT_POW5_BITCOUNT;
+        int32_t j = q - k;
+        vr = mul_shift(mv, float_pow5_split[i], j);
+        vp = mul_shift(mp, float_pow5_split[i], j);
+        vm = mul_shift(mm, float_pow5_split[i], j);
+        if(q != 0 && (vp - 1) / 10 <= vm / 10) {
+            j = q - 1 - (pow5bits(i + 1) - FLOAT_POW5_BITCOUNT);
+            last_removed = mul_shift(mv, float_pow5_split[i + 1], j) % 10;
+        }
+        if(q <= 1) {
+            vr_trailing_zeros = true;
+            if(accept_bounds) {
+                vm_trailing_zeros = mm_shift == 1;
+            } else {
+                --vp;
+            }
+        } else if(q < 31) {
+            vr_trailing_zeros = multiple_of_pow2(mv, q - 1);
+        }
+    }
+
+    int32_t removed = 0;
+    uint32_t output;
+    if(vm_trailing_zeros || vr_trailing_zeros) {
+        while(vp / 10 > vm / 10) {
+            vm_trailing_zeros &= vm % 10 == 0;
+            vr_trailing_zeros &= last_removed == 0;
+            last_removed = vr % 10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            ++removed;
+        }
+        if(vm_trailing_zeros) {
+            while(vm % 10 == 0) {
+                vr_trailing_zeros &= last_removed == 0;
+                last_removed = vr % 10;
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                ++removed;
+            }
+        }
+        // round half to even when the number is exactly halfway
+        if(vr_trailing_zeros && last_removed == 5 && vr % 2 == 0) last_removed = 4;
+        output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) || last_removed >= 5);
+    } else {
+        while(vp / 10 > vm / 10) {
+            last_removed = vr % 10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            ++removed;
+        }
+        output = vr + (vr == vm || last_removed >= 5);
+    }
+    *digits = output;
+    *exponent = e10 + removed;
+}
+
+// Plain decimal where that stays short, exponent notation otherwise.
+static char *fmt_float_shortest(char *dst, float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(float));
+    uint32_t ieee_mantissa = bits & 0x7fffff;
+    uint32_t ieee_exponent = (bits >> 23) & 0xff;
+    if(bits >> 31) *dst++ = '-';
+    if(ieee_exponent == 0xff) {
+        memcpy(dst, ieee_mantissa ? "nan" : "inf", 3);
+        return dst + 3;
+    }
+    if(!ieee_exponent && !ieee_mantissa) {
+        *dst++ = '0';
+        return dst;
+    }
+    if(!float_tables_ready) ryu_init();
+    uint32_t digits;
+    int32_t exp;
+    f2d(ieee_mantissa, ieee_exponent, &digits, &exp);
+    int32_t len = decimal_length(digits);
+    int32_t point = len + exp; // digits before the decimal point
+    if(exp >= 0 && point <= 9) {
+        put_digits(dst + len, digits, len);
+        dst += len;
+        for(int32_t i = 0; i < exp; ++i) *dst++ = '0';
+    } else if(point > 0 && exp < 0) {
+        put_digits(dst + point, digits / pow10_u32[-exp], point);
+        dst[point] = '.';
+        put_digits(dst + len + 1, digits % pow10_u32[-exp], -exp);
+        dst += len + 1;
+    } else if(point <= 0 && point > -6) {
+        *dst++ = '0';
+        *dst++ = '.';
+        for(int32_t i = 0; i < -point; ++i) *dst++ = '0';
+        put_digits(dst + len, digits, len);
+        dst += len;
+    } else {
+        put_digits(dst + len + (len > 1), digits, len);
+        if(len > 1) {
+            dst[0] = dst[1];
+            dst[1] = '.';
+        }
+        dst += len + (len > 1);
+        *dst++ = 'e';
+        int32_t e = point - 1;
+        if(e < 0) {
+            *dst++ = '-';
+            e = -e;
+        }
+        dst = fmt_u64(dst, e);
+    }
+    return dst;
+}
+
+// Same output as printf("%.*f"), which is still used when the scaled value
+// doesn't fit a double exactly.
+static char *fmt_float_fixed(char *dst, float f, int precision) {
+    double scaled = fabs((double)f) * pow10_u32[precision];
+    if(!(scaled < 9007199254740992.0)) return dst + sprintf(dst, "%.*f", precision, f);
+    uint64_t v = (uint64_t)rint(scaled);
+    if(signbit(f)) *dst++ = '-';
+    uint32_t div = pow10_u32[precision];
+    dst = fmt_u64(dst, v / div);
+    if(precision) {
+        *dst++ = '.';
+        put_digits(dst + precision, v % div, precision);
+        dst += precision;
+    }
+    return dst;
+}
+
+static void ow_float(ObjWriter *w, float f, int precision) {
+    char *p = ow_reserve(w, 64);
+    char *end = precision < 0 ? fmt_float_shortest(p, f) : fmt_float_fixed(p, f, MIN(precision, 9));
+    w->length += end - p;
+}
+
+static void ow_floats(ObjWriter *w, const char *prefix, const float *f, int n, int precision) {
+    ow_str(w, prefix);
+    for(int i = 0; i < n; ++i) {
+        ow_char(w, ' ');
+        ow_float(w, f[i], precision);
+    }
+    ow_char(w, '\n');
+}
+
+void save_mtl(char *mtl_filename, char *xtx_filename, Model *m) {
+    ObjWriter w;
+    if(!ow_open(&w, mtl_filename)) return;
+    char tex_filename[256];
+    Material *mp = m->material.p;
+    for(size_t i = 0; i < m->material.length; ++i) {
+        ow_str(&w, "newmtl material_");
+        ow_u64(&w, i);
+        ow_char(&w, '\n');
+        ow_floats(&w, "Kd", mp[i].col.color0, 3, options.obj_precision);
+        if(xtx_filename && mp[i].has_texture) {
+            if(mp[i].pal == 0xff) {
+                snprintf(tex_filename, 256, TEX_RGB_FMT, xtx_filename, TEX_EXT(options.tex_container));
+            } else {
+                snprintf(tex_filename, 256, TEX_PAL_FMT, xtx_filename, TEX_EXT(options.tex_container));
+            }
+            ow_str(&w, "map_Kd ");
+            ow_str(&w, tex_filename);
+            ow_char(&w, '\n');
+        }
+    }
+    if(!ow_close(&w)) printf("Failed to write file: \"%s\"\n", mtl_filename);
+}
+
+static void ow_face_vertex(ObjWriter *w, size_t i, bool normal) {
+    ow_char(w, ' ');
+    ow_u64(w, i + 1);
+    ow_char(w, '/');
+    ow_u64(w, i + 1);
+    ow_char(w, '/');
+    if(normal) ow_u64(w, i + 1);
+}
+
+void save_obj(char *obj_filename, char *mtl_filename, Model *m) {
+    ObjWriter w;
+    if(!ow_open(&w, obj_filename)) return;
+    int precision = options.obj_precision;
+    ow_str(&w, "mtllib ");
+    ow_str(&w, mtl_filename);
+    ow_char(&w, '\n');
+    float (*pos)[3] = m->attr[ATTR_POSITION].p;
+    float (*uv)[2] = m->attr[ATTR_TEXCOORD].p;
+    float (*nrm)[3] = m->attr[ATTR_NORMAL].p;
+    const float zero[2] = {0, 0};
+    for(size_t i = 0; i < m->vertex_count; ++i) {
+        ow_floats(&w, "v", pos[i], 3, precision);
+        ow_floats(&w, "vt", uv ? uv[i] : zero, 2, precision);
+        if(nrm) ow_floats(&w, "vn", nrm[i], 3, precision);
+    }
+    size_t material_index = SIZE_MAX;
+    Mesh *mp = m->mesh.p;
+    for(size_t i = 0; i < m->mesh.length; ++i) {
+        ow_str(&w, "o ");
+        ow_str(&w, mp[i].name);
+        ow_char(&w, '\n');
+        Triangle *tp = mp[i].tri.p;
+        for(size_t j = 0; j < mp[i].tri.length; ++j) {
+            if(tp[j].mat != material_index) {
+                material_index = tp[j].mat;
+                ow_str(&w, "usemtl material_");
+                ow_u64(&w, material_index);
+                ow_char(&w, '\n');
+            }
+            size_t *idx = tp[j].i;
+            bool normal = nrm && nrm[idx[0]][0] + nrm[idx[0]][1] + nrm[idx[0]][2] != 0;
+            ow_char(&w, 'f');
+            for(int k = 0; k < 3; ++k) ow_face_vertex(&w, idx[k], normal);
+            ow_char(&w, '\n');
+        }
+    }
+    if(!ow_close(&w)) printf("Failed to write file: \"%s\"\n", obj_filename);
+}
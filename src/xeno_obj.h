@@ -0,0 +1,9 @@
+#ifndef XENO_OBJ_H
+#define XENO_OBJ_H
+
+#include "xenotool.h"
+
+void save_obj(char *obj_filename, char *mtl_filename, Model *m);
+void save_mtl(char *mtl_filename, char *xtx_filename, Model *m);
+
+#endif
@@ -0,0 +1,732 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "xeno_png.h"
+#include "xenotool.h"
+#include "pool.h"
+#include "macro.h"
+
+// Rows are filtered and deflated in independent stripes so they can be
+// encoded in parallel. Every stripe becomes its own IDAT chunk; stripes
+// don't share a deflate window, which costs next to nothing at this size.
+// The output only depends on the image, not on the thread count.
+#define PNG_STRIPE_ROWS 64
+
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_WINDOW_MASK (DEFLATE_WINDOW - 1)
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_MAX_CHAIN 32 // match candidates tried per position
+#define DEFLATE_LAZY_LIMIT 32 // don't look for a better match after one this long
+#define DEFLATE_STORED_MAX 65535
+
+static const uint16_t len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+// order the code length code lengths are sent in
+static const uint8_t codelen_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+static uint8_t len_code[DEFLATE_MAX_MATCH + 1];
+static uint8_t dist_code_table[512];
+static uint32_t crc_table[256];
+static bool png_ready;
+
+static void png_init() {
+    if(png_ready) return;
+    for(int c = 0; c < 29; ++c) {
+        for(int l = len_base[c]; l < len_base[c] + (1 << len_extra[c]) && l <= DEFLATE_MAX_MATCH; ++l) len_code[l] = c;
+    }
+    for(int c = 0; c < 30; ++c) {
+        for(int d = dist_base[c]; d < dist_base[c] + (1 << dist_extra[c]); ++d) {
+            if(d <= 256) {
+                dist_code_table[d - 1] = c;
+            } else {
+                dist_code_table[256 + ((d - 1) >> 7)] = c;
+            }
+        }
+    }
+    for(uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for(int k = 0; k < 8; ++k) c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+    png_ready = true;
+}
+
+static inline uint32_t dist_code(uint32_t d) {
+    return d <= 256 ? dist_code_table[d - 1] : dist_code_table[256 + ((d - 1) >> 7)];
+}
+
+// running CRC, start with 0xffffffff and invert at the end
+static uint32_t crc_update(uint32_t c, const uint8_t *p, size_t n) {
+    for(size_t i = 0; i < n; ++i) c = crc_table[(c ^ p[i]) & 0xff] ^ (c >> 8);
+    return c;
+}
+
+static uint32_t adler32(const uint8_t *p, size_t n) {
+    uint32_t s1 = 1, s2 = 0;
+    while(n) {
+        // largest block that can't overflow s2
+        size_t k = MIN(n, 5552);
+        n -= k;
+        while(k--) {
+            s1 += *p++;
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+    }
+    return s2 << 16 | s1;
+}
+
+// adler32 of two buffers back to back, from the checksums of both
+static uint32_t adler32_combine(uint32_t a1, uint32_t a2, size_t len2) {
+    const uint32_t base = 65521;
+    uint32_t rem = len2 % base;
+    uint32_t s1 = a1 & 0xffff;
+    uint32_t s2 = (rem * s1) % base;
+    s1 += (a2 & 0xffff) + base - 1;
+    s2 += (a1 >> 16) + (a2 >> 16) + base - rem;
+    if(s1 >= base) s1 -= base;
+    if(s1 >= base) s1 -= base;
+    if(s2 >= base * 2) s2 -= base * 2;
+    if(s2 >= base) s2 -= base;
+    return s2 << 16 | s1;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+typedef struct {
+    uint8_t *p;
+    size_t length;
+    uint64_t bits;
+    uint32_t count;
+} BitWriter;
+
+// n <= 16
+static inline void bw_put(BitWriter *b, uint32_t v, uint32_t n) {
+    b->bits |= (uint64_t)v << b->count;
+    b->count += n;
+    if(b->count >= 32) {
+        for(int k = 0; k < 4; ++k) b->p[b->length++] = b->bits >> (k * 8);
+        b->bits >>= 32;
+        b->count -= 32;
+    }
+}
+
+static void bw_align(BitWriter *b) {
+    while(b->count) {
+        b->p[b->length++] = b->bits;
+        b->bits >>= 8;
+        b->count = b->count > 8 ? b->count - 8 : 0;
+    }
+}
+
+// literal when dist is 0, otherwise a match
+typedef struct {
+    uint16_t value;
+    uint16_t dist;
+} Token;
+
+typedef struct {
+    Token *tok;
+    size_t count;
+    uint32_t lit_freq[286];
+    uint32_t dist_freq[30];
+} TokenList;
+
+static inline void emit_literal(TokenList *t, uint8_t c) {
+    t->tok[t->count++] = (Token){c, 0};
+    ++t->lit_freq[c];
+}
+
+static inline void emit_match(TokenList *t, uint32_t len, uint32_t dist) {
+    t->tok[t->count++] = (Token){len, dist};
+    ++t->lit_freq[257 + len_code[len]];
+    ++t->dist_freq[dist_code(dist)];
+}
+
+static inline uint32_t match_length(const uint8_t *a, const uint8_t *b, uint32_t max) {
+    uint32_t len = 0;
+    while(len + 8 <= max) {
+        uint64_t x, y;
+        memcpy(&x, a + len, 8);
+        memcpy(&y, b + len, 8);
+        if(x != y) return len + (__builtin_ctzll(x ^ y) >> 3);
+        len += 8;
+    }
+    while(len < max && a[len] == b[len]) ++len;
+    return len;
+}
+
+static inline uint32_t hash3(const uint8_t *p) {
+    return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+// Hash chain search with one step of lazy matching like zlib's default levels.
+static void lz77_chain(const uint8_t *in, size_t n, int32_t *head, int32_t *prev, TokenList *t) {
+    for(size_t i = 0; i < (1 << DEFLATE_HASH_BITS); ++i) head[i] = -1;
+    uint32_t prev_len = 0, prev_dist = 0;
+    bool pending = false;
+    for(size_t i = 0; i < n; ++i) {
+        uint32_t len = 0, dist = 0;
+        if(i + DEFLATE_MIN_MATCH <= n) {
+            uint32_t h = hash3(in + i);
+            int32_t cand = head[h];
+            uint32_t max = MIN(DEFLATE_MAX_MATCH, n - i);
+            int chain = (pending && prev_len >= DEFLATE_LAZY_LIMIT) ? 0 : DEFLATE_MAX_CHAIN;
+            while(cand >= 0 && i - cand <= DEFLATE_WINDOW && chain--) {
+                if(in[cand + len] == in[i + len] || !len) {
+                    uint32_t l = match_length(in + cand, in + i, max);
+                    if(l > len) {
+                        len = l;
+                        dist = i - cand;
+                        if(l == max) break;
+                    }
+                }
+                int32_t next = prev[cand & DEFLATE_WINDOW_MASK];
+                if(next >= cand) break;
+                cand = next;
+            }
+            prev[i & DEFLATE_WINDOW_MASK] = head[h];
+            head[h] = i;
+            if(len < DEFLATE_MIN_MATCH) len = 0;
+        }
+        if(pending && prev_len && len <= prev_len) {
+            // the match from the previous position wins, skip over it
+            emit_match(t, prev_len, prev_dist);
+            size_t end = i - 1 + prev_len;
+            for(++i; i < end; ++i) {
+                if(i + DEFLATE_MIN_MATCH > n) continue;
+                uint32_t h = hash3(in + i);
+                prev[i & DEFLATE_WINDOW_MASK] = head[h];
+                head[h] = i;
+            }
+            --i;
+            pending = false;
+        } else {
+            if(pending) emit_literal(t, in[i - 1]);
+            pending = true;
+            prev_len = len;
+            prev_dist = dist;
+        }
+    }
+    if(pending) emit_literal(t, in[n - 1]);
+}
+
+// Fast mode: greedy runs only, repeats of the previous byte or pixel.
+static void lz77_rle(const uint8_t *in, size_t n, uint32_t bpp, TokenList *t) {
+    for(size_t i = 0; i < n;) {
+        uint32_t max = MIN(DEFLATE_MAX_MATCH, n - i);
+        uint32_t len = i >= 1 ? match_length(in + i - 1, in + i, max) : 0;
+        uint32_t dist = 1;
+        if(bpp > 1 && i >= bpp) {
+            uint32_t l = match_length(in + i - bpp, in + i, max);
+            if(l > len) {
+                len = l;
+                dist = bpp;
+            }
+        }
+        if(len >= DEFLATE_MIN_MATCH) {
+            emit_match(t, len, dist);
+            i += len;
+        } else {
+            emit_literal(t, in[i++]);
+        }
+    }
+}
+
+// Huffman code lengths limited to max_bits. The tree is built by plain
+// repeated minimum search, there are at most 286 symbols.
+static void huff_lengths(const uint32_t *freq, int n, int max_bits, uint8_t *len) {
+    int sym[286];
+    uint32_t weight[2 * 286];
+    int16_t parent[2 * 286];
+    uint16_t depth[2 * 286];
+    int used = 0;
+    for(int s = 0; s < n; ++s) {
+        len[s] = 0;
+        if(freq[s]) sym[used++] = s;
+    }
+    if(used == 0) return;
+    if(used == 1) {
+        // a lone code still needs a sibling for the code to be complete
+        len[sym[0]] = 1;
+        len[sym[0] ? 0 : 1] = 1;
+        return;
+    }
+    for(int i = 0; i < used; ++i) {
+        weight[i] = freq[sym[i]];
+        parent[i] = -1;
+    }
+    int nodes = used;
+    for(int m = 0; m < used - 1; ++m) {
+        int a = -1, b = -1;
+        for(int i = 0; i < nodes; ++i) {
+            if(parent[i] >= 0) continue;
+            if(a < 0 || weight[i] < weight[a]) {
+                b = a;
+                a = i;
+            } else if(b < 0 || weight[i] < weight[b]) {
+                b = i;
+            }
+        }
+        weight[nodes] = weight[a] + weight[b];
+        parent[nodes] = -1;
+        parent[a] = parent[b] = nodes;
+        ++nodes;
+    }
+    uint32_t count[288] = {0};
+    depth[nodes - 1] = 0;
+    for(int i = nodes - 2; i >= 0; --i) {
+        depth[i] = depth[parent[i]] + 1;
+        if(i < used) ++count[MIN(depth[i], max_bits)];
+    }
+    // Too long codes are clamped, then shorter codes are lengthened until
+    // the code is complete again (the same fix up miniz uses).
+    uint32_t total = 0;
+    for(int i = max_bits; i > 0; --i) total += count[i] << (max_bits - i);
+    while(total != (1u << max_bits)) {
+        --count[max_bits];
+        for(int i = max_bits - 1; i > 0; --i) {
+            if(count[i]) {
+                --count[i];
+                count[i + 1] += 2;
+                break;
+            }
+        }
+        --total;
+    }
+    // most frequent symbols get the shortest codes
+    for(int i = 1; i < used; ++i) {
+        int s = sym[i];
+        int k = i;
+        for(; k > 0 && freq[sym[k - 1]] < freq[s]; --k) sym[k] = sym[k - 1];
+        sym[k] = s;
+    }
+    int k = 0;
+    for(int l = 1; l <= max_bits; ++l) {
+        for(uint32_t c = 0; c < count[l]; ++c) len[sym[k++]] = l;
+    }
+}
+
+// canonical codes, bit reversed since deflate sends them MSB first
+static void huff_codes(const uint8_t *len, int n, uint16_t *code) {
+    uint16_t count[16] = {0}, next[16];
+    for(int s = 0; s < n; ++s) ++count[len[s]];
+    count[0] = 0;
+    uint16_t c = 0;
+    for(int b = 1; b < 16; ++b) {
+        c = (c + count[b - 1]) << 1;
+        next[b] = c;
+    }
+    for(int s = 0; s < n; ++s) {
+        if(!len[s]) continue;
+        uint16_t v = next[len[s]]++, r = 0;
+        for(int b = 0; b < len[s]; ++b) r |= ((v >> b) & 1) << (len[s] - 1 - b);
+        code[s] = r;
+    }
+}
+
+typedef struct {
+    uint8_t lit_len[288];
+    uint8_t dist_len[30];
+    uint16_t lit_code[288];
+    uint16_t dist_code[30];
+    int hlit, hdist, hclen;
+    uint8_t cl_len[19];
+    uint16_t cl_code[19];
+    uint8_t rle[286 + 30];
+    uint8_t rle_extra[286 + 30];
+    int rle_count;
+} HuffBlock;
+
+// code lengths with runs as symbols 16 (repeat previous 3-6 times),
+// 17 (3-10 zeros) and 18 (11-138 zeros)
+static void rle_lengths(HuffBlock *hb, const uint8_t *lens, int n) {
+    hb->rle_count = 0;
+    for(int i = 0; i < n;) {
+        uint8_t l = lens[i];
+        int run = 1;
+        while(i + run < n && lens[i + run] == l) ++run;
+        i += run;
+        if(l == 0) {
+            while(run >= 11) {
+                int k = MIN(run, 138);
+                hb->rle[hb->rle_count] = 18;
+                hb->rle_extra[hb->rle_count++] = k - 11;
+                run -= k;
+            }
+            if(run >= 3) {
+                hb->rle[hb->rle_count] = 17;
+                hb->rle_extra[hb->rle_count++] = run - 3;
+                run = 0;
+            }
+        } else {
+            hb->rle[hb->rle_count++] = l;
+            --run;
+            while(run >= 3) {
+                int k = MIN(run, 6);
+                hb->rle[hb->rle_count] = 16;
+                hb->rle_extra[hb->rle_count++] = k - 3;
+                run -= k;
+            }
+        }
+        while(run-- > 0) hb->rle[hb->rle_count++] = l;
+    }
+}
+
+static const uint8_t rle_extra_bits[19] = {[16] = 2, [17] = 3, [18] = 7};
+
+static size_t token_extra_bits(const TokenList *t) {
+    size_t bits = 0;
+    for(int c = 0; c < 29; ++c) bits += (size_t)t->lit_freq[257 + c] * len_extra[c];
+    for(int c = 0; c < 30; ++c) bits += (size_t)t->dist_freq[c] * dist_extra[c];
+    return bits;
+}
+
+// returns the size of the block in bits
+static size_t huff_dynamic(HuffBlock *hb, const TokenList *t) {
+    huff_lengths(t->lit_freq, 286, 15, hb->lit_len);
+    // blocks without matches still get a distance code, not every
+    // decoder takes an empty one
+    uint32_t dist_freq[30];
+    bool any = false;
+    for(int s = 0; s < 30; ++s) {
+        dist_freq[s] = t->dist_freq[s];
+        any |= dist_freq[s] != 0;
+    }
+    if(!any) dist_freq[0] = 1;
+    huff_lengths(dist_freq, 30, 15, hb->dist_len);
+    hb->hlit = 286;
+    while(hb->hlit > 257 && !hb->lit_len[hb->hlit - 1]) --hb->hlit;
+    hb->hdist = 30;
+    while(hb->hdist > 1 && !hb->dist_len[hb->hdist - 1]) --hb->hdist;
+    uint8_t lens[286 + 30];
+    memcpy(lens, hb->lit_len, hb->hlit);
+    memcpy(lens + hb->hlit, hb->dist_len, hb->hdist);
+    rle_lengths(hb, lens, hb->hlit + hb->hdist);
+    uint32_t cl_freq[19] = {0};
+    for(int i = 0; i < hb->rle_count; ++i) ++cl_freq[hb->rle[i]];
+    huff_lengths(cl_freq, 19, 7, hb->cl_len);
+    hb->hclen = 19;
+    while(hb->hclen > 4 && !hb->cl_len[codelen_order[hb->hclen - 1]]) --hb->hclen;
+    huff_codes(hb->lit_len, 286, hb->lit_code);
+    huff_codes(hb->dist_len, 30, hb->dist_code);
+    huff_codes(hb->cl_len, 19, hb->cl_code);
+    size_t bits = 3 + 5 + 5 + 4 + 3 * hb->hclen;
+    for(int i = 0; i < hb->rle_count; ++i) bits += hb->cl_len[hb->rle[i]] + rle_extra_bits[hb->rle[i]];
+    for(int s = 0; s < 286; ++s) bits += (size_t)t->lit_freq[s] * hb->lit_len[s];
+    for(int s = 0; s < 30; ++s) bits += (size_t)t->dist_freq[s] * hb->dist_len[s];
+    return bits + token_extra_bits(t);
+}
+
+static size_t huff_fixed(HuffBlock *hb, const TokenList *t) {
+    for(int s = 0; s < 288; ++s) hb->lit_len[s] = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+    for(int s = 0; s < 30; ++s) hb->dist_len[s] = 5;
+    huff_codes(hb->lit_len, 288, hb->lit_code);
+    huff_codes(hb->dist_len, 30, hb->dist_code);
+    size_t bits = 3;
+    for(int s = 0; s < 286; ++s) bits += (size_t)t->lit_freq[s] * hb->lit_len[s];
+    for(int s = 0; s < 30; ++s) bits += (size_t)t->dist_freq[s] * 5;
+    return bits + token_extra_bits(t);
+}
+
+static void write_huff_block(BitWriter *b, const HuffBlock *hb, const TokenList *t, bool final, bool dynamic) {
+    bw_put(b, final | (dynamic ? 2 : 1) << 1, 3);
+    if(dynamic) {
+        bw_put(b, hb->hlit - 257, 5);
+        bw_put(b, hb->hdist - 1, 5);
+        bw_put(b, hb->hclen - 4, 4);
+        for(int i = 0; i < hb->hclen; ++i) bw_put(b, hb->cl_len[codelen_order[i]], 3);
+        for(int i = 0; i < hb->rle_count; ++i) {
+            uint8_t s = hb->rle[i];
+            bw_put(b, hb->cl_code[s], hb->cl_len[s]);
+            if(rle_extra_bits[s]) bw_put(b, hb->rle_extra[i], rle_extra_bits[s]);
+        }
+    }
+    for(size_t i = 0; i < t->count; ++i) {
+        Token k = t->tok[i];
+        if(!k.dist) {
+            bw_put(b, hb->lit_code[k.value], hb->lit_len[k.value]);
+            continue;
+        }
+        uint32_t lc = len_code[k.value];
+        bw_put(b, hb->lit_code[257 + lc], hb->lit_len[257 + lc]);
+        if(len_extra[lc]) bw_put(b, k.value - len_base[lc], len_extra[lc]);
+        uint32_t dc = dist_code(k.dist);
+        bw_put(b, hb->dist_code[dc], hb->dist_len[dc]);
+        if(dist_extra[dc]) bw_put(b, k.dist - dist_base[dc], dist_extra[dc]);
+    }
+    bw_put(b, hb->lit_code[256], hb->lit_len[256]);
+}
+
+static void write_stored(BitWriter *b, const uint8_t *in, size_t n, bool final) {
+    do {
+        size_t k = MIN(n, DEFLATE_STORED_MAX);
+        n -= k;
+        bw_put(b, final && !n, 3);
+        bw_align(b);
+        uint8_t hdr[4] = {(uint8_t)k, (uint8_t)(k >> 8), (uint8_t)~k, (uint8_t)(~k >> 8)};
+        memcpy(b->p + b->length, hdr, 4);
+        memcpy(b->p + b->length + 4, in, k);
+        b->length += 4 + k;
+        in += k;
+    } while(n);
+}
+
+static size_t stored_size(size_t n) {
+    return n + 5 * MAX((n + DEFLATE_STORED_MAX - 1) / DEFLATE_STORED_MAX, 1);
+}
+
+static size_t deflate_bound(size_t n) {
+    // zlib header, sync flush and the adler32 on top of stored blocks
+    return stored_size(n) + 2 + 5 + 4 + 8;
+}
+
+// Deflates one stripe as a single block, whichever of dynamic, fixed and
+// stored is smallest. Stripes other than the last end on a byte boundary.
+static bool deflate_stripe(const uint8_t *in, size_t n, uint32_t bpp, bool fast, bool final, BitWriter *b) {
+    TokenList t = {0};
+    t.tok = malloc(n * sizeof(Token));
+    int32_t *head = fast ? NULL : malloc((1 << DEFLATE_HASH_BITS) * sizeof(int32_t));
+    int32_t *prev = fast ? NULL : malloc(DEFLATE_WINDOW * sizeof(int32_t));
+    HuffBlock *hb = malloc(sizeof(HuffBlock));
+    bool ok = t.tok && hb && (fast || (head && prev));
+    if(ok) {
+        if(fast) {
+            lz77_rle(in, n, bpp, &t);
+        } else {
+            lz77_chain(in, n, head, prev, &t);
+        }
+        ++t.lit_freq[256];
+        HuffBlock fixed;
+        size_t dynamic_bits = huff_dynamic(hb, &t);
+        size_t fixed_bits = huff_fixed(&fixed, &t);
+        size_t huff_bits = MIN(dynamic_bits, fixed_bits);
+        if(huff_bits / 8 + 1 + (final ? 0 : 5) >= stored_size(n)) {
+            write_stored(b, in, n, final);
+        } else {
+            write_huff_block(b, fixed_bits < dynamic_bits ? &fixed : hb, &t, final, fixed_bits >= dynamic_bits);
+            if(!final) {
+                // empty stored block to get back to a byte boundary
+                bw_put(b, 0, 3);
+                bw_align(b);
+                memcpy(b->p + b->length, "\x00\x00\xff\xff", 4);
+                b->length += 4;
+            }
+        }
+        bw_align(b);
+    }
+    free(hb);
+    free(prev);
+    free(head);
+    free(t.tok);
+    return ok;
+}
+
+static void filter_row(uint8_t type, const uint8_t *row, const uint8_t *up, size_t n, uint32_t bpp, uint8_t *dst) {
+    for(size_t i = 0; i < n; ++i) {
+        uint8_t a = i >= bpp ? row[i - bpp] : 0;
+        uint8_t b = up ? up[i] : 0;
+        uint8_t c = i >= bpp && up ? up[i - bpp] : 0;
+        uint8_t p;
+        switch(type) {
+            case 1: p = a; break;
+            case 2: p = b; break;
+            case 3: p = (a + b) >> 1; break;
+            case 4: {
+                int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+                p = (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+                break;
+            }
+            default: p = 0; break;
+        }
+        dst[i] = row[i] - p;
+    }
+}
+
+typedef struct {
+    const uint8_t *pixels;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bpp;
+    bool fast;
+    size_t stripes;
+    uint8_t **out;
+    size_t *out_length;
+    uint32_t *adler;
+    size_t *raw_length;
+    uint32_t *crc;
+} PngJobs;
+
+static void png_stripe_job(void *ctx, size_t job, size_t worker) {
+    (void)worker;
+    PngJobs *j = ctx;
+    size_t row_size = (size_t)j->width * j->bpp;
+    uint32_t y0 = job * PNG_STRIPE_ROWS;
+    uint32_t y1 = MIN(y0 + PNG_STRIPE_ROWS, j->height);
+    size_t n = (y1 - y0) * (row_size + 1);
+    uint8_t *raw = malloc(n);
+    uint8_t *tmp = j->fast ? NULL : malloc(row_size * 4);
+    j->out[job] = malloc(deflate_bound(n));
+    if(!raw || (!j->fast && !tmp) || !j->out[job]) {
+        free(tmp);
+        free(raw);
+        return;
+    }
+    for(uint32_t y = y0; y < y1; ++y) {
+        const uint8_t *row = j->pixels + y * row_size;
+        const uint8_t *up = y ? row - row_size : NULL;
+        uint8_t *dst = raw + (y - y0) * (row_size + 1);
+        if(j->fast) {
+            dst[0] = 2;
+            filter_row(2, row, up, row_size, j->bpp, dst + 1);
+            continue;
+        }
+        // pick the filter with the smallest sum of absolute differences
+        uint8_t best = 0;
+        uint64_t best_sum = UINT64_MAX;
+        for(uint8_t f = 0; f < 5; ++f) {
+            uint8_t *p = f ? tmp + (f - 1) * row_size : dst + 1;
+            if(f) {
+                filter_row(f, row, up, row_size, j->bpp, p);
+            } else {
+                memcpy(p, row, row_size);
+            }
+            uint64_t sum = 0;
+            for(size_t i = 0; i < row_size; ++i) sum += abs((int8_t)p[i]);
+            if(sum < best_sum) {
+                best_sum = sum;
+                best = f;
+            }
+        }
+        dst[0] = best;
+        if(best) memcpy(dst + 1, tmp + (best - 1) * row_size, row_size);
+    }
+    BitWriter b = {.p = j->out[job]};
+    if(job == 0) {
+        b.p[b.length++] = 0x78;
+        b.p[b.length++] = j->fast ? 0x01 : 0x9c;
+    }
+    // a stripe that failed keeps out_length 0
+    if(deflate_stripe(raw, n, j->bpp, j->fast, job == j->stripes - 1, &b)) j->out_length[job] = b.length;
+    j->adler[job] = adler32(raw, n);
+    j->raw_length[job] = n;
+    j->crc[job] = crc_update(crc_update(0xffffffff, (const uint8_t*)"IDAT", 4), b.p, b.length);
+    free(tmp);
+    free(raw);
+}
+
+static bool png_chunk(FILE *fp, const char *type, const uint8_t *data, uint32_t length, uint32_t crc) {
+    uint8_t hdr[8];
+    put_be32(hdr, length);
+    memcpy(hdr + 4, type, 4);
+    uint8_t end[4];
+    put_be32(end, crc ^ 0xffffffff);
+    return fwrite(hdr, 1, 8, fp) == 8 && (!length || fwrite(data, 1, length, fp) == length) && fwrite(end, 1, 4, fp) == 4;
+}
+
+static bool png_chunk_crc(FILE *fp, const char *type, const uint8_t *data, uint32_t length) {
+    uint32_t crc = crc_update(crc_update(0xffffffff, (const uint8_t*)type, 4), data, length);
+    return png_chunk(fp, type, data, length, crc);
+}
+
+// pal holds pal_count RGBA entries for color type 3, NULL otherwise
+static bool png_encode(const char *filename, const uint8_t *pixels, uint32_t width, uint32_t height,
+                       uint8_t channels, uint8_t color_type, const uint8_t *pal, uint32_t pal_count) {
+    png_init();
+    size_t stripes = (height + PNG_STRIPE_ROWS - 1) / PNG_STRIPE_ROWS;
+    PngJobs j = {
+        .pixels = pixels, .width = width, .height = height, .bpp = channels, .fast = options.png_fast,
+        .stripes = stripes,
+        .out = calloc(stripes, sizeof(uint8_t*)),
+        .out_length = calloc(stripes, sizeof(size_t)),
+        .adler = calloc(stripes, sizeof(uint32_t)),
+        .raw_length = calloc(stripes, sizeof(size_t)),
+        .crc = calloc(stripes, sizeof(uint32_t))
+    };
+    bool ok = j.out && j.out_length && j.adler && j.raw_length && j.crc;
+    if(ok) {
+        pool_run(stripes, options.threads, png_stripe_job, &j);
+        for(size_t i = 0; i < stripes; ++i) ok = ok && j.out_length[i];
+    }
+    FILE *fp = ok ? fopen(filename, "wb") : NULL;
+    if(fp) {
+        // the adler32 trailer goes at the end of the last stripe
+        uint32_t adler = j.adler[0];
+        for(size_t i = 1; i < stripes; ++i) adler = adler32_combine(adler, j.adler[i], j.raw_length[i]);
+        uint8_t *last = j.out[stripes - 1] + j.out_length[stripes - 1];
+        put_be32(last, adler);
+        j.crc[stripes - 1] = crc_update(j.crc[stripes - 1], last, 4);
+        j.out_length[stripes - 1] += 4;
+
+        uint8_t ihdr[13] = {0};
+        put_be32(ihdr, width);
+        put_be32(ihdr + 4, height);
+        ihdr[8] = 8;
+        ihdr[9] = color_type;
+        ok = fwrite("\x89PNG\r\n\x1a\n", 1, 8, fp) == 8 && png_chunk_crc(fp, "IHDR", ihdr, 13);
+        if(pal) {
+            // tRNS can stop after the last entry that isn't opaque
+            uint8_t plte[256 * 3], trns[256];
+            uint32_t trns_count = 0;
+            for(uint32_t i = 0; i < pal_count; ++i) {
+                memcpy(plte + i * 3, pal + i * 4, 3);
+                trns[i] = pal[i * 4 + 3];
+                if(trns[i] != 0xff) trns_count = i + 1;
+            }
+            ok = ok && png_chunk_crc(fp, "PLTE", plte, pal_count * 3);
+            if(trns_count) ok = ok && png_chunk_crc(fp, "tRNS", trns, trns_count);
+        }
+        for(size_t i = 0; i < stripes && ok; ++i) ok = png_chunk(fp, "IDAT", j.out[i], j.out_length[i], j.crc[i]);
+        ok = ok && png_chunk_crc(fp, "IEND", NULL, 0);
+        if(fclose(fp)) ok = false;
+    } else {
+        ok = false;
+    }
+    for(size_t i = 0; j.out && i < stripes; ++i) free(j.out[i]);
+    free(j.out);
+    free(j.out_length);
+    free(j.adler);
+    free(j.raw_length);
+    free(j.crc);
+    return ok;
+}
+
+// Writes 8-bit gray (1 channel), gray + alpha (2), RGB (3) or RGBA (4)
+// pixels. With options.png_fast rows use the Up filter and deflate only
+// looks for runs, which is several times faster for slightly larger files.
+bool png_write(const char *filename, const uint8_t *pixels, uint32_t width, uint32_t height, uint8_t channels) {
+    static const uint8_t color_type[5] = {0, 0, 4, 2, 6};
+    if(!width || !height || !channels || channels > 4) return false;
+    return png_encode(filename, pixels, width, height, channels, color_type[channels], NULL, 0);
+}
+
+// Writes 8-bit palette indices with up to 256 RGBA palette entries.
+bool png_write_indexed(const char *filename, const uint8_t *idx, uint32_t width, uint32_t height, const uint8_t *pal, uint32_t pal_count) {
+    if(!width || !height || !pal_count || pal_count > 256) return false;
+    return png_encode(filename, idx, width, height, 1, 3, pal, pal_count);
+}
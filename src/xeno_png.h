@@ -0,0 +1,10 @@
+#ifndef XENO_PNG_H
+#define XENO_PNG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+bool png_write(const char *filename, const uint8_t *pixels, uint32_t width, uint32_t height, uint8_t channels);
+bool png_write_indexed(const char *filename, const uint8_t *idx, uint32_t width, uint32_t height, const uint8_t *pal, uint32_t pal_count);
+
+#endif
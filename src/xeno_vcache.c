@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "xeno_vcache.h"
+#include "xeno_model.h"
+#include "pool.h"
+#include "xenotool.h"
+#include "macro.h"
+
+// Triangles are reordered with Tom Forsyth's linear speed vertex cache
+// optimisation: every vertex scores by its place in a modelled LRU cache
+// and by how few triangles still use it, the next triangle is the best
+// scoring one around the vertices in the cache. Each material span of a
+// mesh is done on its own, spans are what save_glb makes primitives of.
+//
+// Then the span is cut into clusters that keep the cache order, and the
+// clusters are sorted for overdraw like Tipsify and meshoptimizer do:
+// ones that face away from the span center are drawn first, so they
+// occlude the inner ones from most views.
+
+#define CACHE_SIZE 32
+#define CACHE_DECAY_POWER 1.5f
+#define LAST_TRI_SCORE 0.75f
+#define VALENCE_BOOST_SCALE 2.0f
+#define VALENCE_BOOST_POWER 0.5f
+#define VALENCE_MAX 64 // valence scores past this are computed
+#define OVERDRAW_CACHE 16 // FIFO cache the clusters are cut for
+#define OVERDRAW_THRESHOLD 1.05f // clusters may miss this much more than the cache order
+
+static float cache_score[CACHE_SIZE];
+static float valence_score[VALENCE_MAX];
+static bool vcache_ready;
+
+static void vcache_init() {
+    if(vcache_ready) return;
+    for(int i = 0; i < CACHE_SIZE; ++i) {
+        // the last triangle's vertices get a fixed score, so it doesn't
+        // matter in which order they went in
+        cache_score[i] = i < 3 ? LAST_TRI_SCORE : powf(1 - (float)(i - 3) / (CACHE_SIZE - 3), CACHE_DECAY_POWER);
+    }
+    valence_score[0] = 0;
+    for(int i = 1; i < VALENCE_MAX; ++i) valence_score[i] = VALENCE_BOOST_SCALE * powf(i, -VALENCE_BOOST_POWER);
+    vcache_ready = true;
+}
+
+static float vertex_score(int cache_pos, uint32_t remaining) {
+    if(!remaining) return -1;
+    float s = cache_pos >= 0 ? cache_score[cache_pos] : 0;
+    return s + (remaining < VALENCE_MAX ? valence_score[remaining] : VALENCE_BOOST_SCALE * powf(remaining, -VALENCE_BOOST_POWER));
+}
+
+typedef struct {
+    size_t mesh;
+    size_t first;
+    size_t count;
+} Span;
+
+// Per worker scratch. local maps model vertices to the span's, it is all
+// -1 between spans.
+typedef struct {
+    int32_t *local;
+    uint32_t *vertex; // span vertex to model vertex
+    uint32_t *remaining; // triangles not emitted yet, per span vertex
+    uint32_t *adj_first;
+    uint32_t *adj; // triangles of each span vertex, remaining ones first
+    int32_t *cache_pos;
+    float *score;
+    uint32_t (*tri)[3]; // in span vertices
+    float *tri_score;
+    bool *emitted;
+    Triangle *out;
+    uint32_t *stamp; // FIFO cache time each span vertex went in
+    uint32_t *cluster; // first triangle of each cluster
+    struct cluster_key {
+        float key;
+        uint32_t cluster;
+    } *order;
+} Scratch;
+
+typedef struct {
+    Model *m;
+    const Span *span;
+    Scratch *scratch;
+    size_t *clusters; // overdraw clusters per span
+} VCacheJobs;
+
+static void scratch_free(Scratch *s) {
+    free(s->local);
+    free(s->vertex);
+    free(s->remaining);
+    free(s->adj_first);
+    free(s->adj);
+    free(s->cache_pos);
+    free(s->score);
+    free(s->tri);
+    free(s->tri_score);
+    free(s->emitted);
+    free(s->out);
+    free(s->stamp);
+    free(s->cluster);
+    free(s->order);
+}
+
+// sized for the largest span
+static bool scratch_init(Scratch *s, size_t vertex_count, size_t tri_count) {
+    size_t vc = MIN(vertex_count, tri_count * 3) + 1;
+    s->local = malloc(vertex_count * sizeof(int32_t) + 1);
+    s->vertex = malloc(vc * sizeof(uint32_t));
+    s->remaining = malloc(vc * sizeof(uint32_t));
+    s->adj_first = malloc((vc + 1) * sizeof(uint32_t));
+    s->adj = malloc(tri_count * 3 * sizeof(uint32_t) + 1);
+    s->cache_pos = malloc(vc * sizeof(int32_t));
+    s->score = malloc(vc * sizeof(float));
+    s->tri = malloc(tri_count * sizeof(uint32_t[3]) + 1);
+    s->tri_score = malloc(tri_count * sizeof(float) + 1);
+    s->emitted = malloc(tri_count + 1);
+    s->out = malloc(tri_count * sizeof(Triangle) + 1);
+    s->stamp = malloc(vc * sizeof(uint32_t));
+    s->cluster = malloc((tri_count + 1) * sizeof(uint32_t));
+    s->order = malloc((tri_count + 1) * sizeof(struct cluster_key));
+    if(!s->local || !s->vertex || !s->remaining || !s->adj_first || !s->adj || !s->cache_pos || !s->score || !s->tri || !s->tri_score || !s->emitted || !s->out) return false;
+    if(!s->stamp || !s->cluster || !s->order) return false;
+    memset(s->local, 0xff, vertex_count * sizeof(int32_t));
+    return true;
+}
+
+// Misses of triangle t in a FIFO cache of OVERDRAW_CACHE span vertices.
+// A vertex is in the cache if it went in less than OVERDRAW_CACHE misses
+// ago, moving time past that empties it.
+static uint32_t fifo_misses(Scratch *s, const Triangle *t, uint32_t *time) {
+    uint32_t misses = 0;
+    for(int k = 0; k < 3; ++k) {
+        uint32_t v = s->local[t->i[k]];
+        if(*time - s->stamp[v] > OVERDRAW_CACHE) {
+            s->stamp[v] = (*time)++;
+            ++misses;
+        }
+    }
+    return misses;
+}
+
+// Cuts the cache ordered span in s->out into clusters. Every triangle that
+// misses on all three vertices starts one, and those are cut again once
+// the misses so far are within OVERDRAW_THRESHOLD of their whole ratio,
+// what is left at the end goes to the cluster before.
+static size_t span_clusters(Scratch *s, size_t n, uint32_t vc) {
+    uint32_t time = OVERDRAW_CACHE + 1;
+    for(uint32_t v = 0; v < vc; ++v) s->stamp[v] = 0;
+    size_t hard = 0;
+    for(size_t i = 0; i < n; ++i) {
+        uint32_t misses = fifo_misses(s, &s->out[i], &time);
+        if(misses == 3 || !i) s->order[hard++].cluster = i;
+    }
+    size_t count = 0;
+    for(size_t h = 0; h < hard; ++h) {
+        size_t start = s->order[h].cluster;
+        size_t end = h + 1 < hard ? s->order[h + 1].cluster : n;
+        time += OVERDRAW_CACHE + 1;
+        uint32_t misses = 0;
+        for(size_t i = start; i < end; ++i) misses += fifo_misses(s, &s->out[i], &time);
+        float threshold = OVERDRAW_THRESHOLD * misses / (end - start);
+        s->cluster[count++] = start;
+        time += OVERDRAW_CACHE + 1;
+        uint32_t run_misses = 0, run_tris = 0;
+        for(size_t i = start; i < end; ++i) {
+            run_misses += fifo_misses(s, &s->out[i], &time);
+            ++run_tris;
+            if((float)run_misses / run_tris > threshold) continue;
+            if(i + 1 < end) s->cluster[count++] = i + 1;
+            time += OVERDRAW_CACHE + 1;
+            run_misses = run_tris = 0;
+        }
+        if(run_tris && s->cluster[count - 1] != start) --count;
+    }
+    return count;
+}
+
+static int cluster_key_cmp(const void *a, const void *b) {
+    const struct cluster_key *x = a, *y = b;
+    if(x->key != y->key) return x->key < y->key ? 1 : -1;
+    return x->cluster < y->cluster ? -1 : x->cluster > y->cluster;
+}
+
+// Sorts the clusters of s->out by how far their area weighted center lies
+// out from the span center along their average normal, biggest first, and
+// writes them to t.
+static void sort_clusters(Scratch *s, const float (*pos)[3], size_t n, uint32_t vc, size_t count, Triangle *t) {
+    float center[3] = {0};
+    for(uint32_t v = 0; v < vc; ++v) {
+        for(int c = 0; c < 3; ++c) center[c] += pos[s->vertex[v]][c] / vc;
+    }
+    for(size_t k = 0; k < count; ++k) {
+        size_t end = k + 1 < count ? s->cluster[k + 1] : n;
+        float mid[3] = {0}, normal[3] = {0}, area = 0;
+        for(size_t i = s->cluster[k]; i < end; ++i) {
+            const float *p0 = pos[s->out[i].i[0]], *p1 = pos[s->out[i].i[1]], *p2 = pos[s->out[i].i[2]];
+            float e1[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+            float e2[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+            float nrm[3] = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]};
+            float a = sqrtf(nrm[0] * nrm[0] + nrm[1] * nrm[1] + nrm[2] * nrm[2]);
+            for(int c = 0; c < 3; ++c) {
+                mid[c] += (p0[c] + p1[c] + p2[c]) / 3 * a;
+                normal[c] += nrm[c];
+            }
+            area += a;
+        }
+        float len = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        float key = 0;
+        for(int c = 0; c < 3; ++c) {
+            float d = area > 0 ? mid[c] / area - center[c] : 0;
+            key += d * (len > 0 ? normal[c] / len : 0);
+        }
+        // NaN positions sort last
+        s->order[k] = (struct cluster_key){isnan(key) ? -INFINITY : key, k};
+    }
+    qsort(s->order, count, sizeof(struct cluster_key), cluster_key_cmp);
+    size_t out = 0;
+    for(size_t k = 0; k < count; ++k) {
+        uint32_t c = s->order[k].cluster;
+        size_t end = c + 1 < count ? s->cluster[c + 1] : n;
+        for(size_t i = s->cluster[c]; i < end; ++i) t[out++] = s->out[i];
+    }
+}
+
+static void optimize_span(void *ctx, size_t job, size_t worker) {
+    VCacheJobs *j = ctx;
+    Scratch *s = &j->scratch[worker];
+    const Span *span = &j->span[job];
+    Triangle *t = (Triangle*)((Mesh*)j->m->mesh.p)[span->mesh].tri.p + span->first;
+    size_t n = span->count;
+
+    // span vertices and the triangles using each of them
+    uint32_t vc = 0;
+    for(size_t i = 0; i < n; ++i) {
+        for(int k = 0; k < 3; ++k) {
+            size_t v = t[i].i[k];
+            if(s->local[v] < 0) {
+                s->local[v] = vc;
+                s->vertex[vc] = v;
+                s->remaining[vc++] = 0;
+            }
+            s->tri[i][k] = s->local[v];
+            ++s->remaining[s->local[v]];
+        }
+    }
+    s->adj_first[0] = 0;
+    for(uint32_t v = 0; v < vc; ++v) {
+        s->adj_first[v + 1] = s->adj_first[v] + s->remaining[v];
+        s->remaining[v] = 0;
+        s->cache_pos[v] = -1;
+    }
+    for(size_t i = 0; i < n; ++i) {
+        for(int k = 0; k < 3; ++k) {
+            uint32_t v = s->tri[i][k];
+            s->adj[s->adj_first[v] + s->remaining[v]++] = i;
+        }
+    }
+    for(uint32_t v = 0; v < vc; ++v) s->score[v] = vertex_score(-1, s->remaining[v]);
+    for(size_t i = 0; i < n; ++i) {
+        s->tri_score[i] = s->score[s->tri[i][0]] + s->score[s->tri[i][1]] + s->score[s->tri[i][2]];
+        s->emitted[i] = false;
+    }
+
+    uint32_t cache[CACHE_SIZE + 3], next_cache[CACHE_SIZE + 3];
+    size_t cache_len = 0, cursor = 0;
+    int64_t best = -1;
+    for(size_t out = 0; out < n; ++out) {
+        // nothing around the cache, start over from the first triangle left
+        if(best < 0) {
+            while(s->emitted[cursor]) ++cursor;
+            best = cursor;
+        }
+        uint32_t *tri = s->tri[best];
+        s->out[out] = t[best];
+        s->emitted[best] = true;
+        for(int k = 0; k < 3; ++k) {
+            // move it past the remaining triangles of the vertex
+            uint32_t v = tri[k], *a = s->adj + s->adj_first[v];
+            for(uint32_t i = 0; i < s->remaining[v]; ++i) {
+                if(a[i] != best) continue;
+                a[i] = a[--s->remaining[v]];
+                a[s->remaining[v]] = best;
+                break;
+            }
+        }
+        // the triangle's vertices go to the front of the cache
+        size_t next_len = 0;
+        for(int k = 0; k < 3; ++k) {
+            bool dup = false;
+            for(size_t i = 0; i < next_len; ++i) dup |= next_cache[i] == tri[k];
+            if(!dup) next_cache[next_len++] = tri[k];
+        }
+        for(size_t i = 0; i < cache_len; ++i) {
+            uint32_t v = cache[i];
+            if(v != tri[0] && v != tri[1] && v != tri[2]) next_cache[next_len++] = v;
+        }
+        // the vertices that fall out of the cache are scored too
+        for(size_t i = 0; i < next_len; ++i) {
+            uint32_t v = next_cache[i];
+            s->cache_pos[v] = i < CACHE_SIZE ? (int32_t)i : -1;
+            float score = vertex_score(s->cache_pos[v], s->remaining[v]);
+            float d = score - s->score[v];
+            s->score[v] = score;
+            uint32_t *a = s->adj + s->adj_first[v];
+            for(uint32_t r = 0; r < s->remaining[v]; ++r) s->tri_score[a[r]] += d;
+        }
+        best = -1;
+        float best_score = -1;
+        for(size_t i = 0; i < MIN(next_len, CACHE_SIZE); ++i) {
+            uint32_t v = next_cache[i], *a = s->adj + s->adj_first[v];
+            for(uint32_t r = 0; r < s->remaining[v]; ++r) {
+                if(s->tri_score[a[r]] > best_score) {
+                    best = a[r];
+                    best_score = s->tri_score[a[r]];
+                }
+            }
+        }
+        cache_len = MIN(next_len, CACHE_SIZE);
+        memcpy(cache, next_cache, cache_len * sizeof(uint32_t));
+    }
+    size_t clusters = span_clusters(s, n, vc);
+    sort_clusters(s, j->m->attr[ATTR_POSITION].p, n, vc, clusters, t);
+    j->clusters[job] = clusters;
+    for(uint32_t v = 0; v < vc; ++v) s->local[s->vertex[v]] = -1;
+}
+
+// Average cache miss ratio, transformed vertices per triangle, for a FIFO
+// cache of cache_size vertices over the whole model.
+float vcache_acmr(const Model *m, uint32_t cache_size) {
+    uint32_t *stamp = calloc(m->vertex_count + 1, sizeof(uint32_t));
+    if(!stamp) return 0;
+    // a vertex is in the cache if it went in less than cache_size misses ago
+    uint32_t misses = 0;
+    size_t tris = 0;
+    for(size_t i = 0; i < m->mesh.length; ++i) {
+        const Mesh *mesh = &((Mesh*)m->mesh.p)[i];
+        const Triangle *t = mesh->tri.p;
+        for(size_t j = 0; j < mesh->tri.length; ++j) {
+            for(int k = 0; k < 3; ++k) {
+                size_t v = t[j].i[k];
+                if(stamp[v] && misses - stamp[v] < cache_size) continue;
+                stamp[v] = ++misses;
+            }
+        }
+        tris += mesh->tri.length;
+    }
+    free(stamp);
+    return tris ? (float)misses / tris : 0;
+}
+
+// Renumbers the vertices in the order the triangles first use them, unused
+// ones go last. Vertices pushed after this won't weld with the old ones.
+static bool reorder_vertices(Model *m) {
+    size_t *remap = malloc(m->vertex_count * sizeof(size_t) + 1);
+    if(!remap) return false;
+    memset(remap, 0xff, m->vertex_count * sizeof(size_t));
+    size_t next = 0;
+    for(size_t i = 0; i < m->mesh.length; ++i) {
+        Mesh *mesh = &((Mesh*)m->mesh.p)[i];
+        Triangle *t = mesh->tri.p;
+        for(size_t j = 0; j < mesh->tri.length; ++j) {
+            for(int k = 0; k < 3; ++k) {
+                if(remap[t[j].i[k]] == SIZE_MAX) remap[t[j].i[k]] = next++;
+                t[j].i[k] = remap[t[j].i[k]];
+            }
+        }
+    }
+    for(size_t v = 0; v < m->vertex_count; ++v) {
+        if(remap[v] == SIZE_MAX) remap[v] = next++;
+    }
+    bool ok = true;
+    for(int a = 0; a < ATTR_COUNT && ok; ++a) {
+        if(!model_has(m, a)) continue;
+        size_t size = m->attr[a].size;
+        uint8_t *src = m->attr[a].p, *dst = malloc(m->vertex_count * size + 1);
+        if(!dst) {
+            ok = false;
+            break;
+        }
+        for(size_t v = 0; v < m->vertex_count; ++v) memcpy(dst + remap[v] * size, src + v * size, size);
+        memcpy(src, dst, m->vertex_count * size);
+        free(dst);
+    }
+    free(remap);
+    return ok;
+}
+
+// Optimizes the triangle order of every material span for the vertex
+// cache and overdraw, then the vertex order for fetching. Prints the FIFO cache miss
+// ratio before and after.
+bool vcache_optimize(Model *m) {
+    vcache_init();
+    float before = vcache_acmr(m, 16);
+    vector spans = vector_init(sizeof(Span));
+    size_t largest = 0;
+    for(size_t i = 0; i < m->mesh.length; ++i) {
+        Mesh *mesh = &((Mesh*)m->mesh.p)[i];
+        Triangle *t = mesh->tri.p;
+        for(size_t j = 0; j < mesh->tri.length;) {
+            Span span = {i, j, 0};
+            while(j < mesh->tri.length && t[j].mat == t[span.first].mat) ++j;
+            span.count = j - span.first;
+            largest = MAX(largest, span.count);
+            if(!vector_push(&spans, &span)) {
+                vector_cleanup(&spans);
+                return false;
+            }
+        }
+    }
+    size_t threads = MIN(options.threads, spans.length);
+    Scratch *scratch = calloc(MAX(threads, 1), sizeof(Scratch));
+    size_t *clusters = calloc(spans.length + 1, sizeof(size_t));
+    bool ok = scratch && clusters;
+    for(size_t w = 0; w < threads && ok; ++w) ok = scratch_init(&scratch[w], m->vertex_count, largest);
+    if(ok) {
+        VCacheJobs j = {m, spans.p, scratch, clusters};
+        pool_run(spans.length, threads, optimize_span, &j);
+        ok = reorder_vertices(m);
+    }
+    for(size_t w = 0; w < threads && scratch; ++w) scratch_free(&scratch[w]);
+    free(scratch);
+    size_t span_count = spans.length, cluster_count = 0;
+    for(size_t i = 0; i < span_count && clusters; ++i) cluster_count += clusters[i];
+    free(clusters);
+    vector_cleanup(&spans);
+    if(!ok) {
+        printf("Error: out of memory\n");
+        return false;
+    }
+    printf("Vertex cache: ACMR %.3f -> %.3f (FIFO 16), %llu spans, %llu overdraw clusters\n", before, vcache_acmr(m, 16), span_count, cluster_count);
+    return true;
+}
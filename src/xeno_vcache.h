@@ -0,0 +1,12 @@
+#ifndef XENO_VCACHE_H
+#define XENO_VCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "xenotool.h"
+
+float vcache_acmr(const Model *m, uint32_t cache_size);
+bool vcache_optimize(Model *m);
+
+#endif
@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "xeno_vif.h"
+#include "macro.h"
+
+// Packed element size in bytes, indexed by unpack_type (vn << 2 | vl).
+// S-5, V2-5 and V3-5 don't exist.
+static const uint8_t vif_elem_size[16] = {
+    4, 2, 1, 0, // S-32  S-16  S-8
+    8, 4, 2, 0, // V2-32 V2-16 V2-8
+    12, 6, 3, 0, // V3-32 V3-16 V3-8
+    16, 8, 4, 2 // V4-32 V4-16 V4-8 V4-5
+};
+
+// number of elements read from the packet, CL < WL only reads CL of every WL writes
+static size_t vif_elem_count(const VIFState *s, size_t num) {
+    if(!s->wl || s->cl >= s->wl) return num;
+    return (num / s->wl) * s->cl + MIN(num % s->wl, s->cl);
+}
+
+size_t vif_unpack_size(uint8_t unpack_type, size_t num) {
+    return ((size_t)vif_elem_size[unpack_type & 0xf] * num + 3) & ~(size_t)3;
+}
+
+// bytes an UNPACK of num qwords reads from the packet, fill cycles read nothing
+size_t vif_packet_size(const VIFState *s, uint8_t unpack_type, size_t num) {
+    return vif_unpack_size(unpack_type, vif_elem_count(s, num));
+}
+
+// number of qwords from the start address up to and including the last one written
+size_t vif_unpack_span(const VIFState *s, size_t num) {
+    if(!num) return 0;
+    if(!s->wl || s->cl <= s->wl) return num;
+    return ((num - 1) / s->wl) * s->cl + (num - 1) % s->wl + 1;
+}
+
+static inline uint32_t vif_ext(uint32_t v, unsigned bits, bool usn) {
+    if(usn) return v;
+    uint32_t sign = 1u << (bits - 1);
+    return (v ^ sign) - sign;
+}
+
+static void expand_v4_8(const uint8_t *src, size_t n, bool usn, uint32_t *dst) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for(; i + 4 <= n; i += 4) {
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        // duplicate each byte into the high half, then shift it back down
+        __m128i w0 = _mm_unpacklo_epi8(b, b);
+        __m128i w1 = _mm_unpackhi_epi8(b, b);
+        w0 = usn ? _mm_srli_epi16(w0, 8) : _mm_srai_epi16(w0, 8);
+        w1 = usn ? _mm_srli_epi16(w1, 8) : _mm_srai_epi16(w1, 8);
+        __m128i d[4] = {
+            _mm_unpacklo_epi16(w0, w0), _mm_unpackhi_epi16(w0, w0),
+            _mm_unpacklo_epi16(w1, w1), _mm_unpackhi_epi16(w1, w1)
+        };
+        for(int k = 0; k < 4; ++k) {
+            d[k] = usn ? _mm_srli_epi32(d[k], 16) : _mm_srai_epi32(d[k], 16);
+            _mm_storeu_si128((__m128i*)(dst + i * 4 + k * 4), d[k]);
+        }
+    }
+#endif
+    for(i *= 4; i < n * 4; ++i) dst[i] = vif_ext(src[i], 8, usn);
+}
+
+static void expand_v4_16(const uint8_t *src, size_t n, bool usn, uint32_t *dst) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for(; i + 2 <= n; i += 2) {
+        __m128i h = _mm_loadu_si128((const __m128i*)(src + i * 8));
+        __m128i d0 = _mm_unpacklo_epi16(h, h);
+        __m128i d1 = _mm_unpackhi_epi16(h, h);
+        d0 = usn ? _mm_srli_epi32(d0, 16) : _mm_srai_epi32(d0, 16);
+        d1 = usn ? _mm_srli_epi32(d1, 16) : _mm_srai_epi32(d1, 16);
+        _mm_storeu_si128((__m128i*)(dst + i * 4), d0);
+        _mm_storeu_si128((__m128i*)(dst + i * 4 + 4), d1);
+    }
+#endif
+    for(i *= 4; i < n * 4; ++i) {
+        uint16_t v;
+        memcpy(&v, src + i * 2, 2);
+        dst[i] = vif_ext(v, 16, usn);
+    }
+}
+
+static void expand_v4_5(const uint8_t *src, size_t n, uint32_t *dst) {
+    for(size_t i = 0; i < n; ++i) {
+        uint16_t v;
+        memcpy(&v, src + i * 2, 2);
+        dst[i * 4 + 0] = (v & 0x1f) << 3;
+        dst[i * 4 + 1] = ((v >> 5) & 0x1f) << 3;
+        dst[i * 4 + 2] = ((v >> 10) & 0x1f) << 3;
+        dst[i * 4 + 3] = (v >> 15) << 7;
+    }
+}
+
+// S, V2 and V3 formats. S is broadcast to all fields, fields past the
+// packed components are undefined on hardware and set to 0 here.
+static void expand_generic(const uint8_t *src, size_t n, uint8_t vn, uint8_t vl, bool usn, uint32_t *dst) {
+    size_t comps = vn + 1;
+    for(size_t i = 0; i < n; ++i) {
+        uint32_t c[4] = {0};
+        for(size_t k = 0; k < comps; ++k) {
+            switch(vl) {
+                case 0: memcpy(&c[k], src, 4); break;
+                case 1: {
+                    uint16_t v;
+                    memcpy(&v, src, 2);
+                    c[k] = vif_ext(v, 16, usn);
+                    break;
+                }
+                case 2: c[k] = vif_ext(*src, 8, usn); break;
+            }
+            src += 4 >> vl;
+        }
+        if(!vn) c[1] = c[2] = c[3] = c[0];
+        memcpy(dst + i * 4, c, sizeof(c));
+    }
+}
+
+// expands n packed elements into consecutive qwords
+static void vif_expand(const uint8_t *src, size_t n, uint8_t unpack_type, bool usn, uint32_t *dst) {
+    uint8_t vn = unpack_type >> 2;
+    uint8_t vl = unpack_type & 0x3;
+    switch(unpack_type) {
+        case 0xc: memcpy(dst, src, n * 16); break;
+        case 0xd: expand_v4_16(src, n, usn, dst); break;
+        case 0xe: expand_v4_8(src, n, usn, dst); break;
+        case 0xf: expand_v4_5(src, n, dst); break;
+        default: expand_generic(src, n, vn, vl, usn, dst); break;
+    }
+}
+
+// Unpacks num qword writes from src to dst, honouring CL/WL cycling, the
+// write mask, ROW/COL registers and the addition mode. dst must hold
+// vif_unpack_span qwords. Returns the number of packet bytes consumed,
+// or 0 for an invalid unpack type.
+size_t vif_unpack(VIFState *s, VIFCommand vif, size_t num, const void *src, uint32_t *dst) {
+    uint8_t type = vif.unpack_type;
+    if(!vif_elem_size[type]) return 0;
+    size_t elems = vif_elem_count(s, num);
+    size_t size = vif_unpack_size(type, elems);
+    bool usn = vif.zero_ext;
+    bool contiguous = !s->wl || s->cl == s->wl;
+    if(contiguous && !vif.write_masking && !s->mode) {
+        vif_expand(src, elems, type, usn, dst);
+        return size;
+    }
+    uint32_t tmp[256 * 4];
+    uint8_t cl = s->wl ? s->cl : 1;
+    uint8_t wl = s->wl ? s->wl : 1;
+    const uint8_t *p = src;
+    size_t read = 0, e = 0, e_len = 0;
+    for(size_t n = 0; n < num; ++n) {
+        size_t blk = n / wl;
+        size_t pos = n % wl;
+        size_t addr = (cl >= wl) ? blk * cl + pos : n;
+        bool fill = pos >= cl;
+        if(!fill && e == e_len) {
+            e_len = MIN(elems - read, 256);
+            vif_expand(p, e_len, type, usn, tmp);
+            p += e_len * vif_elem_size[type];
+            read += e_len;
+            e = 0;
+        }
+        const uint32_t *data = fill ? NULL : &tmp[e++ * 4];
+        size_t cycle = MIN(pos, 3);
+        for(int f = 0; f < 4; ++f) {
+            uint8_t m = vif.write_masking ? (s->mask >> (cycle * 8 + f * 2)) & 0x3 : 0;
+            // cycles without data take the ROW register unless masked otherwise
+            if(fill && !m) m = 1;
+            uint32_t v;
+            switch(m) {
+                case 0: {
+                    v = data[f];
+                    if(s->mode == 1) v += s->row[f];
+                    if(s->mode == 2) v = s->row[f] += v;
+                    break;
+                }
+                case 1: v = s->row[f]; break;
+                case 2: v = s->col[cycle]; break;
+                default: continue;
+            }
+            dst[addr * 4 + f] = v;
+        }
+    }
+    return size;
+}
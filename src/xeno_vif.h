@@ -0,0 +1,26 @@
+#ifndef XENO_VIF_H
+#define XENO_VIF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lex_file.h"
+
+#define VU_MEM_SIZE 0x4000
+#define VU_MEM_QWORDS (VU_MEM_SIZE / 16)
+
+// VIF registers that affect UNPACK, set by STCYCL, STMASK, STROW, STCOL and STMOD.
+typedef struct {
+    uint32_t mask;
+    uint32_t row[4];
+    uint32_t col[4];
+    uint8_t mode;
+    uint8_t cl;
+    uint8_t wl;
+} VIFState;
+
+size_t vif_unpack_size(uint8_t unpack_type, size_t num);
+size_t vif_packet_size(const VIFState *s, uint8_t unpack_type, size_t num);
+size_t vif_unpack_span(const VIFState *s, size_t num);
+size_t vif_unpack(VIFState *s, VIFCommand vif, size_t num, const void *src, uint32_t *dst);
+
+#endif
@@ -2,99 +2,372 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CLUT8_AVX2
+#endif
 
 #include "xtx_file.h"
+#include "mfile.h"
+#include "arena.h"
+#include "pool.h"
+#include "xeno_gs.h"
 #include "xenotool.h"
 #include "xenodebug.h"
 #include "macro.h"
 
-void get_palette(uint8_t *img_rgb, uint16_t x0, uint16_t y0, uint16_t w, RGBA *pal) {
-    RGBA *rgba = (RGBA*) img_rgb;
-    int i = 0;
-    for(uint16_t y = 0; y < 16; ++y) {
-        for(uint16_t x = 0; x < 16; ++x) {
-            pal[i++] = rgba[((y0 + y) * w) + x0 + x];
+// Index texture of the whole atlas, it lives at the same place in local
+// memory as the PSMCT32 buffer the sub-images were uploaded to.
+static GSBuffer index_buffer(const Texture *tex) {
+    return (GSBuffer){.bp = 0, .bw = tex->width / 64, .psm = GS_PSMT8};
+}
+
+static GSBuffer upload_buffer(const Texture *tex) {
+    return (GSBuffer){.bp = 0, .bw = tex->width / 128, .psm = GS_PSMCT32};
+}
+
+static void clut8_expand_scalar(const uint8_t *idx, size_t n, const RGBA *pal, RGBA *dst) {
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+        dst[i] = pal[idx[i]];
+        dst[i + 1] = pal[idx[i + 1]];
+        dst[i + 2] = pal[idx[i + 2]];
+        dst[i + 3] = pal[idx[i + 3]];
+    }
+    for(; i < n; ++i) dst[i] = pal[idx[i]];
+}
+
+#ifdef CLUT8_AVX2
+__attribute__((target("avx2")))
+static void clut8_expand_avx2(const uint8_t *idx, size_t n, const RGBA *pal, RGBA *dst) {
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8) {
+        __m256i k = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(idx + i)));
+        __m256i c = _mm256_i32gather_epi32((const int*)pal, k, 4);
+        _mm256_storeu_si256((__m256i*)(dst + i), c);
+    }
+    clut8_expand_scalar(idx + i, n - i, pal, dst + i);
+}
+#endif
+
+// dst[i] = pal[idx[i]], with AVX2 gathers when the CPU has them
+void clut8_expand(const uint8_t *idx, size_t n, const RGBA *pal, RGBA *dst) {
+#ifdef CLUT8_AVX2
+    if(__builtin_cpu_supports("avx2")) {
+        clut8_expand_avx2(idx, n, pal, dst);
+        return;
+    }
+#endif
+    clut8_expand_scalar(idx, n, pal, dst);
+}
+
+#define PALETTE_SLICE_ROWS 64
+
+// A unique (rectangle, palette) pair from the material list, clipped to the image.
+// Jobs in the same wave don't overlap and can run at the same time.
+typedef struct {
+    uint32_t u0, u1, v0, v1;
+    uint32_t palx, paly;
+    size_t palette;
+    size_t wave;
+} PaletteJob;
+
+typedef struct {
+    size_t job;
+    uint32_t v0, v1;
+} PaletteSlice;
+
+typedef struct {
+    const uint8_t *img;
+    RGBA *dst;
+    uint16_t w;
+    const PaletteJob *job;
+    RGBA (*pal)[256];
+    const PaletteSlice *slice;
+} PaletteJobs;
+
+static bool rect_empty(const PaletteJob *r) {
+    return r->u0 >= r->u1 || r->v0 >= r->v1;
+}
+
+static bool rect_overlap(const PaletteJob *a, const PaletteJob *b) {
+    if(rect_empty(a) || rect_empty(b)) return false;
+    return a->u0 < b->u1 && b->u0 < a->u1 && a->v0 < b->v1 && b->v0 < a->v1;
+}
+
+static void apply_palette_job(void *ctx, size_t job, size_t worker) {
+    (void)worker;
+    const PaletteJobs *j = ctx;
+    const PaletteSlice *s = &j->slice[job];
+    const PaletteJob *pj = &j->job[s->job];
+    const RGBA *pal = j->pal[pj->palette];
+    for(uint32_t v = s->v0; v < s->v1; ++v) {
+        size_t offset = (size_t)v * j->w + pj->u0;
+        clut8_expand(j->img + offset, pj->u1 - pj->u0, pal, j->dst + offset);
+    }
+}
+
+// With the '!' debug flag, reports the first texel of material i that an
+// earlier material already covers, like a texel by texel scan would.
+static bool palette_overlap(const Material *t, const PaletteJob *rect, size_t i) {
+    int64_t old = -1;
+    uint32_t u = 0, v = 0;
+    for(size_t j = 0; j < i; ++j) {
+        if(t[j].pal == 0xff || !rect_overlap(&rect[i], &rect[j])) continue;
+        uint32_t ju = MAX(rect[i].u0, rect[j].u0);
+        uint32_t jv = MAX(rect[i].v0, rect[j].v0);
+        if(old < 0 || jv < v || (jv == v && ju < u)) {
+            u = ju;
+            v = jv;
         }
+        old = j;
     }
-    for(int i = 0; i < 8; ++i) {
-        for(int j = 0; j < 8; ++j) {
-            int k = (i*32) + 8 + j;
-            int l = (i*32) + 16 + j;
-            RGBA c = pal[k];
-            pal[k] = pal[l];
-            pal[l] = c;
+    if(old < 0) return false;
+    // the texel holds whichever material wrote it last
+    for(size_t j = i; j-- > 0;) {
+        if(t[j].pal != 0xff && u >= rect[j].u0 && u < rect[j].u1 && v >= rect[j].v0 && v < rect[j].v1) {
+            old = j;
+            break;
         }
     }
+    printf("idx overlap at %d %d idx: new %lld old %lld pal: new %x old %x\n", u, v, i, old, t[i].pal, t[old].pal);
+    return true;
 }
 
-RGBA* apply_palettes(uint8_t *img_rgb, uint8_t *img, uint16_t w, uint16_t h, vector *mat) {
+// Output covers the cropped area, the same as tex->unswizzled.
+RGBA* apply_palettes(const Texture *tex, vector *mat) {
+    uint16_t w = tex->crop_width, h = tex->crop_height;
     RGBA *ret = malloc(w * h * sizeof(RGBA));
     memset(ret, 0, w * h * sizeof(RGBA));
-    int *mat_pal = malloc(w * h * sizeof(int));
-    for(int i = 0; i < w * h ; ++i) mat_pal[i] = -1;
-    int64_t *mat_idx = malloc(w * h * sizeof(int64_t));
-    for(int i = 0; i < w * h ; ++i) mat_idx[i] = -1;
-    RGBA pal[256];
     Material *t = mat->p;
-    for(size_t i = 0; i < mat->length; ++i) {
+    size_t n = mat->length;
+    PaletteJob *rect = malloc(n * sizeof(PaletteJob));
+    PaletteJob *job = malloc(n * sizeof(PaletteJob));
+    RGBA (*pal)[256] = malloc(n * sizeof(RGBA[256]));
+    if(!rect || !job || !pal) {
+        printf("Error: out of memory\n");
+        goto END;
+    }
+    size_t end = n;
+    for(size_t i = 0; i < n; ++i) {
+        rect[i] = (PaletteJob){
+            .u0 = t[i].umin, .u1 = MIN(t[i].umax, w),
+            .v0 = t[i].vmin, .v1 = MIN(t[i].vmax, h),
+            .palx = t[i].palx, .paly = t[i].paly
+        };
         if(t[i].pal == 0xff) continue;
         if(dbg('m')) printf("Material %llu: \n", i);
         if(dbg('m')) print_material(t[i]);
-        get_palette(img_rgb, t[i].palx, t[i].paly, w/2, pal);
-        for(uint32_t v = t[i].vmin; v < t[i].vmax; ++v) {
-            for(uint32_t u = t[i].umin; u < t[i].umax; ++u) {
-                if(u >= (w) || v >= (h)) continue;
-                size_t offset = (v * w) + u;
-                if(dbg('!') && mat_idx[offset] >= 0 && mat_idx[offset] != (int64_t)i) {
-                    printf("idx overlap at %d %d idx: new %lld old %lld pal: new %x old %x\n", u, v, i, mat_idx[offset], t[i].pal, mat_pal[offset]);
-                    free(mat_idx);
-                    free(mat_pal);
-                    return ret;
-                }
-                if(dbg('!') && mat_pal[offset] >= 0 && mat_pal[offset] != t[i].pal) {
-                    printf("palette overlap at %d %d idx: new %lld old %lld pal: new %x old %x\n", u, v, i, mat_idx[offset], t[i].pal, mat_pal[offset]);
-                    free(mat_pal);
-                    free(mat_idx);
-                    return ret;
-                }
-                mat_pal[offset] = t[i].pal;
-                mat_idx[offset] = i;
-                ret[offset] = pal[img[offset]];
+        if(dbg('!') && palette_overlap(t, rect, i)) {
+            end = i;
+            break;
+        }
+    }
+    // Later materials win where they overlap, so keep the last of every
+    // duplicate and give each job a wave after everything it overlaps.
+    size_t njob = 0, npal = 0, nslice = 0, nwave = 0;
+    GSBuffer clut = upload_buffer(tex);
+    for(size_t i = end; i-- > 0;) {
+        PaletteJob *r = &rect[i];
+        if(t[i].pal == 0xff || rect_empty(r)) continue;
+        bool dup = false;
+        for(size_t k = 0; k < njob && !dup; ++k) {
+            dup = job[k].u0 == r->u0 && job[k].u1 == r->u1 && job[k].v0 == r->v0 && job[k].v1 == r->v1
+                  && job[k].palx == r->palx && job[k].paly == r->paly;
+        }
+        if(!dup) job[njob++] = *r;
+    }
+    for(size_t k = 0; k < njob / 2; ++k) {
+        PaletteJob tmp = job[k];
+        job[k] = job[njob - 1 - k];
+        job[njob - 1 - k] = tmp;
+    }
+    for(size_t k = 0; k < njob; ++k) {
+        size_t p = 0;
+        while(p < k && (job[p].palx != job[k].palx || job[p].paly != job[k].paly)) ++p;
+        if(p == k) {
+            gs_read_clut(tex->vram, &clut, job[k].palx, job[k].paly, 256, pal[npal]);
+            job[k].palette = npal++;
+        } else {
+            job[k].palette = job[p].palette;
+        }
+        job[k].wave = 0;
+        for(size_t j = 0; j < k; ++j) {
+            if(rect_overlap(&job[j], &job[k])) job[k].wave = MAX(job[k].wave, job[j].wave + 1);
+        }
+        nwave = MAX(nwave, job[k].wave + 1);
+        nslice += (job[k].v1 - job[k].v0 + PALETTE_SLICE_ROWS - 1) / PALETTE_SLICE_ROWS;
+    }
+    // big rectangles are split into slices of rows so the threads stay busy
+    PaletteSlice *slice = malloc(nslice * sizeof(PaletteSlice));
+    if(nslice && !slice) {
+        printf("Error: out of memory\n");
+        goto END;
+    }
+    PaletteJobs jobs = {.img = tex->unswizzled, .dst = ret, .w = w, .job = job, .pal = pal, .slice = slice};
+    for(size_t wave = 0; wave < nwave; ++wave) {
+        size_t count = 0;
+        for(size_t k = 0; k < njob; ++k) {
+            if(job[k].wave != wave) continue;
+            for(uint32_t v = job[k].v0; v < job[k].v1; v += PALETTE_SLICE_ROWS) {
+                slice[count++] = (PaletteSlice){.job = k, .v0 = v, .v1 = MIN(v + PALETTE_SLICE_ROWS, job[k].v1)};
             }
         }
+        pool_run(count, options.threads, apply_palette_job, &jobs);
     }
-    free(mat_idx);
-    free(mat_pal);
+    free(slice);
+END:
+    free(pal);
+    free(job);
+    free(rect);
     return ret;
 }
 
-// I think I found this somewhere on xentax. Whoever it was that wrote it, thank you.
-uint8_t* unswizzle8(uint8_t *b, uint16_t width, uint16_t height) {
-    uint8_t *ret = malloc(width * height);
-    memset(ret, 0, width * height);
-    for(int y = 0; y < height; ++y) {
-        for(int x = 0; x < width; ++x) {
-            int block_location = (y & (~0xf)) * width + (x & (~0xf)) * 2;
-            int swap_selector = (((y + 2) >> 2) & 0x1) * 4;
-            int posY = (((y & (~3)) >> 1) + (y & 1)) & 0x7;
-            int column_location = posY * width * 2 + ((x + swap_selector) & 0x7) * 4;
-            int byte_num = ((y >> 1) & 1) + ((x >> 2) & 2);
-            ret[(y * width) + x] = b[block_location + column_location + byte_num];
+// When every textured material uses the same CLUT, the apply_palettes
+// image is that CLUT applied to tex->unswizzled and can be kept as indices.
+// Texels no material covers get a transparent black entry, the way
+// apply_palettes leaves them. Fails if there is more than one CLUT, or
+// uncovered texels and no such entry.
+bool palette_indices(const Texture *tex, const vector *mat, uint8_t *idx, RGBA pal[256]) {
+    uint16_t w = tex->crop_width, h = tex->crop_height;
+    const Material *t = mat->p;
+    int64_t first = -1;
+    for(size_t i = 0; i < mat->length; ++i) {
+        if(t[i].pal == 0xff || t[i].umin >= MIN(t[i].umax, w) || t[i].vmin >= MIN(t[i].vmax, h)) continue;
+        if(first < 0) first = i;
+        if(t[i].palx != t[first].palx || t[i].paly != t[first].paly) return false;
+    }
+    if(first < 0) return false;
+    uint8_t *covered = calloc((size_t)w * h, 1);
+    if(!covered) return false;
+    for(size_t i = 0; i < mat->length; ++i) {
+        uint32_t u1 = MIN(t[i].umax, w);
+        if(t[i].pal == 0xff || t[i].umin >= u1) continue;
+        for(uint32_t v = t[i].vmin; v < MIN(t[i].vmax, h); ++v) {
+            memset(covered + (size_t)v * w + t[i].umin, 1, u1 - t[i].umin);
         }
     }
-    return ret;
+    GSBuffer clut = upload_buffer(tex);
+    gs_read_clut(tex->vram, &clut, t[first].palx, t[first].paly, 256, pal);
+    int clear = -1;
+    for(int c = 0; c < 256 && clear < 0; ++c) {
+        if(!pal[c].r && !pal[c].g && !pal[c].b && !pal[c].a) clear = c;
+    }
+    bool ok = true;
+    for(size_t k = 0; k < (size_t)w * h && ok; ++k) {
+        if(covered[k]) {
+            idx[k] = tex->unswizzled[k];
+        } else if(clear >= 0) {
+            idx[k] = clear;
+        } else {
+            ok = false;
+        }
+    }
+    free(covered);
+    return ok;
 }
 
-int parse_xtx(char *filename, Texture *tex) {
+typedef struct {
+    const Texture *tex;
+    uint8_t *dst;
+    uint32_t w, h;
+    const bool *block;
+} RegionJobs;
+
+// one job per row of 16x16 blocks, each run of marked blocks is one read
+static void region_job(void *ctx, size_t job, size_t worker) {
+    (void)worker;
+    const RegionJobs *j = ctx;
+    GSBuffer buf = index_buffer(j->tex);
+    uint32_t bx = (j->w + 15) / 16;
+    uint32_t y = job * 16, h = MIN(16, j->h - y);
+    const bool *block = j->block + job * bx;
+    for(uint32_t x0 = 0; x0 < bx;) {
+        if(!block[x0]) {
+            ++x0;
+            continue;
+        }
+        uint32_t x1 = x0;
+        while(x1 < bx && block[x1]) ++x1;
+        uint32_t w = MIN(x1 * 16, j->w) - x0 * 16;
+        gs_read(j->tex->vram, &buf, x0 * 16, y, w, h, j->dst + (size_t)y * j->w + x0 * 16, j->w);
+        x0 = x1;
+    }
+}
+
+// Texture area the materials use, in palette texels and rounded up to
+// whole 32 texel tiles, or all of it if no material has a texture.
+static void material_extent(const Texture *tex, const vector *mat, uint32_t *w, uint32_t *h) {
+    const Material *t = mat ? mat->p : NULL;
+    size_t n = mat ? mat->length : 0;
+    *w = *h = 0;
+    for(size_t i = 0; i < n; ++i) {
+        if(!t[i].has_texture) continue;
+        uint32_t mul = t[i].pal == 0xff ? 2 : 1; // RGB texels are twice the size
+        *w = MAX(*w, t[i].umax * mul);
+        *h = MAX(*h, t[i].vmax * mul);
+    }
+    if(!*w || !*h) {
+        *w = tex->width;
+        *h = tex->height;
+    }
+    *w = MIN((*w + 31) & ~31u, tex->width);
+    *h = MIN((*h + 31) & ~31u, tex->height);
+}
+
+// For -r, when the materials are known: crops the texture to their extent
+// and unswizzles only the blocks the paletted ones sample. tex->rgb stays
+// whole, the palettes can be anywhere in it.
+bool xtx_decode_regions(Texture *tex, const vector *mat) {
+    uint32_t cw, ch;
+    material_extent(tex, mat, &cw, &ch);
+    uint32_t bx = (cw + 15) / 16, by = (ch + 15) / 16;
+    bool *block = calloc(bx * by, sizeof(bool));
+    if(!block) return false;
+    const Material *t = mat ? mat->p : NULL;
+    size_t n = mat ? mat->length : 0;
+    for(size_t i = 0; i < n; ++i) {
+        if(!t[i].has_texture || t[i].pal == 0xff) continue;
+        uint32_t u1 = MIN(t[i].umax, cw), v1 = MIN(t[i].vmax, ch);
+        if(t[i].umin >= u1 || t[i].vmin >= v1) continue;
+        for(uint32_t y = t[i].vmin / 16; y <= (v1 - 1) / 16; ++y) {
+            for(uint32_t x = t[i].umin / 16; x <= (u1 - 1) / 16; ++x) block[y * bx + x] = true;
+        }
+    }
+    tex->unswizzled = calloc(cw, ch);
+    if(tex->unswizzled) {
+        RegionJobs jobs = {.tex = tex, .dst = tex->unswizzled, .w = cw, .h = ch, .block = block};
+        pool_run(by, options.threads, region_job, &jobs);
+    }
+    free(block);
+    if(!tex->unswizzled) return false;
+    tex->crop_width = cw;
+    tex->crop_height = ch;
+    if(dbg('x')) printf("cropped to %d x %d\n", cw, ch);
+    return true;
+}
+
+int parse_xtx(mfile *f, Texture *tex, arena *a) {
     XTXFile xtx;
-    FILE *fp = fopen(filename, "rb");
-    fread(&xtx.header, sizeof(XTXHeader), 1, fp);
+    if(!mfile_read(f, &xtx.header, sizeof(XTXHeader))) {
+        printf("Error: XTX header out of bounds\n");
+        return -1;
+    }
     if(dbg('x')) print_xtxheader(xtx.header);
-    xtx.img = malloc(xtx.header.count * sizeof(uint8_t*));
-    xtx.img_header = malloc(xtx.header.count * sizeof(XTXImgHeader));
-    xtx.img_header2 = malloc(xtx.header.count * sizeof(XTXImgHeader2));
-    fseek(fp, xtx.header.img_header_addr, SEEK_SET);
-    fread(xtx.img_header, sizeof(XTXImgHeader), xtx.header.count, fp);
+    if(!mfile_seek(f, xtx.header.img_header_addr) || mfile_remaining(f) / sizeof(XTXImgHeader) < xtx.header.count) {
+        printf("Error: XTX image headers out of bounds\n");
+        return -1;
+    }
+    xtx.img = arena_alloc(a, xtx.header.count * sizeof(uint8_t*));
+    xtx.img_header = arena_alloc(a, xtx.header.count * sizeof(XTXImgHeader));
+    xtx.img_header2 = arena_alloc(a, xtx.header.count * sizeof(XTXImgHeader2));
+    if(!xtx.img || !xtx.img_header || !xtx.img_header2) {
+        printf("Error: out of memory\n");
+        return -1;
+    }
+    mfile_read(f, xtx.img_header, sizeof(XTXImgHeader) * xtx.header.count);
     uint16_t buffer_width =  xtx.img_header[0].buffer_width;
     for(uint32_t i = 0; i < xtx.header.count; ++i) {
         XTXImgHeader h = xtx.img_header[i];
@@ -104,13 +377,13 @@ int parse_xtx(char *filename, Texture *tex) {
         }
         if(dbg('x')) print_xtximgheader(h);
         size_t size = h.width * h.height * 4;
-        xtx.img[i] = malloc(size);
-        fseek(fp, h.img_addr, SEEK_SET);
-        fread(&(xtx.img_header2[i]), sizeof(XTXImgHeader2), 1, fp);
+        if(!mfile_seek(f, h.img_addr) || !mfile_read(f, &(xtx.img_header2[i]), sizeof(XTXImgHeader2))
+           || !(xtx.img[i] = mfile_get_ptr(f, size))) {
+            printf("Error: XTX image %d out of bounds\n", i);
+            return -1;
+        }
         if(dbg('x')) print_bytes_dim(xtx.img_header2[i].unk0, 32, 16);
-        fread(xtx.img[i], size, 1, fp);
     }
-    fclose(fp);
     if(buffer_width == 0) buffer_width = 8;
     uint32_t len = 0;
     switch(buffer_width) {
@@ -131,9 +404,17 @@ int parse_xtx(char *filename, Texture *tex) {
             return -1;
         }
     }
+    tex->vram = calloc(GS_VRAM_SIZE, 1);
     tex->rgb = malloc(tex->width * tex->height);
+    if(!tex->vram || !tex->rgb) {
+        printf("Error: out of memory\n");
+        return -1;
+    }
+    GSBuffer upload = upload_buffer(tex);
     tex->max_x = 0;
     tex->max_y = 0;
+    // Sub-images are uploaded straight from the mapped file to a PSMCT32
+    // buffer len texels wide.
     for(uint32_t i = 0; i < xtx.header.count; ++i) {
         XTXImgHeader h = xtx.img_header[i];
         uint32_t o = h.offset;
@@ -144,22 +425,28 @@ int parse_xtx(char *filename, Texture *tex) {
         x0 *= 64;
         uint32_t y0 = block / (buffer_width / 2);
         y0 *= 32;
+        if(x0 + h.width > len || y0 + h.height > tex->height / 2) {
+            printf("Error: XTX image %d outside the buffer\n", i);
+            return -1;
+        }
         tex->max_x = MAX(tex->max_x, (x0 + h.width) * 2);
         tex->max_y = MAX(tex->max_y, (y0 + h.height) * 2);
         if(dbg('x')) printf("x: %d, y: %d\n", x0, y0);
-        for(uint32_t y = 0; y < h.height; ++y) {
-            for(uint32_t x = 0; x < h.width; ++x) {
-                size_t offset_src = (y * h.width) + x;
-                size_t offset_dst = ((y0 + y) * len) + x0 + x;
-                ((RGBA*)tex->rgb)[offset_dst] = ((RGBA*)xtx.img[i])[offset_src];
-            }
-        }
+        gs_write(tex->vram, &upload, x0, y0, h.width, h.height, xtx.img[i], h.width);
     }
     if(dbg('x')) printf("max x: %d, max y: %d\n", tex->max_x, tex->max_y);
-    tex->unswizzled = unswizzle8(tex->rgb, tex->width, tex->height);
-    for(uint32_t i = 0; i < xtx.header.count; ++i) free(xtx.img[i]);
-    free(xtx.img);
-    free(xtx.img_header);
-    free(xtx.img_header2);
+    tex->crop_width = tex->width;
+    tex->crop_height = tex->height;
+    gs_read(tex->vram, &upload, 0, 0, len, tex->height / 2, tex->rgb, len);
+    // The same memory read back as PSMT8 is the index texture. With -r only
+    // the blocks the materials use are read, once they're parsed.
+    if(options.tex_crop) return 0;
+    tex->unswizzled = malloc(tex->width * tex->height);
+    if(!tex->unswizzled) {
+        printf("Error: out of memory\n");
+        return -1;
+    }
+    GSBuffer index = index_buffer(tex);
+    gs_read(tex->vram, &index, 0, 0, tex->width, tex->height, tex->unswizzled, tex->width);
     return 0;
 }
\ No newline at end of file
@@ -1,7 +1,13 @@
 #ifndef XENO_XTX_H
 #define XENO_XTX_H
 
-int parse_xtx(char *filename, Texture *tex);
-RGBA* apply_palettes(uint8_t *img_rgb, uint8_t *img, uint16_t w, uint16_t h, vector *mat);
+#include "mfile.h"
+#include "arena.h"
+
+int parse_xtx(mfile *f, Texture *tex, arena *a);
+void clut8_expand(const uint8_t *idx, size_t n, const RGBA *pal, RGBA *dst);
+bool xtx_decode_regions(Texture *tex, const vector *mat);
+RGBA* apply_palettes(const Texture *tex, vector *mat);
+bool palette_indices(const Texture *tex, const vector *mat, uint8_t *idx, RGBA pal[256]);
 
 #endif
\ No newline at end of file
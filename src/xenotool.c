@@ -1,4 +1,4 @@
-// gcc -std=c2x -fno-omit-frame-pointer -fcf-protection -fno-math-errno -Wall -Wextra -Wpedantic -g -fsanitize=undefined -fsanitize-trap=all -o ../bin/xenotool.exe xenotool.c xeno_lex.c xeno_xtx.c xeno_arx.c xeno_jnt.c xenodebug.c && xenotool
+// gcc -std=c2x -fno-omit-frame-pointer -fcf-protection -fno-math-errno -Wall -Wextra -Wpedantic -g -fsanitize=undefined -fsanitize-trap=all -o ../bin/xenotool.exe xenotool.c xeno_lex.c xeno_xtx.c xeno_arx.c xeno_jnt.c xeno_vif.c xeno_model.c xeno_obj.c xeno_png.c xeno_ktx.c xeno_bc.c xeno_mip.c xeno_gs.c xeno_meshopt.c xeno_vcache.c xenodebug.c && xenotool
 
 #include <stdio.h>
 #include <stdint.h>
@@ -11,6 +11,14 @@
 #include "vector.h"
 #define STR_IMPLEMENTATION
 #include "str.h"
+#define MFILE_IMPLEMENTATION
+#include "mfile.h"
+#define HASHIDX_IMPLEMENTATION
+#include "hashidx.h"
+#define POOL_IMPLEMENTATION
+#include "pool.h"
+#define ARENA_IMPLEMENTATION
+#include "arena.h"
 #include "jnt_file.h"
 #include "lex_file.h"
 #include "xtx_file.h"
@@ -19,28 +27,49 @@
 #include "xeno_arx.h"
 #include "xeno_jnt.h"
 #include "xeno_lex.h"
+#include "xeno_model.h"
+#include "xeno_obj.h"
+#include "xeno_png.h"
+#include "xeno_ktx.h"
+#include "xeno_bc.h"
+#include "xeno_mip.h"
 #include "xeno_xtx.h"
+#include "xeno_meshopt.h"
+#include "xeno_vcache.h"
 #include "glb.h"
 #include "macro.h"
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
 
 extern bool dbgflags[256];
 
+Options options = {.threads = 0, .obj_precision = -1, .png_fast = false, .tex_container = TEX_PNG, .tex_format = TEX_FORMAT_RGBA8, .bc_quality = BC_NORMAL, .mip_filter = MIP_NONE, .tex_crop = false, .glb_compact = false, .glb_meshopt = false, .vcache = false, .glb_strips = false};
+
 void usage() {
     puts("Usage: xenotool [options] file...");
     puts("Options:");
     puts("  -s            Simulate without writing to file(s)");
+    puts("  -b            Benchmark ARX decompression");
+    puts("  -jN           Use N worker threads (default: one per CPU)");
+    puts("  -pN           Write OBJ/MTL numbers with N decimals (default: shortest exact)");
+    puts("  -f            Fast PNG encoding, larger files");
+    puts("  -tF           Write textures as F: png (default), ktx2 or dds");
+    puts("  -cF           Block compress color textures as F: bc1, bc3 or bc7 (KTX2/DDS, default dds)");
+    puts("  -qN           Block compression quality 0 (fast) to 2 (best), default 1");
+    puts("  -m[F]         Mip chain for color textures, F: box (default) or kaiser (KTX2/DDS, default dds)");
+    puts("  -r            Decode and write only the texture area the models use");
+    puts("  -z            Compact GLB: quantized vertex attributes, small joints and indices");
+    puts("  -e            Meshopt compressed GLB buffers (EXT_meshopt_compression), best with -z");
+    puts("  -o            Reorder triangles and vertices for the vertex cache and overdraw, reports ACMR");
+    puts("  -k            Keep triangle strips, GLB primitives in TRIANGLE_STRIP mode");
     return;
 }
 
-XenoFileEnum get_filetype(char *filename) {
-    FILE *fp = fopen(filename, "rb");
-    if(!fp) return FILE_ERROR;
+XenoFileEnum get_filetype(mfile *f) {
     XenoFileEnum type;
     
     uint32_t val = 0;
-    fread(&val, sizeof(uint32_t), 1, fp);
+    mfile_seek(f, 0);
+    mfile_read(f, &val, sizeof(uint32_t));
+    mfile_seek(f, 0);
     switch(val) {
         case FILE_LEX: {
             type = FILE_LEX;
@@ -63,97 +92,434 @@ XenoFileEnum get_filetype(char *filename) {
         }
     }
     
-    fclose(fp);
     return type;
 }
 
-void save_image(char *filename, uint16_t width, uint16_t height, void* src, bool rgb) {
+// Gives every distinct color an index, fails on the 257th one.
+static bool index_colors(const RGBA *img, size_t n, uint8_t *idx, RGBA *pal, uint32_t *count) {
+    uint32_t key[1024];
+    int16_t slot[1024];
+    for(int i = 0; i < 1024; ++i) slot[i] = -1;
+    uint32_t last = 0;
+    int16_t last_i = -1;
+    *count = 0;
+    for(size_t i = 0; i < n; ++i) {
+        uint32_t c;
+        memcpy(&c, &img[i], sizeof(uint32_t));
+        if(c != last || last_i < 0) {
+            uint32_t h = (c * 2654435761u) >> 22;
+            while(slot[h] >= 0 && key[h] != c) h = (h + 1) & 1023;
+            if(slot[h] < 0) {
+                if(*count == 256) return false;
+                key[h] = c;
+                slot[h] = *count;
+                pal[(*count)++] = img[i];
+            }
+            last = c;
+            last_i = slot[h];
+        }
+        idx[i] = last_i;
+    }
+    return true;
+}
+
+// KHR_texture_basisu only takes KTX2 with Basis Universal payloads, not
+// the raw RGBA and BC blocks written here, so a GLB links PNGs instead.
+static TextureContainer glb_texture_container(void) {
+    return options.tex_container == TEX_KTX2 ? TEX_PNG : options.tex_container;
+}
+
+// KTX2/DDS color texture, with the mip chain and block compression the
+// options ask for.
+static bool save_texture(char *filename, RGBA *img, uint32_t width, uint32_t height, TextureContainer container) {
+    TextureFormat format = options.tex_format;
+    TexLevel levels[MIP_MAX_LEVELS] = {{width, height, (uint8_t*)img}};
+    TexLevel blocks[MIP_MAX_LEVELS] = {0};
+    uint32_t count = 1;
+    if(options.mip_filter != MIP_NONE) count = mip_build(levels, options.mip_filter);
+    bool ok = true;
+    if(format != TEX_FORMAT_RGBA8) {
+        for(uint32_t i = 0; i < count && ok; ++i) {
+            blocks[i] = levels[i];
+            blocks[i].data = bc_encode((RGBA*)levels[i].data, levels[i].width, levels[i].height, format, options.bc_quality);
+            ok = blocks[i].data != NULL;
+        }
+    }
+    const TexLevel *out = format != TEX_FORMAT_RGBA8 ? blocks : levels;
+    if(ok && container == TEX_KTX2) {
+        ok = ktx2_write(filename, out, count, format, true);
+    } else if(ok) {
+        ok = dds_write(filename, out, count, format, true);
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+        if(i) free(levels[i].data);
+        free(blocks[i].data);
+    }
+    return ok;
+}
+
+// rgb images are 32-bit with PS2 alpha (0x80 = opaque), others are 8-bit
+// grayscale. PNGs are written indexed when they have at most 256 colors,
+// KTX2 and DDS get R8, RGBA or options.tex_format blocks. RGB sources are
+// read stride texels a row, index ones are packed.
+void save_image(char *filename, uint16_t width, uint16_t height, uint16_t stride, void* src, bool rgb, TextureContainer container) {
     uint8_t* b = src;
-    RGBA *img = malloc(width * height * sizeof(RGBA));
+    bool ok;
     if(rgb) {
-        for(int y = 0; y < height; ++y) {
-            for(int x = 0; x < width; ++x) {
-                uint8_t *p = &b[(y * width * 4) + (x * 4)];
-                RGBA *pixel = &img[(y*width)+x];
-                pixel->r = p[0];
-                pixel->g = p[1];
-                pixel->b = p[2];
-                pixel->a = CLAMP(255.0f*(((float)p[3])/128.0f), 0, 255);
+        RGBA *img = malloc(width * height * sizeof(RGBA));
+        uint8_t *idx = malloc(width * height);
+        RGBA pal[256];
+        uint32_t pal_count;
+        ok = img && idx;
+        if(ok) {
+            for(int y = 0; y < height; ++y) {
+                for(int x = 0; x < width; ++x) {
+                    uint8_t *p = &b[(y * stride * 4) + (x * 4)];
+                    RGBA *pixel = &img[(y*width)+x];
+                    pixel->r = p[0];
+                    pixel->g = p[1];
+                    pixel->b = p[2];
+                    pixel->a = CLAMP(255.0f*(((float)p[3])/128.0f), 0, 255);
+                }
             }
+            if(container != TEX_PNG) {
+                ok = save_texture(filename, img, width, height, container);
+            } else if(index_colors(img, width * height, idx, pal, &pal_count)) {
+                ok = png_write_indexed(filename, idx, width, height, (uint8_t*)pal, pal_count);
+            } else {
+                ok = png_write(filename, (uint8_t*)img, width, height, 4);
+            }
+        }
+        free(idx);
+        free(img);
+    } else if(container != TEX_PNG) {
+        TexLevel level = {width, height, b};
+        if(container == TEX_KTX2) {
+            ok = ktx2_write(filename, &level, 1, TEX_FORMAT_R8, false);
+        } else {
+            ok = dds_write(filename, &level, 1, TEX_FORMAT_R8, false);
         }
     } else {
-        for(int y = 0; y < height; ++y) {
-            for(int x = 0; x < width; ++x) {
-                uint8_t p = b[(y * width) + (x)];
-                RGBA *pixel = &img[(y*width)+x];
-                pixel->r = p;
-                pixel->g = p;
-                pixel->b = p;
-                pixel->a = 255;
+        ok = png_write(filename, b, width, height, 1);
+    }
+    if(!ok) {
+        printf("Failed to write file: \"%s\"\n", filename);
+        return;
+    }
+    printf("Wrote \"%s\"\n", filename);
+}
+
+// A palette image with a single CLUT is written as its indices and that
+// CLUT, instead of hashing the expanded colors back into a palette.
+static void save_palette_image(char *filename, const Texture *tex, vector *mat, RGBA *rgba, TextureContainer container) {
+    size_t n = (size_t)tex->crop_width * tex->crop_height;
+    uint8_t *idx = container == TEX_PNG ? malloc(n) : NULL;
+    RGBA pal[256];
+    if(!idx || !palette_indices(tex, mat, idx, pal)) {
+        free(idx);
+        save_image(filename, tex->crop_width, tex->crop_height, tex->crop_width, rgba, true, container);
+        return;
+    }
+    // CLUTs can repeat colors, those texels get one index so they compress alike
+    uint8_t first[256];
+    for(int c = 0; c < 256; ++c) {
+        pal[c].a = CLAMP(255.0f*(((float)pal[c].a)/128.0f), 0, 255);
+        first[c] = c;
+        for(int d = 0; d < c; ++d) {
+            if(!memcmp(&pal[d], &pal[c], sizeof(RGBA))) {
+                first[c] = d;
+                break;
             }
         }
     }
-    stbi_write_png(filename, width, height, 4, img, width * 4);
-    free(img);
+    uint32_t count = 0;
+    for(size_t k = 0; k < n; ++k) {
+        idx[k] = first[idx[k]];
+        count = MAX(count, idx[k] + 1u);
+    }
+    bool ok = png_write_indexed(filename, idx, tex->crop_width, tex->crop_height, (uint8_t*)pal, count);
+    free(idx);
+    if(!ok) {
+        printf("Failed to write file: \"%s\"\n", filename);
+        return;
+    }
     printf("Wrote \"%s\"\n", filename);
 }
 
-#define TEX_RGB_FMT "%s_RGB.png"
-#define TEX_PAL_FMT "%s_palette.png"
+#define GLB_BLOCK_SIZE (1 << 16)
 
-void save_mtl(char *mtl_filename, char *xtx_filename, Model *m) {
-    FILE *fp = fopen(mtl_filename, "w");
-    char *tex_filename = malloc(256);
-    if(!fp) return;
-    Material *mp = m->material.p;
-    for(size_t i = 0; i < m->material.length; ++i) {
-        fprintf(fp, "newmtl material_%llu\n", i);
-        fprintf(fp, "Kd %6.9f %6.9f %6.9f\n", mp[i].col.color0[0], mp[i].col.color0[1], mp[i].col.color0[2]);
-        if(xtx_filename && mp[i].has_texture) {
-            if(mp[i].pal == 0xff) {
-                snprintf(tex_filename, 256, TEX_RGB_FMT, xtx_filename);
-            } else {
-                snprintf(tex_filename, 256, TEX_PAL_FMT, xtx_filename);
+// Compact GLB encoding. Positions are normalized int16 and come back as
+// center + q * extent through the mesh node transform, or through the
+// inverse bind matrices for skinned meshes. The extent is the same on
+// every axis, a non-uniform scale would skew the int8 normals.
+typedef struct {
+    bool compact;
+    bool joints8; // uint8 joints, at most 256 bones
+    bool indices16; // uint16 indices, at most 65536 vertices
+    float center[3];
+    float extent;
+} GlbEncoding;
+
+static int16_t quantize_snorm16(float v, float center, float extent) {
+    return lrintf(CLAMP((v - center) / extent, -1.0f, 1.0f) * 32767);
+}
+
+typedef union {
+    float t[GLB_BLOCK_SIZE / sizeof(float[2])][2];
+    float w[GLB_BLOCK_SIZE / sizeof(float[4])][4];
+    int16_t j[GLB_BLOCK_SIZE / sizeof(int16_t[4])][4];
+    int16_t p[GLB_BLOCK_SIZE / sizeof(int16_t[4])][4];
+    int8_t n[GLB_BLOCK_SIZE / sizeof(int8_t[4])][4];
+    uint8_t b[GLB_BLOCK_SIZE / sizeof(uint8_t[4])][4];
+} GlbBlock;
+
+// streams GLB keeps as the model has them
+static bool glb_attribute_raw(int a, const GlbEncoding *e) {
+    return !e->compact && a != ATTR_TEXCOORD && a != ATTR_WEIGHTS && a != ATTR_JOINTS;
+}
+
+// Converts vertices i0 to i0 + n of stream a to their GLB layout.
+static void glb_convert_attribute(Model *m, int a, const GlbEncoding *e, size_t i0, size_t n, GlbBlock *block) {
+    float (*pos)[3] = m->attr[ATTR_POSITION].p;
+    float (*nrm)[3] = m->attr[ATTR_NORMAL].p;
+    float (*uv)[2] = m->attr[ATTR_TEXCOORD].p;
+    float (*col)[4] = m->attr[ATTR_COLOR].p;
+    float (*w)[4] = m->attr[ATTR_WEIGHTS].p;
+    int16_t (*jnt)[4] = m->attr[ATTR_JOINTS].p;
+    for(size_t k = 0; k < n; ++k) {
+        size_t i = i0 + k;
+        switch(a) {
+            case ATTR_POSITION: {
+                for(int c = 0; c < 3; ++c) block->p[k][c] = quantize_snorm16(pos[i][c], e->center[c], e->extent);
+                block->p[k][3] = 0;
+                break;
+            }
+            case ATTR_NORMAL: {
+                for(int c = 0; c < 3; ++c) block->n[k][c] = lrintf(CLAMP(nrm[i][c], -1.0f, 1.0f) * 127);
+                block->n[k][3] = 0;
+                break;
+            }
+            case ATTR_TEXCOORD: {
+                block->t[k][0] = uv[i][0];
+                block->t[k][1] = 1 - uv[i][1];
+                break;
+            }
+            case ATTR_COLOR: {
+                for(int c = 0; c < 4; ++c) block->b[k][c] = lrintf(CLAMP(col[i][c], 0.0f, 1.0f) * 255);
+                break;
+            }
+            case ATTR_WEIGHTS: {
+                float t[4] = {0};
+                if(w) memcpy(t, w[i], sizeof(t));
+                float sum = t[0] + t[1] + t[2] + t[3];
+                if(!e->compact) {
+                    for(int j = 0; j < 4; ++j) block->w[k][j] = t[j] / sum;
+                    break;
+                }
+                // unorm8 weights have to add up to exactly 255, the
+                // rounding error goes to the biggest one
+                int total = 0, big = 0;
+                for(int j = 0; j < 4; ++j) {
+                    block->b[k][j] = sum > 0 ? lrintf(t[j] / sum * 255) : (j == 0) * 255;
+                    total += block->b[k][j];
+                    if(block->b[k][j] > block->b[k][big]) big = j;
+                }
+                block->b[k][big] += 255 - total;
+                break;
+            }
+            case ATTR_JOINTS: {
+                for(int j = 0; j < 4; ++j) {
+                    int16_t v = jnt[i][j];
+                    if((!w || w[i][j] == 0) && v != 0) v = 0;
+                    if(e->joints8) {
+                        block->b[k][j] = v;
+                    } else {
+                        block->j[k][j] = v;
+                    }
+                }
+                break;
             }
-            fprintf(fp, "map_Kd %s\n", tex_filename);
         }
     }
-    free(tex_filename);
-    fclose(fp);
 }
 
-void save_obj(char *obj_filename, char *mtl_filename, Model *m) {
-    FILE *fp = fopen(obj_filename, "w");
-    if(!fp) return;
-    fprintf(fp,"mtllib %s\n", mtl_filename);
-    Vertex *vp = m->vertex.p;
-    for(size_t i = 0; i < m->vertex.length; ++i) {
-        fprintf(fp, "v %6.9f %6.9f %6.9f\n", vp[i].x, vp[i].y, vp[i].z);
-        fprintf(fp, "vt %6.9f %6.9f\n", vp[i].u, vp[i].v);
-        fprintf(fp, "vn %6.9f %6.9f %6.9f\n", vp[i].nx, vp[i].ny, vp[i].nz);
-    }
-    size_t material_index = SIZE_MAX;
-    Mesh *mp = m->mesh.p;
+// Streams that need converting go through a fixed size block, the rest is
+// written straight from the model.
+// Writers return false when out of memory, the BIN chunk is short then.
+static bool glb_write_attribute(FILE *fp, Model *m, int a, size_t stride, const GlbEncoding *e) {
+    if(glb_attribute_raw(a, e)) {
+        fwrite(m->attr[a].p, m->attr[a].size, m->vertex_count, fp);
+        return true;
+    }
+    GlbBlock *block = malloc(GLB_BLOCK_SIZE);
+    if(!block) {
+        printf("Error: out of memory\n");
+        return false;
+    }
+    size_t per_block = GLB_BLOCK_SIZE / stride;
+    for(size_t i0 = 0; i0 < m->vertex_count; i0 += per_block) {
+        size_t n = MIN(per_block, m->vertex_count - i0);
+        glb_convert_attribute(m, a, e, i0, n, block);
+        fwrite(block, stride, n, fp);
+    }
+    free(block);
+    return true;
+}
+
+// EXT_meshopt_compression stream of attribute a, NULL when out of memory.
+static uint8_t *glb_meshopt_attribute(Model *m, int a, size_t stride, const GlbEncoding *e, size_t *size) {
+    size_t cap = meshopt_vertex_bound(m->vertex_count, stride);
+    uint8_t *src = malloc(m->vertex_count * stride + 1);
+    uint8_t *dst = malloc(cap);
+    GlbBlock *block = malloc(GLB_BLOCK_SIZE);
+    *size = 0;
+    if(src && dst && block && glb_attribute_raw(a, e)) {
+        memcpy(src, m->attr[a].p, m->vertex_count * stride);
+    } else if(src && dst && block) {
+        size_t per_block = GLB_BLOCK_SIZE / stride;
+        for(size_t i0 = 0; i0 < m->vertex_count; i0 += per_block) {
+            size_t n = MIN(per_block, m->vertex_count - i0);
+            glb_convert_attribute(m, a, e, i0, n, block);
+            memcpy(src + i0 * stride, block, n * stride);
+        }
+    }
+    if(src && dst && block) *size = meshopt_encode_vertex(dst, cap, src, m->vertex_count, stride);
+    free(src);
+    free(block);
+    if(!*size) {
+        free(dst);
+        return NULL;
+    }
+    return dst;
+}
+
+// Vertex that continues the strip ending in p0 p1 with triangle t in any
+// rotation. Odd strip triangles are p0 v p1, like parse_lex expands them.
+static bool strip_continue(uint32_t p0, uint32_t p1, bool odd, const Triangle *t, uint32_t *v) {
+    for(int r = 0; r < 3; ++r) {
+        uint32_t a = t->i[r], b = t->i[(r + 1) % 3], c = t->i[(r + 2) % 3];
+        if(a == p0 && (odd ? c : b) == p1) {
+            *v = odd ? b : c;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Joins the triangles of a span into one TRIANGLE_STRIP. A triangle that
+// doesn't continue it starts over after two repeated indices, written
+// a c b on odd positions so the winding stays, and rotated so the next
+// triangle can continue it if there is such a rotation.
+static bool glb_build_strip(vector *strip, const Triangle *t, size_t count) {
+    size_t first = strip->length;
+    for(size_t j = 0; j < count; ++j) {
+        uint32_t *s = (uint32_t*)strip->p + first;
+        size_t n = strip->length - first;
+        uint32_t v;
+        if(n >= 3 && strip_continue(s[n - 2], s[n - 1], n % 2, &t[j], &v)) {
+            if(!vector_push(strip, &v)) return false;
+            continue;
+        }
+        bool odd = n % 2;
+        int rot = 0;
+        for(int r = 0; r < 3 && j + 1 < count; ++r) {
+            uint32_t b = t[j].i[(r + 1) % 3], c = t[j].i[(r + 2) % 3];
+            if(strip_continue(odd ? c : b, odd ? b : c, !odd, &t[j + 1], &v)) {
+                rot = r;
+                break;
+            }
+        }
+        uint32_t a = t[j].i[rot], b = t[j].i[(rot + 1) % 3], c = t[j].i[(rot + 2) % 3];
+        uint32_t tri[3] = {a, odd ? c : b, odd ? b : c};
+        if(n) {
+            uint32_t last = s[n - 1];
+            if(!vector_push(strip, &last) || !vector_push(strip, &a)) return false;
+        }
+        if(!vector_push_n(strip, tri, 3)) return false;
+    }
+    return true;
+}
+
+static bool glb_write_indices(FILE *fp, Model *m, const GlbEncoding *e, const vector *strip) {
+    uint32_t *block = malloc(GLB_BLOCK_SIZE);
+    uint16_t *block16 = (uint16_t*)block;
+    if(!block) {
+        printf("Error: out of memory\n");
+        return false;
+    }
+    if(strip->length && !e->indices16) {
+        fwrite(strip->p, sizeof(uint32_t), strip->length, fp);
+    }
+    for(size_t k0 = 0; k0 < strip->length && e->indices16; k0 += GLB_BLOCK_SIZE / sizeof(uint16_t)) {
+        size_t n = MIN(GLB_BLOCK_SIZE / sizeof(uint16_t), strip->length - k0);
+        for(size_t k = 0; k < n; ++k) block16[k] = ((uint32_t*)strip->p)[k0 + k];
+        fwrite(block16, sizeof(uint16_t), n, fp);
+    }
+    if(strip->length) {
+        free(block);
+        return true;
+    }
+    const size_t per_block = GLB_BLOCK_SIZE / sizeof(uint32_t[3]);
     for(size_t i = 0; i < m->mesh.length; ++i) {
-        // fprintf(fp, "o object_%llu\n", i);
-        fprintf(fp, "o %s\n", mp[i].name);
-        Triangle *tp = mp[i].tri.p;
-        for(size_t j = 0; j < mp[i].tri.length; ++j) {
-            if(tp[j].mat != material_index) {
-                material_index = tp[j].mat;
-                fprintf(fp, "usemtl material_%llu\n", material_index);
+        Mesh *mesh = &((Mesh*)m->mesh.p)[i];
+        Triangle *t = mesh->tri.p;
+        for(size_t j0 = 0; j0 < mesh->tri.length; j0 += per_block) {
+            size_t n = MIN(per_block, mesh->tri.length - j0);
+            if(e->indices16) {
+                for(size_t k = 0; k < n * 3; ++k) block16[k] = t[j0 + k / 3].i[k % 3];
+                fwrite(block16, sizeof(uint16_t[3]), n, fp);
+                continue;
             }
-            size_t *idx = tp[j].i;
-            if(vp[idx[0]].nx + vp[idx[0]].ny + vp[idx[0]].nz == 0) {
-                fprintf(fp, "f %llu/%llu/ %llu/%llu/ %llu/%llu/\n",
-                        idx[0]+1,idx[0]+1, idx[1]+1,idx[1]+1, idx[2]+1,idx[2]+1);
-            } else {
-                fprintf(fp, "f %llu/%llu/%llu %llu/%llu/%llu %llu/%llu/%llu\n",
-                        idx[0]+1,idx[0]+1,idx[0]+1, idx[1]+1,idx[1]+1,idx[1]+1, idx[2]+1,idx[2]+1,idx[2]+1);
+            for(size_t k = 0; k < n; ++k) {
+                block[k * 3] = t[j0 + k].i[0];
+                block[k * 3 + 1] = t[j0 + k].i[1];
+                block[k * 3 + 2] = t[j0 + k].i[2];
             }
+            fwrite(block, sizeof(uint32_t[3]), n, fp);
         }
     }
-    fclose(fp);
+    free(block);
+    return true;
+}
+
+// EXT_meshopt_compression stream of all the triangles, or of the strips
+// when there are any, NULL when out of memory.
+static uint8_t *glb_meshopt_indices(Model *m, const vector *strip, size_t *size) {
+    if(strip->length) {
+        size_t cap = meshopt_sequence_bound(strip->length, m->vertex_count);
+        uint8_t *dst = malloc(cap);
+        *size = dst ? meshopt_encode_sequence(dst, cap, strip->p, strip->length) : 0;
+        if(!*size) {
+            free(dst);
+            return NULL;
+        }
+        return dst;
+    }
+    size_t count = 0;
+    for(size_t i = 0; i < m->mesh.length; ++i) count += ((Mesh*)m->mesh.p)[i].tri.length * 3;
+    size_t cap = meshopt_index_bound(count, m->vertex_count);
+    uint32_t *src = malloc(count * sizeof(uint32_t) + 1);
+    uint8_t *dst = malloc(cap);
+    *size = 0;
+    if(src && dst) {
+        uint32_t *p = src;
+        for(size_t i = 0; i < m->mesh.length; ++i) {
+            Mesh *mesh = &((Mesh*)m->mesh.p)[i];
+            Triangle *t = mesh->tri.p;
+            for(size_t j = 0; j < mesh->tri.length; ++j) {
+                *p++ = t[j].i[0];
+                *p++ = t[j].i[1];
+                *p++ = t[j].i[2];
+            }
+        }
+        *size = meshopt_encode_index(dst, cap, src, count);
+    }
+    free(src);
+    if(!*size) {
+        free(dst);
+        return NULL;
+    }
+    return dst;
 }
 
 void save_glb(char *glb_filename, char *xtx_filename, Model *m) {
@@ -178,89 +544,93 @@ void save_glb(char *glb_filename, char *xtx_filename, Model *m) {
         } else {
             ch = p+1;
         }
-        snprintf(tex_rgb, 256, TEX_RGB_FMT, ch);
-        snprintf(tex_pal, 256, TEX_PAL_FMT, ch);
+        snprintf(tex_rgb, 256, TEX_RGB_FMT, ch, TEX_EXT(glb_texture_container()));
+        snprintf(tex_pal, 256, TEX_PAL_FMT, ch, TEX_EXT(glb_texture_container()));
         // printf("%s\n%s\n", tex_rgb, tex_pal);
     }
     
-    //prepare binary chunk
-    vector bin = vector_init(1);
-    Vertex *vp = m->vertex.p;
-    float min_x, min_y, min_z, max_x, max_y, max_z;
-    min_x = max_x = vp[0].x;
-    min_y = max_y = vp[0].y;
-    min_z = max_z = vp[0].z;
-    for(size_t i = 0; i < m->vertex.length; ++i) {
-        vector_push_n(&bin, &vp[i].x, sizeof(float));
-        vector_push_n(&bin, &vp[i].y, sizeof(float));
-        vector_push_n(&bin, &vp[i].z, sizeof(float));
-        min_x = MIN(min_x, vp[i].x);
-        min_y = MIN(min_y, vp[i].y);
-        min_z = MIN(min_z, vp[i].z);
-        max_x = MAX(max_x, vp[i].x);
-        max_y = MAX(max_y, vp[i].y);
-        max_z = MAX(max_z, vp[i].z);
-    }
-    size_t position_size = bin.length;
-    
-    size_t normal_offset = bin.length;
-    for(size_t i = 0; i < m->vertex.length; ++i) {
-        vector_push_n(&bin, &vp[i].nx, sizeof(float));
-        vector_push_n(&bin, &vp[i].ny, sizeof(float));
-        vector_push_n(&bin, &vp[i].nz, sizeof(float));
-    }
-    size_t normal_size = bin.length - normal_offset;
-    
-    size_t uv_offset = bin.length;
-    for(size_t i = 0; i < m->vertex.length; ++i) {
-        vector_push_n(&bin, &vp[i].u, sizeof(float));
-        float v = 1 - vp[i].v;
-        vector_push_n(&bin, &v, sizeof(float));
-    }
-    size_t uv_size = bin.length - uv_offset;
-    
-    size_t color_offset = bin.length;
-    for(size_t i = 0; i < m->vertex.length; ++i) {
-        vector_push_n(&bin, &vp[i].r, sizeof(float));
-        vector_push_n(&bin, &vp[i].g, sizeof(float));
-        vector_push_n(&bin, &vp[i].b, sizeof(float));
-        vector_push_n(&bin, &vp[i].a, sizeof(float));
-    }
-    size_t color_size = bin.length - color_offset;
-    
-    size_t weight_offset = bin.length;
-    for(size_t i = 0; i < m->vertex.length; ++i) {
-        float w[4] = {vp[i].w[0], vp[i].w[1], vp[i].w[2], vp[i].w[3]};
-        float sum = w[0] + w[1] + w[2] + w[3];
-        for(int j = 0; j < 4; ++j) w[j] /= sum;
-        vector_push_n(&bin, &w[0], sizeof(float));
-        vector_push_n(&bin, &w[1], sizeof(float));
-        vector_push_n(&bin, &w[2], sizeof(float));
-        vector_push_n(&bin, &w[3], sizeof(float));
-    }
-    size_t weight_size = bin.length - weight_offset;
-    
-    size_t joint_offset = bin.length;
-    for(size_t i = 0; i < m->vertex.length; ++i) {
-        int16_t j[4] = {vp[i].j[0], vp[i].j[1], vp[i].j[2], vp[i].j[3]};
-        float w[4] = {vp[i].w[0], vp[i].w[1], vp[i].w[2], vp[i].w[3]};
-        for(int k = 0; k < 4; ++k) if(w[k] == 0 && j[k] != 0) j[k] = 0;
-        vector_push_n(&bin, &j[0], sizeof(int16_t));
-        vector_push_n(&bin, &j[1], sizeof(int16_t));
-        vector_push_n(&bin, &j[2], sizeof(int16_t));
-        vector_push_n(&bin, &j[3], sizeof(int16_t));
-    }
-    size_t joint_size = bin.length - joint_offset;
+    //binary chunk layout, the data itself is streamed to the file at the end
+    size_t bin_length = 0;
+    // one bufferView and accessor per stream the model has, in VertexAttribute order
+    struct glb_attribute {
+        const char *name;
+        const char *type;
+        int component_type;
+        size_t stride;
+        bool normalized;
+        size_t offset;
+        size_t size;
+        int attr;
+    } attr[ATTR_COUNT];
+    int attr_index[ATTR_COUNT];
+    size_t attr_count = 0;
+    const struct glb_attribute attr_desc[ATTR_COUNT] = {
+        [ATTR_POSITION] = {"POSITION", "VEC3", 5126, 12},
+        [ATTR_NORMAL] = {"NORMAL", "VEC3", 5126, 12},
+        [ATTR_TEXCOORD] = {"TEXCOORD_0", "VEC2", 5126, 8},
+        [ATTR_COLOR] = {"COLOR_0", "VEC4", 5126, 16},
+        [ATTR_WEIGHTS] = {"WEIGHTS_0", "VEC4", 5126, 16},
+        [ATTR_JOINTS] = {"JOINTS_0", "VEC4", 5123, 8},
+    };
+    // KHR_mesh_quantization, vertex attributes are padded to 4 bytes
+    const struct glb_attribute attr_compact[ATTR_COUNT] = {
+        [ATTR_POSITION] = {"POSITION", "VEC3", GLB_SIGNED_SHORT, 8, true},
+        [ATTR_NORMAL] = {"NORMAL", "VEC3", GLB_SIGNED_BYTE, 4, true},
+        [ATTR_TEXCOORD] = {"TEXCOORD_0", "VEC2", GLB_FLOAT, 8},
+        [ATTR_COLOR] = {"COLOR_0", "VEC4", GLB_UNSIGNED_BYTE, 4, true},
+        [ATTR_WEIGHTS] = {"WEIGHTS_0", "VEC4", GLB_UNSIGNED_BYTE, 4, true},
+        [ATTR_JOINTS] = {"JOINTS_0", "VEC4", GLB_UNSIGNED_BYTE, 4},
+    };
+    float (*pos)[3] = m->attr[ATTR_POSITION].p;
+    bool has_skin = model_has(m, ATTR_JOINTS);
+    float min_x = 0, min_y = 0, min_z = 0, max_x = 0, max_y = 0, max_z = 0;
+    if(m->vertex_count) {
+        min_x = max_x = pos[0][0];
+        min_y = max_y = pos[0][1];
+        min_z = max_z = pos[0][2];
+    }
+    for(size_t i = 0; i < m->vertex_count; ++i) {
+        min_x = MIN(min_x, pos[i][0]);
+        min_y = MIN(min_y, pos[i][1]);
+        min_z = MIN(min_z, pos[i][2]);
+        max_x = MAX(max_x, pos[i][0]);
+        max_y = MAX(max_y, pos[i][1]);
+        max_z = MAX(max_z, pos[i][2]);
+    }
+    GlbEncoding enc = {
+        .compact = options.glb_compact,
+        .joints8 = options.glb_compact && m->bone_count <= 256,
+        .indices16 = options.glb_compact && m->vertex_count <= 65536,
+        .center = {(min_x + max_x) / 2, (min_y + max_y) / 2, (min_z + max_z) / 2},
+        .extent = MAX(MAX(max_x - min_x, max_y - min_y), max_z - min_z) / 2
+    };
+    if(enc.extent <= 0) enc.extent = 1;
+    for(int a = 0; a < ATTR_COUNT; ++a) {
+        attr_index[a] = -1;
+        // skinned meshes need both streams, even if every weight is zero
+        bool present = (a == ATTR_WEIGHTS) ? has_skin : model_has(m, a);
+        if(!present) continue;
+        struct glb_attribute *ga = &attr[attr_count];
+        *ga = enc.compact ? attr_compact[a] : attr_desc[a];
+        if(a == ATTR_JOINTS && enc.compact && !enc.joints8) *ga = attr_desc[a];
+        ga->attr = a;
+        ga->offset = bin_length;
+        ga->size = m->vertex_count * ga->stride;
+        bin_length += ga->size;
+        attr_index[a] = attr_count++;
+    }
     
     struct material_span{
         size_t mesh;
         size_t count;
         size_t mat;
+        size_t first; // triangle in the mesh
+        size_t indices;
     };
     vector mspanv = vector_init(sizeof(struct material_span));
     struct material_span mspan = {0};
     
-    size_t indices_offset = bin.length;
+    size_t indices_offset = bin_length;
     bool has_weights = false;
     for(size_t i = 0; i < m->mesh.length; ++i) {
         Mesh *mesh = &((Mesh*)m->mesh.p)[i];
@@ -274,17 +644,60 @@ void save_glb(char *glb_filename, char *xtx_filename, Model *m) {
                 mspan.mat = t[j].mat;
                 mspan.count = 1;
                 mspan.mesh = i;
+                mspan.first = j;
             }
-            uint32_t idx = t[j].i[0];
-            vector_push_n(&bin, &idx, sizeof(uint32_t));
-            idx = t[j].i[1];
-            vector_push_n(&bin, &idx, sizeof(uint32_t));
-            idx = t[j].i[2];
-            vector_push_n(&bin, &idx, sizeof(uint32_t));
         }
     }
     vector_push(&mspanv, &mspan);
-    size_t indices_size = bin.length - indices_offset;
+    // strips are built up front, their length is only known after
+    vector strip = vector_init(sizeof(uint32_t));
+    size_t index_count = 0;
+    for(size_t i = 0; i < mspanv.length; ++i) {
+        struct material_span *sp = &((struct material_span*)mspanv.p)[i];
+        sp->indices = sp->count * 3;
+        if(options.glb_strips) {
+            Triangle *t = ((Mesh*)m->mesh.p)[sp->mesh].tri.p;
+            size_t first = strip.length;
+            if(!glb_build_strip(&strip, t + sp->first, sp->count)) printf("Error: out of memory\n");
+            sp->indices = strip.length - first;
+        }
+        index_count += sp->indices;
+    }
+    bin_length += index_count * (enc.indices16 ? sizeof(uint16_t) : sizeof(uint32_t));
+    size_t indices_size = bin_length - indices_offset;
+    // skinned meshes get their positions dequantized by the inverse bind matrices
+    size_t ibm_offset = (bin_length + 3) & ~(size_t)3;
+    bool has_ibm = false;
+    for(size_t i = 0; i < m->mesh.length && enc.compact; ++i) {
+        if(((Mesh*)m->mesh.p)[i].weight_format & 0xff) has_ibm = true;
+    }
+    if(has_ibm) bin_length = ibm_offset + m->bone_count * sizeof(float[16]);
+    
+    // EXT_meshopt_compression streams are encoded up front since the JSON
+    // needs their sizes, the layout above becomes the fallback buffer
+    struct glb_packed {
+        uint8_t *data;
+        size_t size;
+        size_t offset;
+    } packed[ATTR_COUNT + 1] = {0};
+    size_t packed_length = 0;
+    bool meshopt = options.glb_meshopt;
+    for(size_t i = 0; i <= attr_count && meshopt; ++i) {
+        struct glb_packed *p = &packed[i];
+        if(i < attr_count) {
+            p->data = glb_meshopt_attribute(m, attr[i].attr, attr[i].stride, &enc, &p->size);
+        } else {
+            p->data = glb_meshopt_indices(m, &strip, &p->size);
+        }
+        if(!p->data) {
+            printf("Error: out of memory\n");
+            meshopt = false;
+        }
+        p->offset = packed_length;
+        packed_length = (packed_length + p->size + 3) & ~(size_t)3;
+    }
+    size_t packed_ibm_offset = packed_length;
+    if(has_ibm) packed_length += m->bone_count * sizeof(float[16]);
     
     //prepare json chunk
     str json = str_init();
@@ -292,6 +705,22 @@ void save_glb(char *glb_filename, char *xtx_filename, Model *m) {
     
     str_append_cstr(&json, "{\"asset\":{\"generator\":\"xenotool by Laku, built on "__DATE__"\",\"version\":\"2.0\"}");
     
+    // DDS images are only reachable through an extension, there is no PNG fallback
+    const char *tex_extension = NULL, *tex_mime = NULL;
+    if(xtx_filename && glb_texture_container() == TEX_DDS) {
+        tex_extension = "MSFT_texture_dds";
+        tex_mime = "image/vnd-ms.dds";
+    }
+    if(tex_extension || enc.compact || meshopt) {
+        const char *used[] = {tex_extension, enc.compact ? "KHR_mesh_quantization" : NULL, meshopt ? "EXT_meshopt_compression" : NULL};
+        char ext[256] = "";
+        for(int i = 0; i < 3; ++i) {
+            if(used[i]) snprintf(ext + strlen(ext), 256 - strlen(ext), "%s\"%s\"", *ext ? "," : "", used[i]);
+        }
+        snprintf(buf, 1024, ",\"extensionsUsed\":[%s],\"extensionsRequired\":[%s]", ext, ext);
+        str_append_cstr(&json, buf);
+    }
+    
     //scene
     str_append_cstr(&json, ",\"scene\":0,\"scenes\":[{\"name\":\"Scene\",\"nodes\":[");
     if(has_weights) {
@@ -335,6 +764,9 @@ void save_glb(char *glb_filename, char *xtx_filename, Model *m) {
         Mesh *mesh = &((Mesh*)m->mesh.p)[i];
         if(mesh->weight_format & 0xff) {
             snprintf(buf, 1024, "{\"mesh\":%llu,\"name\":\"%s\",\"skin\":0}", i, mesh->name);
+        } else if(enc.compact) {
+            float *c = enc.center, e = enc.extent;
+            snprintf(buf, 1024, "{\"mesh\":%llu,\"name\":\"%s\",\"scale\":[%6.9f,%6.9f,%6.9f],\"translation\":[%6.9f,%6.9f,%6.9f]}", i, mesh->name, e, e, e, c[0], c[1], c[2]);
         } else {
             snprintf(buf, 1024, "{\"mesh\":%llu,\"name\":\"%s\"}", i, mesh->name);
         }
@@ -350,7 +782,12 @@ void save_glb(char *glb_filename, char *xtx_filename, Model *m) {
             snprintf(buf, 1024, "%d", m->bone_count - 1 - i);
             str_append_cstr(&json, buf);
         }
-        str_append_cstr(&json, "],\"name\":\"Armature\"}]");
+        if(has_ibm) {
+            snprintf(buf, 1024, "],\"inverseBindMatrices\":%llu,\"name\":\"Armature\"}]", attr_count + mspanv.length);
+            str_append_cstr(&json, buf);
+        } else {
+            str_append_cstr(&json, "],\"name\":\"Armature\"}]");
+        }
     }
     
     //materials
@@ -373,7 +810,6 @@ void save_glb(char *glb_filename, char *xtx_filename, Model *m) {
     str_append_cstr(&json, "]");
     
     //meshes
-    const int attribute_count = 6;
     size_t mspani = 0;
     struct material_span *mspanp = mspanv.p;
     str_append_cstr(&json, ",\"meshes\":[");
@@ -385,19 +821,19 @@ void save_glb(char *glb_filename, char *xtx_filename, Model *m) {
         int j = 0;
         while(mspanp[mspani].mesh == i) {
             if(j++ > 0) str_append_cstr(&json, ",");
-            switch(mesh.weight_format) {
-                default:
-                case 0:
-                case 1024:
-                    snprintf(buf, 1024, "{\"attributes\":{\"POSITION\":0,\"NORMAL\":1,\"TEXCOORD_0\":2,\"COLOR_0\":3},\"indices\":%llu,\"material\":%llu}", mspani+attribute_count, mspanp[mspani].mat);
-                    break;
-                case 1:
-                case 3:
-                case 5:
-                    snprintf(buf, 1024, "{\"attributes\":{\"POSITION\":0,\"NORMAL\":1,\"TEXCOORD_0\":2,\"COLOR_0\":3,\"WEIGHTS_0\":4,\"JOINTS_0\":5},\"indices\":%llu,\"material\":%llu}", mspani+attribute_count, mspanp[mspani].mat);
-                    break;
+            bool skinned = mesh.weight_format == 1 || mesh.weight_format == 3 || mesh.weight_format == 5;
+            str_append_cstr(&json, "{\"attributes\":{");
+            for(int a = 0, n = 0; a < ATTR_COUNT; ++a) {
+                if(attr_index[a] < 0) continue;
+                if(!skinned && (a == ATTR_WEIGHTS || a == ATTR_JOINTS)) continue;
+                snprintf(buf, 1024, "%s\"%s\":%d", n++ ? "," : "", attr[attr_index[a]].name, attr_index[a]);
+                str_append_cstr(&json, buf);
+            }
+            if(options.glb_strips) {
+                snprintf(buf, 1024, "},\"indices\":%llu,\"material\":%llu,\"mode\":5}", mspani+attr_count, mspanp[mspani].mat);
+            } else {
+                snprintf(buf, 1024, "},\"indices\":%llu,\"material\":%llu}", mspani+attr_count, mspanp[mspani].mat);
             }
-            
             str_append_cstr(&json, buf);
             ++mspani;
             if(mspani >= mspanv.length) break;
@@ -408,60 +844,100 @@ void save_glb(char *glb_filename, char *xtx_filename, Model *m) {
     
     //accessors
     str_append_cstr(&json, ",\"accessors\":[");
-    snprintf(buf, 1024, "{\"bufferView\":0,\"componentType\":5126,\"count\":%llu,\"max\":[%6.9f,%6.9f,%6.9f],\"min\":[%6.9f,%6.9f,%6.9f],\"type\":\"VEC3\"},", m->vertex.length, max_x, max_y, max_z, min_x, min_y, min_z);
-    str_append_cstr(&json, buf);
-    snprintf(buf, 1024, "{\"bufferView\":1,\"componentType\":5126,\"count\":%llu,\"type\":\"VEC3\"},", m->vertex.length);
-    str_append_cstr(&json, buf);
-    snprintf(buf, 1024, "{\"bufferView\":2,\"componentType\":5126,\"count\":%llu,\"type\":\"VEC2\"},", m->vertex.length);
-    str_append_cstr(&json, buf);
-    snprintf(buf, 1024, "{\"bufferView\":3,\"componentType\":5126,\"count\":%llu,\"type\":\"VEC4\"},", m->vertex.length);
-    str_append_cstr(&json, buf);
-    snprintf(buf, 1024, "{\"bufferView\":4,\"componentType\":5126,\"count\":%llu,\"type\":\"VEC4\"},", m->vertex.length);
-    str_append_cstr(&json, buf);
-    snprintf(buf, 1024, "{\"bufferView\":5,\"componentType\":5123,\"count\":%llu,\"type\":\"VEC4\"},", m->vertex.length);
-    str_append_cstr(&json, buf);
+    for(size_t i = 0; i < attr_count; ++i) {
+        if(i == (size_t)attr_index[ATTR_POSITION] && enc.compact) {
+            int16_t q[2][3];
+            float bounds[2][3] = {{min_x, min_y, min_z}, {max_x, max_y, max_z}};
+            for(int b = 0; b < 2; ++b) {
+                for(int c = 0; c < 3; ++c) q[b][c] = quantize_snorm16(bounds[b][c], enc.center[c], enc.extent);
+            }
+            snprintf(buf, 1024, "{\"bufferView\":%llu,\"componentType\":%d,\"count\":%llu,\"max\":[%d,%d,%d],\"min\":[%d,%d,%d],\"normalized\":true,\"type\":\"%s\"},", i, attr[i].component_type, m->vertex_count, q[1][0], q[1][1], q[1][2], q[0][0], q[0][1], q[0][2], attr[i].type);
+        } else if(i == (size_t)attr_index[ATTR_POSITION]) {
+            snprintf(buf, 1024, "{\"bufferView\":%llu,\"componentType\":%d,\"count\":%llu,\"max\":[%6.9f,%6.9f,%6.9f],\"min\":[%6.9f,%6.9f,%6.9f],\"type\":\"%s\"},", i, attr[i].component_type, m->vertex_count, max_x, max_y, max_z, min_x, min_y, min_z, attr[i].type);
+        } else if(attr[i].normalized) {
+            snprintf(buf, 1024, "{\"bufferView\":%llu,\"componentType\":%d,\"count\":%llu,\"normalized\":true,\"type\":\"%s\"},", i, attr[i].component_type, m->vertex_count, attr[i].type);
+        } else {
+            snprintf(buf, 1024, "{\"bufferView\":%llu,\"componentType\":%d,\"count\":%llu,\"type\":\"%s\"},", i, attr[i].component_type, m->vertex_count, attr[i].type);
+        }
+        str_append_cstr(&json, buf);
+    }
     size_t accessor_byteoffset = 0;
     for(size_t i = 0; i < mspanv.length; ++i) {
         if(i > 0) str_append_cstr(&json, ",");
-        size_t count = mspanp[i].count * 3;
-        snprintf(buf, 1024, "{\"bufferView\":6,\"byteOffset\":%llu,\"componentType\":5125,\"count\":%llu,\"type\":\"SCALAR\"}", accessor_byteoffset, count);
-        accessor_byteoffset += count * sizeof(uint32_t);
+        size_t count = mspanp[i].indices;
+        snprintf(buf, 1024, "{\"bufferView\":%llu,\"byteOffset\":%llu,\"componentType\":%d,\"count\":%llu,\"type\":\"SCALAR\"}", attr_count, accessor_byteoffset, enc.indices16 ? 5123 : 5125, count);
+        accessor_byteoffset += count * (enc.indices16 ? sizeof(uint16_t) : sizeof(uint32_t));
+        str_append_cstr(&json, buf);
+    }
+    if(has_ibm) {
+        snprintf(buf, 1024, ",{\"bufferView\":%llu,\"componentType\":5126,\"count\":%u,\"type\":\"MAT4\"}", attr_count + 1, m->bone_count);
         str_append_cstr(&json, buf);
     }
     str_append_cstr(&json, "]");
     
     if(xtx_filename) {
         //textures
-        str_append_cstr(&json, ",\"textures\":[{\"source\":0},{\"source\":1}]");
+        if(tex_extension && options.mip_filter != MIP_NONE) {
+            // linear filtering between the stored mip levels
+            str_append_cstr(&json, ",\"samplers\":[{\"magFilter\":9729,\"minFilter\":9987}]");
+            snprintf(buf, 1024, ",\"textures\":[{\"sampler\":0,\"extensions\":{\"%s\":{\"source\":0}}},{\"sampler\":0,\"extensions\":{\"%s\":{\"source\":1}}}]", tex_extension, tex_extension);
+            str_append_cstr(&json, buf);
+        } else if(tex_extension) {
+            snprintf(buf, 1024, ",\"textures\":[{\"extensions\":{\"%s\":{\"source\":0}}},{\"extensions\":{\"%s\":{\"source\":1}}}]", tex_extension, tex_extension);
+            str_append_cstr(&json, buf);
+        } else {
+            str_append_cstr(&json, ",\"textures\":[{\"source\":0},{\"source\":1}]");
+        }
         
         //images
-        snprintf(buf, 1024, ",\"images\":[{\"uri\":\"%s\"},{\"uri\":\"%s\"}]", tex_rgb, tex_pal);
+        if(tex_mime) {
+            snprintf(buf, 1024, ",\"images\":[{\"uri\":\"%s\",\"mimeType\":\"%s\"},{\"uri\":\"%s\",\"mimeType\":\"%s\"}]", tex_rgb, tex_mime, tex_pal, tex_mime);
+        } else {
+            snprintf(buf, 1024, ",\"images\":[{\"uri\":\"%s\"},{\"uri\":\"%s\"}]", tex_rgb, tex_pal);
+        }
         str_append_cstr(&json, buf);
     }
     
-    //bufferViews
+    //bufferViews, with meshopt they point into the fallback buffer 1 and
+    //the extension into the compressed streams in buffer 0
     str_append_cstr(&json, ",\"bufferViews\":[");
-    snprintf(buf, 1024, "{\"buffer\":0,\"byteLength\":%llu,\"byteOffset\":0,\"target\":34962},", position_size);
-    str_append_cstr(&json, buf);
-    snprintf(buf, 1024, "{\"buffer\":0,\"byteLength\":%llu,\"byteOffset\":%llu,\"target\":34962},", normal_size, normal_offset);
-    str_append_cstr(&json, buf);
-    snprintf(buf, 1024, "{\"buffer\":0,\"byteLength\":%llu,\"byteOffset\":%llu,\"target\":34962},", uv_size, uv_offset);
-    str_append_cstr(&json, buf);
-    snprintf(buf, 1024, "{\"buffer\":0,\"byteLength\":%llu,\"byteOffset\":%llu,\"target\":34962},", color_size, color_offset);
-    str_append_cstr(&json, buf);
-    snprintf(buf, 1024, "{\"buffer\":0,\"byteLength\":%llu,\"byteOffset\":%llu,\"target\":34962},", weight_size, weight_offset);
-    str_append_cstr(&json, buf);
-    snprintf(buf, 1024, "{\"buffer\":0,\"byteLength\":%llu,\"byteOffset\":%llu,\"target\":34962},", joint_size, joint_offset);
-    str_append_cstr(&json, buf);
-    snprintf(buf, 1024, "{\"buffer\":0,\"byteLength\":%llu,\"byteOffset\":%llu,\"target\":34963}", indices_size, indices_offset);
+    for(size_t i = 0; i < attr_count; ++i) {
+        if(enc.compact) {
+            snprintf(buf, 1024, "{\"buffer\":%d,\"byteLength\":%llu,\"byteOffset\":%llu,\"byteStride\":%llu,\"target\":34962", meshopt, attr[i].size, attr[i].offset, attr[i].stride);
+        } else {
+            snprintf(buf, 1024, "{\"buffer\":%d,\"byteLength\":%llu,\"byteOffset\":%llu,\"target\":34962", meshopt, attr[i].size, attr[i].offset);
+        }
+        str_append_cstr(&json, buf);
+        if(meshopt) {
+            snprintf(buf, 1024, ",\"extensions\":{\"EXT_meshopt_compression\":{\"buffer\":0,\"byteLength\":%llu,\"byteOffset\":%llu,\"byteStride\":%llu,\"count\":%llu,\"mode\":\"ATTRIBUTES\"}}", packed[i].size, packed[i].offset, attr[i].stride, m->vertex_count);
+            str_append_cstr(&json, buf);
+        }
+        str_append_cstr(&json, "},");
+    }
+    snprintf(buf, 1024, "{\"buffer\":%d,\"byteLength\":%llu,\"byteOffset\":%llu,\"target\":34963", meshopt, indices_size, indices_offset);
     str_append_cstr(&json, buf);
+    if(meshopt) {
+        size_t index_size = enc.indices16 ? sizeof(uint16_t) : sizeof(uint32_t);
+        snprintf(buf, 1024, ",\"extensions\":{\"EXT_meshopt_compression\":{\"buffer\":0,\"byteLength\":%llu,\"byteOffset\":%llu,\"byteStride\":%llu,\"count\":%llu,\"mode\":\"%s\"}}", packed[attr_count].size, packed[attr_count].offset, index_size, indices_size / index_size, strip.length ? "INDICES" : "TRIANGLES");
+        str_append_cstr(&json, buf);
+    }
+    str_append_cstr(&json, "}");
+    if(has_ibm) {
+        snprintf(buf, 1024, ",{\"buffer\":0,\"byteLength\":%llu,\"byteOffset\":%llu}", m->bone_count * sizeof(float[16]), meshopt ? packed_ibm_offset : ibm_offset);
+        str_append_cstr(&json, buf);
+    }
     str_append_cstr(&json, "]");
     
-    //buffers
-    str_append_cstr(&json, ",\"buffers\":[{\"byteLength\":");
-    sprintf(buf,"%llu", bin.length);
-    str_append_cstr(&json, buf);
-    str_append_cstr(&json, "}]");
+    //buffers, the meshopt fallback has no data of its own
+    if(meshopt) {
+        snprintf(buf, 1024, ",\"buffers\":[{\"byteLength\":%llu},{\"byteLength\":%llu,\"extensions\":{\"EXT_meshopt_compression\":{\"fallback\":true}}}]", packed_length, bin_length);
+        str_append_cstr(&json, buf);
+    } else {
+        str_append_cstr(&json, ",\"buffers\":[{\"byteLength\":");
+        sprintf(buf,"%llu", bin_length);
+        str_append_cstr(&json, buf);
+        str_append_cstr(&json, "}]");
+    }
     
     str_append_cstr(&json, "}");
     
@@ -476,9 +952,10 @@ void save_glb(char *glb_filename, char *xtx_filename, Model *m) {
     jsonh.chunk_length = json.length + json_padding;
     glb_chunk_header binh;
     binh.chunk_type = GLB_CHUNK_TYPE_BIN;
-    size_t bin_padding = ((4 - (bin.length % 4)) % 4);
-    binh.chunk_length = bin.length + bin_padding;
-    glbh.length = sizeof(glb_file_header) + (2 * sizeof(glb_chunk_header)) + json.length + bin.length + json_padding + bin_padding;
+    size_t chunk_length = meshopt ? packed_length : bin_length;
+    size_t bin_padding = ((4 - (chunk_length % 4)) % 4);
+    binh.chunk_length = chunk_length + bin_padding;
+    glbh.length = sizeof(glb_file_header) + (2 * sizeof(glb_chunk_header)) + json.length + chunk_length + json_padding + bin_padding;
     
     fwrite(&glbh, sizeof(glb_file_header), 1, fp);
     fwrite(&jsonh, sizeof(glb_chunk_header), 1, fp);
@@ -486,13 +963,37 @@ void save_glb(char *glb_filename, char *xtx_filename, Model *m) {
     char json_padding_data[4] = "   ";
     fwrite(json_padding_data, 1, json_padding, fp);
     fwrite(&binh, sizeof(glb_chunk_header), 1, fp);
-    fwrite(bin.p, 1, bin.length, fp);
+    uint8_t zero[3] = {0};
+    bool written = true;
+    if(meshopt) {
+        for(size_t i = 0; i <= attr_count; ++i) {
+            fwrite(packed[i].data, 1, packed[i].size, fp);
+            size_t end = i < attr_count ? packed[i + 1].offset : packed_ibm_offset;
+            fwrite(zero, 1, end - packed[i].offset - packed[i].size, fp);
+        }
+    } else {
+        for(size_t i = 0; i < attr_count && written; ++i) written = glb_write_attribute(fp, m, attr[i].attr, attr[i].stride, &enc);
+        written = written && glb_write_indices(fp, m, &enc, &strip);
+        if(has_ibm) fwrite(zero, 1, ibm_offset - indices_offset - indices_size, fp);
+    }
+    if(has_ibm) {
+        // column major, q * extent + center
+        float *c = enc.center, e = enc.extent;
+        float ibm[16] = {e, 0, 0, 0, 0, e, 0, 0, 0, 0, e, 0, c[0], c[1], c[2], 1};
+        for(uint32_t i = 0; i < m->bone_count; ++i) fwrite(ibm, sizeof(ibm), 1, fp);
+    }
     uint8_t bin_padding_data[3] = {0, 0, 0};
     fwrite(bin_padding_data, 1, bin_padding, fp);
+    bool failed = ferror(fp) || !written;
     fclose(fp);
     str_cleanup(&json);
-    vector_cleanup(&bin);
     vector_cleanup(&mspanv);
+    vector_cleanup(&strip);
+    for(size_t i = 0; i <= attr_count; ++i) free(packed[i].data);
+    if(failed) {
+        printf("Failed to write file: \"%s\"\n", glb_filename);
+        return;
+    }
     printf("Wrote \"%s\"\n", glb_filename);
 }
 
@@ -503,9 +1004,11 @@ int main(int argc, char **argv) {
         return 0;
     }
     char *lex_file = NULL, *xtx_file = NULL, *jnt_file = NULL, *arx_file = NULL;
-    vector lex_files = vector_init(sizeof(char*));
+    mfile xtx_mf = {0}, jnt_mf = {0}, arx_mf = {0};
+    vector lex_files = vector_init(sizeof(mfile));
     bool flag_write = true;
     bool gltf_write = true;
+    bool arx_bench = false;
     for(int i = 0; i < 256; ++i) dbgflags[i] = false;
     for(int i = 1; i < argc; ++i) {
         if(argv[i][0] == '-') {
@@ -514,6 +1017,86 @@ int main(int argc, char **argv) {
                     flag_write = false;
                     break;
                 }
+                case 'b': {
+                    arx_bench = true;
+                    break;
+                }
+                case 'j': {
+                    options.threads = strtoul(&argv[i][2], NULL, 10);
+                    break;
+                }
+                case 'f': {
+                    options.png_fast = true;
+                    break;
+                }
+                case 't': {
+                    char *f = &argv[i][2];
+                    if(!strcmp(f, "png")) {
+                        options.tex_container = TEX_PNG;
+                    } else if(!strcmp(f, "ktx2")) {
+                        options.tex_container = TEX_KTX2;
+                    } else if(!strcmp(f, "dds")) {
+                        options.tex_container = TEX_DDS;
+                    } else {
+                        usage();
+                        return -1;
+                    }
+                    break;
+                }
+                case 'c': {
+                    char *f = &argv[i][2];
+                    if(!strcmp(f, "bc1")) {
+                        options.tex_format = TEX_FORMAT_BC1;
+                    } else if(!strcmp(f, "bc3")) {
+                        options.tex_format = TEX_FORMAT_BC3;
+                    } else if(!strcmp(f, "bc7")) {
+                        options.tex_format = TEX_FORMAT_BC7;
+                    } else {
+                        usage();
+                        return -1;
+                    }
+                    break;
+                }
+                case 'm': {
+                    char *f = &argv[i][2];
+                    if(!*f || !strcmp(f, "box")) {
+                        options.mip_filter = MIP_BOX;
+                    } else if(!strcmp(f, "kaiser")) {
+                        options.mip_filter = MIP_KAISER;
+                    } else {
+                        usage();
+                        return -1;
+                    }
+                    break;
+                }
+                case 'r': {
+                    options.tex_crop = true;
+                    break;
+                }
+                case 'z': {
+                    options.glb_compact = true;
+                    break;
+                }
+                case 'e': {
+                    options.glb_meshopt = true;
+                    break;
+                }
+                case 'o': {
+                    options.vcache = true;
+                    break;
+                }
+                case 'k': {
+                    options.glb_strips = true;
+                    break;
+                }
+                case 'q': {
+                    options.bc_quality = CLAMP(atoi(&argv[i][2]), BC_FAST, BC_BEST);
+                    break;
+                }
+                case 'p': {
+                    options.obj_precision = MIN(atoi(&argv[i][2]), 9);
+                    break;
+                }
                 case 'w': {
                     if(argv[i][2] == 'o') {
                         gltf_write = false;
@@ -535,18 +1118,20 @@ int main(int argc, char **argv) {
                 }
             }
         } else {
-            XenoFileEnum type = get_filetype(argv[i]);
+            mfile mf;
+            XenoFileEnum type = mfile_open(&mf, argv[i]) ? get_filetype(&mf) : FILE_ERROR;
             switch(type) {
                 case FILE_LEX: {
                     printf("LEX file \"%s\"\n", argv[i]);
                     if(!lex_file) lex_file = argv[i];
-                    vector_push(&lex_files, &argv[i]);
+                    vector_push(&lex_files, &mf);
                     break;
                 }
                 case FILE_XTX: {
                     printf("XTX file \"%s\"\n", argv[i]);
                     if(!xtx_file) {
                         xtx_file = argv[i];
+                        xtx_mf = mf;
                     } else {
                         puts("Multiple XTX files, exiting.");
                         return -1;
@@ -557,6 +1142,7 @@ int main(int argc, char **argv) {
                     printf("JNT file \"%s\"\n", argv[i]);
                     if(!jnt_file) {
                         jnt_file = argv[i];
+                        jnt_mf = mf;
                     } else {
                         puts("Multiple JNT files, exiting.");
                         return -1;
@@ -567,6 +1153,7 @@ int main(int argc, char **argv) {
                     printf("ARX file \"%s\"\n", argv[i]);
                     if(!arx_file) {
                         arx_file = argv[i];
+                        arx_mf = mf;
                     } else {
                         puts("Multiple ARX files, exiting.");
                         return -1;
@@ -579,18 +1166,24 @@ int main(int argc, char **argv) {
                 }
                 default: {
                     printf("Warning: Ignoring unknown file \"%s\"", argv[i]);
+                    mfile_close(&mf);
                 }
             }
         }
     };
+    if(!options.threads) options.threads = pool_cpu_count();
+    if((options.tex_format != TEX_FORMAT_RGBA8 || options.mip_filter != MIP_NONE) && options.tex_container == TEX_PNG) options.tex_container = TEX_DDS;
     int64_t ret = 0;
     Texture *tex = NULL;
     Model *model = NULL;
     void* arx_data = NULL;
+    // parse state for one file at a time, reset after each one
+    arena parse_arena = arena_init(1 << 20);
     if(xtx_file) {
         tex = malloc(sizeof(Texture));
         memset(tex, 0, sizeof(Texture));
-        ret = parse_xtx(xtx_file, tex);
+        ret = parse_xtx(&xtx_mf, tex, &parse_arena);
+        arena_reset(&parse_arena);
         if(ret) {
             printf("Failed to parse XTX file \"%s\".\n", xtx_file);
             goto END;
@@ -599,29 +1192,43 @@ int main(int argc, char **argv) {
     
     if(lex_files.length) {
         model = malloc(sizeof(Model));
-        model->mesh = vector_init(sizeof(Mesh));
-        model->vertex = vector_init(sizeof(Vertex));
-        model->material = vector_init(sizeof(Material));
-        model->bone = vector_init(sizeof(uint32_t));
-        model->bone_count = 0;
-        model->name[0] = 0;
+        model_init(model);
         for(size_t i = 0; i < lex_files.length; ++i) {
-            ret = parse_lex(((char**)lex_files.p)[i], model, tex);
+            mfile *lex_mf = &((mfile*)lex_files.p)[i];
+            ret = parse_lex(lex_mf, model, tex, &parse_arena);
+            arena_reset(&parse_arena);
             if(ret < 0) {
-                printf("Failed to parse LEX file \"%s\".\n", ((char**)lex_files.p)[i]);
+                printf("Failed to parse LEX file \"%s\".\n", lex_mf->name);
                 goto END;
             }
             printf("%lld tris\n", ret);
         }
     }
     
+    if(tex && options.tex_crop) {
+        if(!xtx_decode_regions(tex, model ? &model->material : NULL)) {
+            printf("Failed to decode XTX file \"%s\".\n", xtx_file);
+            ret = -1;
+            goto END;
+        }
+        if(model && (tex->crop_width != tex->width || tex->crop_height != tex->height)) {
+            model_crop_uv(model, (float)tex->width / tex->crop_width, (float)tex->height / tex->crop_height);
+        }
+    }
+    
+    if(model && options.vcache && !vcache_optimize(model)) {
+        ret = -1;
+        goto END;
+    }
+    
     size_t arx_size = 0;
     if(arx_file) {
-        arx_size = uncompress_arx(arx_file, &arx_data);
+        arx_size = uncompress_arx(&arx_mf, &arx_data);
         if(!arx_size) {
             printf("Failed to uncompress ARX file \"%s\".\n", arx_file);
             goto END;
         }
+        if(arx_bench) benchmark_arx(&arx_mf);
     }
     
     if(arx_file && flag_write) {
@@ -655,39 +1262,58 @@ int main(int argc, char **argv) {
     
     if(xtx_file && flag_write) {
         char filename[256];
-        snprintf(filename, 256, "%s_RGB.png", xtx_file);
-        save_image(filename, tex->width / 2, tex->height / 2, tex->rgb, true);
+        TextureContainer container = options.tex_container;
+        const char *ext = TEX_EXT(container);
+        snprintf(filename, 256, TEX_RGB_FMT, xtx_file, ext);
+        save_image(filename, tex->crop_width / 2, tex->crop_height / 2, tex->width / 2, tex->rgb, true, container);
         
-        snprintf(filename, 256, "%s_unswizzled.png", xtx_file);
-        save_image(filename, tex->width, tex->height, tex->unswizzled, false);
+        snprintf(filename, 256, "%s_unswizzled.%s", xtx_file, ext);
+        save_image(filename, tex->crop_width, tex->crop_height, tex->crop_width, tex->unswizzled, false, container);
         
-        if(model->material.length) {
-            RGBA *rgba = apply_palettes(tex->rgb, tex->unswizzled, tex->width, tex->height, &model->material);
-            snprintf(filename, 256, "%s_palette.png", xtx_file);
-            save_image(filename, tex->width, tex->height, rgba, true);
-            free(rgba);
+        RGBA *rgba = model->material.length ? apply_palettes(tex, &model->material) : NULL;
+        if(rgba) {
+            snprintf(filename, 256, TEX_PAL_FMT, xtx_file, ext);
+            save_palette_image(filename, tex, &model->material, rgba, container);
+        }
+        // the GLB links PNG copies of the textures it uses
+        container = glb_texture_container();
+        if(lex_files.length && gltf_write && container != options.tex_container) {
+            ext = TEX_EXT(container);
+            snprintf(filename, 256, TEX_RGB_FMT, xtx_file, ext);
+            save_image(filename, tex->crop_width / 2, tex->crop_height / 2, tex->width / 2, tex->rgb, true, container);
+            if(rgba) {
+                snprintf(filename, 256, TEX_PAL_FMT, xtx_file, ext);
+                save_palette_image(filename, tex, &model->material, rgba, container);
+            }
         }
+        free(rgba);
     }
     
     if(jnt_file) {
-        ret = parse_jnt(jnt_file);
+        ret = parse_jnt(&jnt_mf, &parse_arena);
+        arena_reset(&parse_arena);
         if(ret < 0) {
             printf("Failed to parse JNT file \"%s\".\n", jnt_file);
         }
     }
 END:
+    arena_cleanup(&parse_arena);
+    for(size_t i = 0; i < lex_files.length; ++i) mfile_close(&((mfile*)lex_files.p)[i]);
+    vector_cleanup(&lex_files);
+    mfile_close(&xtx_mf);
+    mfile_close(&jnt_mf);
+    mfile_close(&arx_mf);
     if(arx_data) {
         free(arx_data);
     }
     if(tex) {
+        free(tex->vram);
         free(tex->rgb);
         free(tex->unswizzled);
         free(tex);
     }
     if(model) {
-        vector_cleanup(&(model->material));
-        vector_cleanup(&(model->mesh));
-        vector_cleanup(&(model->vertex));
+        model_cleanup(model);
         free(model);
     }
     return ret;
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #include "vector.h"
+#include "hashidx.h"
 #include "lex_file.h"
 
 typedef enum {
@@ -64,10 +65,25 @@ typedef struct {
     uint32_t weight_format;
 } Mesh;
 
+// Vertex attributes, stored by Model as one stream each.
+// Element types: POSITION, NORMAL float[3], TEXCOORD float[2],
+// COLOR, WEIGHTS float[4], JOINTS int16_t[4].
+typedef enum {
+    ATTR_POSITION,
+    ATTR_NORMAL,
+    ATTR_TEXCOORD,
+    ATTR_COLOR,
+    ATTR_WEIGHTS,
+    ATTR_JOINTS,
+    ATTR_COUNT
+} VertexAttribute;
+
 typedef struct {
     vector mesh;
     vector material;
-    vector vertex;
+    vector attr[ATTR_COUNT]; // empty if no vertex has the attribute
+    size_t vertex_count;
+    hashidx vertex_index;
     vector bone;
     uint32_t bone_count;
     char name[33];
@@ -76,10 +92,72 @@ typedef struct {
 typedef struct {
     uint32_t width;
     uint32_t height;
+    uint8_t *vram; // emulated GS local memory the texture was uploaded to
     uint8_t *rgb;
     uint8_t *unswizzled;
     uint32_t max_x;
     uint32_t max_y;
+    uint32_t crop_width; // area that gets written, in palette texels
+    uint32_t crop_height;
 } Texture;
 
+// file format textures are written in
+typedef enum {
+    TEX_PNG,
+    TEX_KTX2,
+    TEX_DDS
+} TextureContainer;
+
+// pixel formats of written textures, the BC formats are 4x4 texel blocks
+typedef enum {
+    TEX_FORMAT_R8,
+    TEX_FORMAT_RGBA8,
+    TEX_FORMAT_BC1,
+    TEX_FORMAT_BC3,
+    TEX_FORMAT_BC7
+} TextureFormat;
+
+typedef enum {
+    BC_FAST,
+    BC_NORMAL,
+    BC_BEST
+} BCQuality;
+
+typedef enum {
+    MIP_NONE,
+    MIP_BOX,
+    MIP_KAISER
+} MipFilter;
+
+#define MIP_MAX_LEVELS 17
+
+// one mip level of a written texture, pixels or blocks in its format
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint8_t *data;
+} TexLevel;
+
+typedef struct {
+    size_t threads; // worker threads, 0 = one per CPU
+    int obj_precision; // decimals in OBJ/MTL output, -1 = shortest round trip
+    bool png_fast; // Up filter and run length only deflate
+    TextureContainer tex_container;
+    TextureFormat tex_format; // color textures, BC formats need KTX2 or DDS
+    BCQuality bc_quality;
+    MipFilter mip_filter; // mip chain for color textures, needs KTX2 or DDS
+    bool tex_crop; // decode and write only the texture area the materials use
+    bool glb_compact; // KHR_mesh_quantization and small index types in GLB output
+    bool glb_meshopt; // EXT_meshopt_compression buffers in GLB output
+    bool vcache; // vertex cache and fetch order for the triangles of each material
+    bool glb_strips; // TRIANGLE_STRIP primitives in GLB output
+} Options;
+
+// texture file names, formatted with the XTX file name and TEX_EXT
+#define TEX_RGB_FMT "%s_RGB.%s"
+#define TEX_PAL_FMT "%s_palette.%s"
+#define TEX_EXT(c) ((c) == TEX_KTX2 ? "ktx2" : (c) == TEX_DDS ? "dds" : "png")
+
+extern Options options;
+
 #endif
\ No newline at end of file
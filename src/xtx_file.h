@@ -28,7 +28,7 @@ typedef struct {
     XTXHeader header;
     XTXImgHeader *img_header;
     XTXImgHeader2 *img_header2;
-    uint8_t **img;
+    const uint8_t **img; // into the mapped file
 } XTXFile;
 
 #endif
\ No newline at end of file